@@ -34,8 +34,13 @@
 #include "prpl.h"
 #include "version.h"
 
+#include "matrix-api.h"
 #include "matrix-connection.h"
+#include "matrix-dormantroom.h"
 #include "matrix-room.h"
+#include "matrix-roomtier.h"
+#include "matrix-slidingsync.h"
+#include "matrix-sync.h"
 
 /**
  * Called to get the icon name for the given buddy and account.
@@ -134,6 +139,15 @@ static char *matrixprpl_get_chat_name(GHashTable *components)
 }
 
 
+/**
+ * Get the extra entries for the buddy list menu of a node
+ */
+static GList *matrixprpl_blist_node_menu(PurpleBlistNode *node)
+{
+    return matrix_roomtier_get_menu(node);
+}
+
+
 /**
  * Handle a double-click on a chat in the buddy list, or acceptance of a chat
  * invite: it is expected that we join the chat.
@@ -147,13 +161,16 @@ static void matrixprpl_join_chat(PurpleConnection *gc, GHashTable *components)
 
     conv = purple_find_chat(gc, chat_id);
 
-    if(!conv) {
+    if(!conv && matrix_dormantroom_exists(gc->proto_data, room)) {
+        /* we're in the room, but haven't shown it to the user until now */
+        conv = matrix_dormantroom_promote(gc, room);
+    } else if(!conv) {
         matrix_connection_join_room(gc, room, components);
         return;
     }
 
     /* already in chat. This happens when the account was disconnected,
-     * and has now been asked to reconnect.
+     * and has now been asked to reconnect, or the room was dormant.
      *
      * If we've got this far, chances are that we are correctly joined to
      * the room.
@@ -164,6 +181,13 @@ static void matrixprpl_join_chat(PurpleConnection *gc, GHashTable *components)
     if (!g_slist_find(gc->buddy_chats, conv))
             gc->buddy_chats = g_slist_append(gc->buddy_chats, conv);
     purple_conversation_update(conv, PURPLE_CONV_UPDATE_CHATLEFT);
+
+    /* the user is looking at the room, so make sure the user list is
+     * complete */
+    matrix_room_ensure_members_loaded(conv);
+
+    /* ... and, with sliding sync, that we get the full room state */
+    matrix_slidingsync_subscribe(gc->proto_data, room);
 }
 
 
@@ -255,7 +279,7 @@ static PurplePluginProtocolInfo prpl_info =
     NULL,                                  /* status_text */
     NULL,                                  /* tooltip_text */
     matrixprpl_status_types,               /* status_types */
-    NULL,                                  /* blist_node_menu */
+    matrixprpl_blist_node_menu,            /* blist_node_menu */
     matrixprpl_chat_info,                  /* chat_info */
     matrixprpl_chat_info_defaults,         /* chat_info_defaults */
     matrixprpl_login,                      /* login */
@@ -337,12 +361,60 @@ static void matrixprpl_init(PurplePlugin *plugin)
                     _("On reconnect, skip messages which were received in a "
                       "previous session"),
                     PRPL_ACCOUNT_OPT_SKIP_OLD_MESSAGES, FALSE));
+    protocol_options = g_list_append(protocol_options,
+            purple_account_option_bool_new(
+                    _("Only load room members when they are needed"),
+                    PRPL_ACCOUNT_OPT_LAZY_LOAD_MEMBERS, TRUE));
+    protocol_options = g_list_append(protocol_options,
+            purple_account_option_int_new(
+                    _("Longest time to wait for new events (seconds)"),
+                    PRPL_ACCOUNT_OPT_SYNC_TIMEOUT, DEFAULT_SYNC_TIMEOUT));
+    protocol_options = g_list_append(protocol_options,
+            purple_account_option_int_new(
+                    _("Shortest time between checks for new events "
+                      "(seconds)"),
+                    PRPL_ACCOUNT_OPT_SYNC_MIN_INTERVAL,
+                    DEFAULT_SYNC_MIN_INTERVAL));
+    protocol_options = g_list_append(protocol_options,
+            purple_account_option_bool_new(
+                    _("Use sliding sync"),
+                    PRPL_ACCOUNT_OPT_SLIDING_SYNC, FALSE));
+    protocol_options = g_list_append(protocol_options,
+            purple_account_option_bool_new(
+                    _("Split the first sync of large accounts into parallel "
+                      "requests"),
+                    PRPL_ACCOUNT_OPT_SHARDED_SYNC, TRUE));
 
     prpl_info.protocol_options = protocol_options;
+
+    matrix_sync_init();
 }
 
 static void matrixprpl_destroy(PurplePlugin *plugin) {
     purple_debug_info("matrixprpl", "shutting down\n");
+
+    /* the API worker thread is what feeds the sync threads, so stop it
+     * first */
+    matrix_api_shutdown();
+    matrix_sync_shutdown();
+}
+
+
+static void matrixprpl_show_sync_stats(PurplePluginAction *action)
+{
+    PurpleConnection *gc = action->context;
+
+    matrix_connection_show_sync_stats(gc);
+}
+
+
+static GList *matrixprpl_actions(PurplePlugin *plugin, gpointer context)
+{
+    GList *actions = NULL;
+
+    actions = g_list_append(actions, purple_plugin_action_new(
+            _("Show sync statistics"), matrixprpl_show_sync_stats));
+    return actions;
 }
 
 
@@ -369,7 +441,7 @@ static PurplePluginInfo info =
     NULL,                                                    /* ui_info */
     &prpl_info,                                              /* extra_info */
     NULL,                                                    /* prefs_info */
-    NULL,                                                    /* actions */
+    matrixprpl_actions,                                      /* actions */
     NULL,                                                    /* padding... */
     NULL,
     NULL,
@@ -98,6 +98,7 @@
 /* stub out the gettext macros for now */
 #define _(a) (a)
 #define N_(a) (a)
+#define ngettext(s, p, n) ((n) == 1 ? (s) : (p))
 
 /* data for our 'about' box */
 #define DISPLAY_VERSION "1.0"
@@ -113,11 +114,18 @@
  * share a namespace.
  */
 #define PRPL_ACCOUNT_OPT_HOME_SERVER "home_server"
-#define PRPL_ACCOUNT_OPT_NEXT_BATCH "next_batch"
+#define PRPL_ACCOUNT_OPT_NEXT_BATCH "next_batch"  /* old versions only */
 #define PRPL_ACCOUNT_OPT_SKIP_OLD_MESSAGES "skip_old_messages"
+#define PRPL_ACCOUNT_OPT_LAZY_LOAD_MEMBERS "lazy_load_members"
+#define PRPL_ACCOUNT_OPT_SYNC_TIMEOUT "sync_timeout"
+#define PRPL_ACCOUNT_OPT_SYNC_MIN_INTERVAL "sync_min_interval"
+#define PRPL_ACCOUNT_OPT_SLIDING_SYNC "sliding_sync"
+#define PRPL_ACCOUNT_OPT_SHARDED_SYNC "sharded_initial_sync"
 
 /* defaults for account options */
 #define DEFAULT_HOME_SERVER "https://matrix.org"
+#define DEFAULT_SYNC_TIMEOUT 90         /* seconds */
+#define DEFAULT_SYNC_MIN_INTERVAL 0     /* seconds */
 
 /* identifiers for the chat info / "components" */
 #define PRPL_CHAT_INFO_ROOM_ID "room_id"
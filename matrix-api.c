@@ -39,6 +39,18 @@ struct _MatrixApiRequestData {
     MatrixApiErrorCallback error_callback;
     MatrixApiBadResponseCallback bad_response_callback;
     gpointer user_data;
+
+    /* for requests whose response is parsed on a worker thread: see
+     * "Off-thread parsing" below */
+    MatrixApiPreprocessFunc preprocess;
+    GDestroyNotify preprocess_free;
+    MatrixApiPreprocessedCallback preprocessed_callback;
+
+    /* TRUE while the response is with the worker thread */
+    gboolean in_worker;
+
+    /* set if the request is cancelled while in_worker */
+    gboolean cancelled;
 };
 
 
@@ -104,6 +116,10 @@ typedef struct {
     gchar *content_type;
     gboolean got_headers;
     JsonParser *json_parser;
+
+    /* if non-NULL, the body is collected here instead of being parsed
+     * straight away */
+    GString *body;
 } MatrixApiResponseParserData;
 
 
@@ -115,7 +131,9 @@ static MatrixApiResponseParserData *_response_parser_data_new()
     res->current_header_name = g_string_new("");
     res->current_header_value = g_string_new("");
     res->content_type = NULL;
+    res->got_headers = FALSE;
     res->json_parser = json_parser_new();
+    res->body = NULL;
     return res;
 }
 
@@ -132,6 +150,8 @@ static void _response_parser_data_free(MatrixApiResponseParserData *data)
     /* free the JSON parser, and all of the node structures */
     if(data -> json_parser)
         g_object_unref(data -> json_parser);
+    if(data -> body)
+        g_string_free(data -> body, TRUE);
     g_free(data);
 }
 
@@ -212,7 +232,10 @@ static int _handle_body(http_parser *http_parser, const char *at,
         purple_debug_info("matrixprpl", "Handling API response body %.*s\n",
                 (int)length, at);
 
-    if(strcmp(response_data->content_type, "application/json") == 0) {
+    if(response_data->body != NULL) {
+        /* we'll parse it later */
+        g_string_append_len(response_data->body, at, length);
+    } else if(strcmp(response_data->content_type, "application/json") == 0) {
         if(!json_parser_load_from_data(response_data -> json_parser, at, length,
                 &err)) {
             purple_debug_info("matrixprpl", "unable to parse JSON: %s\n",
@@ -226,6 +249,224 @@ static int _handle_body(http_parser *http_parser, const char *at,
 
 
 
+/******************************************************************************
+ *
+ * Off-thread parsing
+ *
+ * For requests with a MatrixApiPreprocessFunc, we hand the body of the
+ * response to a worker thread, which parses the JSON and calls the preprocess
+ * function. The result is then passed back to the main loop via an idle
+ * callback.
+ *
+ * There is a single worker thread, so responses are handed back in the order
+ * they arrived. The worker thread is started when it is first needed, and
+ * stopped by matrix_api_shutdown when the plugin is unloaded.
+ *
+ * The results are picked up by an idle callback, so the UI must run a glib
+ * main loop (as pidgin and finch do).
+ */
+
+typedef struct {
+    MatrixApiRequestData *request;
+    int response_code;
+    gboolean is_json;
+    GString *body;
+
+    /* results from the worker */
+    JsonParser *json_parser;
+    gchar *parse_error;
+    gpointer preprocessed;
+} MatrixApiWorkerJob;
+
+static GThreadPool *_worker_pool = NULL;
+
+/* the jobs which the worker has finished with (oldest first), and the idle
+ * source which will hand them back to the main loop (or 0 if none is
+ * scheduled). Both are protected by _completed_lock. */
+G_LOCK_DEFINE_STATIC(_completed_lock);
+static GQueue _completed_jobs = G_QUEUE_INIT;
+static guint _completed_source = 0;
+
+
+static void _free_worker_job(MatrixApiWorkerJob *job)
+{
+    if(job->json_parser != NULL)
+        g_object_unref(job->json_parser);
+    g_string_free(job->body, TRUE);
+    g_free(job->parse_error);
+    g_free(job->request);
+    g_free(job);
+}
+
+
+/**
+ * Called on the main loop once the worker has finished with a response
+ */
+static void _worker_job_complete(MatrixApiWorkerJob *job)
+{
+    MatrixApiRequestData *data = job->request;
+    JsonNode *root = NULL;
+
+    if(data->cancelled) {
+        /* the error callback has already been called */
+        if(job->preprocessed != NULL && data->preprocess_free != NULL)
+            data->preprocess_free(job->preprocessed);
+    } else if(job->parse_error != NULL) {
+        purple_debug_info("matrixprpl", "unable to parse JSON: %s\n",
+                job->parse_error);
+        (data->error_callback)(data->conn, data->user_data,
+                _("Invalid response from homeserver"));
+    } else {
+        if(job->is_json)
+            root = json_parser_get_root(job->json_parser);
+
+        if(job->response_code >= 300) {
+            purple_debug_info("matrixprpl", "API gave response %i\n",
+                    job->response_code);
+            (data->bad_response_callback)(data->conn, data->user_data,
+                    job->response_code, root);
+        } else if (data->preprocessed_callback) {
+            (data->preprocessed_callback)(data->conn, data->user_data, root,
+                    job->preprocessed);
+        }
+    }
+
+    _free_worker_job(job);
+}
+
+
+/**
+ * Idle callback: hand the oldest completed job back to its caller
+ *
+ * @returns TRUE if there are more jobs waiting
+ */
+static gboolean _completed_jobs_cb(gpointer user_data)
+{
+    MatrixApiWorkerJob *job;
+    gboolean more;
+
+    G_LOCK(_completed_lock);
+    job = g_queue_pop_head(&_completed_jobs);
+    more = !g_queue_is_empty(&_completed_jobs);
+    if(!more)
+        _completed_source = 0;
+    G_UNLOCK(_completed_lock);
+
+    if(job != NULL)
+        _worker_job_complete(job);
+    return more;
+}
+
+
+/**
+ * Runs on the worker thread: parse the response and preprocess it.
+ *
+ * This must not touch anything except the job.
+ */
+static void _worker_job_run(gpointer job_data, gpointer pool_data)
+{
+    MatrixApiWorkerJob *job = job_data;
+    GError *err = NULL;
+
+    job->json_parser = json_parser_new();
+
+    if(job->is_json) {
+        if(!json_parser_load_from_data(job->json_parser, job->body->str,
+                job->body->len, &err)) {
+            job->parse_error = g_strdup(err->message);
+            g_error_free(err);
+        } else if(job->response_code < 300) {
+            JsonNode *root = json_parser_get_root(job->json_parser);
+            if(root != NULL)
+                job->preprocessed = job->request->preprocess(root);
+        }
+    }
+
+    G_LOCK(_completed_lock);
+    g_queue_push_tail(&_completed_jobs, job);
+    if(_completed_source == 0)
+        _completed_source = g_idle_add(_completed_jobs_cb, NULL);
+    G_UNLOCK(_completed_lock);
+}
+
+
+/**
+ * Pass a response over to the worker thread
+ *
+ * @returns FALSE if the worker thread could not be started
+ */
+static gboolean _start_worker_job(MatrixApiRequestData *data,
+        MatrixApiResponseParserData *response_data, int response_code)
+{
+    MatrixApiWorkerJob *job;
+    GError *err = NULL;
+
+    if(_worker_pool == NULL) {
+        _worker_pool = g_thread_pool_new(_worker_job_run, NULL, 1, FALSE,
+                &err);
+        if(_worker_pool == NULL) {
+            purple_debug_warning("matrixprpl",
+                    "unable to start worker thread: %s\n", err->message);
+            g_error_free(err);
+            return FALSE;
+        }
+    }
+
+    job = g_new0(MatrixApiWorkerJob, 1);
+    job->request = data;
+    job->response_code = response_code;
+    job->is_json = g_strcmp0(response_data->content_type,
+            "application/json") == 0;
+
+    /* take the body off the response data */
+    job->body = response_data->body;
+    response_data->body = NULL;
+
+    data->in_worker = TRUE;
+    g_thread_pool_push(_worker_pool, job, NULL);
+    return TRUE;
+}
+
+
+/**
+ * Parse a response on the main thread, for requests which would normally use
+ * the worker thread, but where it could not be started.
+ */
+static void _worker_job_fallback(MatrixApiRequestData *data,
+        MatrixApiResponseParserData *response_data, int response_code)
+{
+    MatrixApiWorkerJob job = {data, response_code, FALSE, NULL, NULL, NULL,
+            NULL};
+    GError *err = NULL;
+    JsonNode *root = NULL;
+
+    if(g_strcmp0(response_data->content_type, "application/json") == 0) {
+        if(!json_parser_load_from_data(response_data->json_parser,
+                response_data->body->str, response_data->body->len, &err)) {
+            purple_debug_info("matrixprpl", "unable to parse JSON: %s\n",
+                    err->message);
+            g_error_free(err);
+            (data->error_callback)(data->conn, data->user_data,
+                    _("Invalid response from homeserver"));
+            return;
+        }
+        root = json_parser_get_root(response_data->json_parser);
+    }
+
+    if(response_code >= 300) {
+        (data->bad_response_callback)(data->conn, data->user_data,
+                response_code, root);
+        return;
+    }
+
+    if(root != NULL)
+        job.preprocessed = data->preprocess(root);
+    if(data->preprocessed_callback)
+        (data->preprocessed_callback)(data->conn, data->user_data, root,
+                job.preprocessed);
+}
+
+
 /**
  * The callback we give to purple_util_fetch_url_request - does some
  * initial processing of the response
@@ -257,6 +498,8 @@ static void matrix_api_complete(PurpleUtilFetchUrlData *url_data,
         memset(&http_parser_settings, 0, sizeof(http_parser_settings));
 
         response_data = _response_parser_data_new();
+        if(data->preprocess != NULL)
+            response_data->body = g_string_new(NULL);
 
         http_parser_settings.on_header_field = _handle_header_field;
         http_parser_settings.on_header_value = _handle_header_value;
@@ -292,6 +535,21 @@ static void matrix_api_complete(PurpleUtilFetchUrlData *url_data,
         }
     }
 
+    /* the fetch is complete, so we mustn't try to cancel it */
+    data->purple_data = NULL;
+
+    if(!error_message && data->preprocess != NULL) {
+        if(_start_worker_job(data, response_data, response_code)) {
+            /* the worker now owns data */
+            _response_parser_data_free(response_data);
+            return;
+        }
+        _worker_job_fallback(data, response_data, response_code);
+        _response_parser_data_free(response_data);
+        g_free(data);
+        return;
+    }
+
     if(!error_message) {
         root = json_parser_get_root(response_data -> json_parser);
     }
@@ -520,6 +778,30 @@ static MatrixApiRequestData *matrix_api_start(const gchar *url,
 }
 
 
+void matrix_api_shutdown(void)
+{
+    MatrixApiWorkerJob *job;
+
+    /* let the worker finish whatever it has in hand */
+    if(_worker_pool != NULL)
+        g_thread_pool_free(_worker_pool, FALSE, TRUE);
+    _worker_pool = NULL;
+
+    /* the connections have all gone by now, so there is nobody to hand the
+     * results back to */
+    G_LOCK(_completed_lock);
+    if(_completed_source != 0)
+        g_source_remove(_completed_source);
+    _completed_source = 0;
+    while((job = g_queue_pop_head(&_completed_jobs)) != NULL) {
+        if(job->preprocessed != NULL && job->request->preprocess_free != NULL)
+            job->request->preprocess_free(job->preprocessed);
+        _free_worker_job(job);
+    }
+    G_UNLOCK(_completed_lock);
+}
+
+
 void matrix_api_cancel(MatrixApiRequestData *data)
 {
     if(data -> purple_data != NULL)
@@ -527,11 +809,25 @@ void matrix_api_cancel(MatrixApiRequestData *data)
     data -> purple_data = NULL;
     (data->error_callback)(data->conn, data->user_data, "cancelled");
 
+    if(data -> in_worker) {
+        /* the worker still has a pointer to this; it will be freed when the
+         * worker is done with it */
+        data -> cancelled = TRUE;
+        return;
+    }
+
     g_free(data);
 }
 
 
-gchar *_build_login_body(const gchar *username, const gchar *password)
+gboolean matrix_api_request_has_response(MatrixApiRequestData *data)
+{
+    return data -> in_worker;
+}
+
+
+gchar *_build_login_body(const gchar *username, const gchar *password,
+        const gchar *device_id)
 {
     JsonObject *body;
     JsonNode *node;
@@ -542,6 +838,8 @@ gchar *_build_login_body(const gchar *username, const gchar *password)
     json_object_set_string_member(body, "type", "m.login.password");
     json_object_set_string_member(body, "user", username);
     json_object_set_string_member(body, "password", password);
+    if(device_id != NULL)
+        json_object_set_string_member(body, "device_id", device_id);
 	
     node = json_node_new(JSON_NODE_OBJECT);
     json_node_set_object(node, body);
@@ -558,6 +856,7 @@ gchar *_build_login_body(const gchar *username, const gchar *password)
 MatrixApiRequestData *matrix_api_password_login(MatrixConnectionData *conn,
         const gchar *username,
         const gchar *password,
+        const gchar *device_id,
         MatrixApiCallback callback,
         gpointer user_data)
 {
@@ -571,7 +870,7 @@ MatrixApiRequestData *matrix_api_password_login(MatrixConnectionData *conn,
     url = g_strconcat(conn->homeserver, "_matrix/client/api/v1/login",
             NULL);
 
-    json = _build_login_body(username, password);
+    json = _build_login_body(username, password, device_id);
 
     fetch_data = matrix_api_start(url, "POST", "", json, NULL, 0, conn,
                                   callback, NULL, NULL, user_data, 0);
@@ -584,7 +883,10 @@ MatrixApiRequestData *matrix_api_password_login(MatrixConnectionData *conn,
 
 MatrixApiRequestData *matrix_api_sync(MatrixConnectionData *conn,
         const gchar *since, int timeout, gboolean full_state,
-        MatrixApiCallback callback,
+        const gchar *filter,
+        MatrixApiPreprocessFunc preprocess,
+        GDestroyNotify preprocess_free,
+        MatrixApiPreprocessedCallback callback,
         MatrixApiErrorCallback error_callback,
         MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data)
@@ -603,6 +905,9 @@ MatrixApiRequestData *matrix_api_sync(MatrixConnectionData *conn,
     if(full_state)
         g_string_append(url, "&full_state=true");
 
+    if(filter != NULL)
+        g_string_append_printf(url, "&filter=%s", purple_url_encode(filter));
+
     purple_debug_info("matrixprpl", "syncing %s since %s (full_state=%i)\n",
                 conn->pc->account->username, since, full_state);
 
@@ -610,10 +915,70 @@ MatrixApiRequestData *matrix_api_sync(MatrixConnectionData *conn,
      * memory? But it's JSON
      */
     fetch_data = matrix_api_start(url->str, "GET", "", NULL, NULL, 0, conn,
-            callback, error_callback, bad_response_callback, user_data,
+            NULL, error_callback, bad_response_callback, user_data,
             10*1024*1024);
     g_string_free(url, TRUE);
-    
+
+    if(fetch_data != NULL) {
+        fetch_data->preprocess = preprocess;
+        fetch_data->preprocess_free = preprocess_free;
+        fetch_data->preprocessed_callback = callback;
+    }
+
+    return fetch_data;
+}
+
+
+MatrixApiRequestData *matrix_api_sliding_sync(MatrixConnectionData *conn,
+        const gchar *pos, int timeout, JsonObject *request,
+        MatrixApiPreprocessFunc preprocess,
+        GDestroyNotify preprocess_free,
+        MatrixApiPreprocessedCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data)
+{
+    GString *url;
+    MatrixApiRequestData *fetch_data;
+    JsonNode *body_node;
+    JsonGenerator *generator;
+    gchar *json;
+
+    url = g_string_new(conn->homeserver);
+    g_string_append_printf(url,
+            "_matrix/client/unstable/org.matrix.msc3575/sync?timeout=%i",
+            timeout);
+
+    if(pos != NULL)
+        g_string_append_printf(url, "&pos=%s", purple_url_encode(pos));
+
+    g_string_append(url, "&access_token=");
+    g_string_append(url, purple_url_encode(conn->access_token));
+
+    body_node = json_node_new(JSON_NODE_OBJECT);
+    json_node_set_object(body_node, request);
+
+    generator = json_generator_new();
+    json_generator_set_root(generator, body_node);
+    json = json_generator_to_data(generator, NULL);
+    g_object_unref(G_OBJECT(generator));
+    json_node_free(body_node);
+
+    purple_debug_info("matrixprpl", "sliding sync %s from %s\n",
+            conn->pc->account->username, pos);
+
+    fetch_data = matrix_api_start(url->str, "POST", "", json, NULL, 0, conn,
+            NULL, error_callback, bad_response_callback, user_data,
+            10*1024*1024);
+    g_free(json);
+    g_string_free(url, TRUE);
+
+    if(fetch_data != NULL) {
+        fetch_data->preprocess = preprocess;
+        fetch_data->preprocess_free = preprocess_free;
+        fetch_data->preprocessed_callback = callback;
+    }
+
     return fetch_data;
 }
 
@@ -755,27 +1120,153 @@ MatrixApiRequestData *matrix_api_upload_file(MatrixConnectionData *conn,
     return fetch_data;
 }
 
-#if 0
+MatrixApiRequestData *matrix_api_get_room_members(MatrixConnectionData *conn,
+        const gchar *room_id,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data)
+{
+    GString *url;
+    MatrixApiRequestData *fetch_data;
+
+    url = g_string_new(conn->homeserver);
+    g_string_append(url, "_matrix/client/r0/rooms/");
+    g_string_append(url, purple_url_encode(room_id));
+    g_string_append(url, "/members?not_membership=leave&access_token=");
+    g_string_append(url, purple_url_encode(conn->access_token));
+
+    purple_debug_info("matrixprpl", "getting members for %s\n", room_id);
+
+    fetch_data = matrix_api_start(url->str, "GET", "", NULL, NULL, 0, conn,
+            callback, error_callback, bad_response_callback, user_data,
+            10*1024*1024);
+    g_string_free(url, TRUE);
+
+    return fetch_data;
+}
+
+
+MatrixApiRequestData *matrix_api_get_room_messages(MatrixConnectionData *conn,
+        const gchar *room_id, const gchar *from, const gchar *to, int limit,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data)
+{
+    GString *url;
+    MatrixApiRequestData *fetch_data;
+
+    url = g_string_new(conn->homeserver);
+    g_string_append(url, "_matrix/client/r0/rooms/");
+    g_string_append(url, purple_url_encode(room_id));
+    g_string_append(url, "/messages?dir=b");
+    if(from != NULL) {
+        g_string_append(url, "&from=");
+        g_string_append(url, purple_url_encode(from));
+    }
+    if(to != NULL) {
+        g_string_append(url, "&to=");
+        g_string_append(url, purple_url_encode(to));
+    }
+    g_string_append_printf(url, "&limit=%i&access_token=", limit);
+    g_string_append(url, purple_url_encode(conn->access_token));
+
+    purple_debug_info("matrixprpl", "getting messages for %s from %s\n",
+            room_id, from == NULL ? "the end" : from);
+
+    fetch_data = matrix_api_start(url->str, "GET", "", NULL, NULL, 0, conn,
+            callback, error_callback, bad_response_callback, user_data,
+            10*1024*1024);
+    g_string_free(url, TRUE);
+
+    return fetch_data;
+}
+
+MatrixApiRequestData *matrix_api_get_joined_rooms(MatrixConnectionData *conn,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data)
+{
+    GString *url;
+    MatrixApiRequestData *fetch_data;
+
+    url = g_string_new(conn->homeserver);
+    g_string_append(url, "_matrix/client/r0/joined_rooms?access_token=");
+    g_string_append(url, purple_url_encode(conn->access_token));
+
+    purple_debug_info("matrixprpl", "getting joined rooms\n");
+
+    fetch_data = matrix_api_start(url->str, "GET", "", NULL, NULL, 0, conn,
+            callback, error_callback, bad_response_callback, user_data,
+            10*1024*1024);
+    g_string_free(url, TRUE);
+
+    return fetch_data;
+}
+
+
+MatrixApiRequestData *matrix_api_create_filter(MatrixConnectionData *conn,
+        JsonObject *filter,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data)
+{
+    GString *url;
+    MatrixApiRequestData *fetch_data;
+    JsonNode *body_node;
+    JsonGenerator *generator;
+    gchar *json;
+
+    url = g_string_new(conn->homeserver);
+    g_string_append(url, "_matrix/client/r0/user/");
+    g_string_append(url, purple_url_encode(conn->user_id));
+    g_string_append(url, "/filter?access_token=");
+    g_string_append(url, purple_url_encode(conn->access_token));
+
+    body_node = json_node_new(JSON_NODE_OBJECT);
+    json_node_set_object(body_node, filter);
+
+    generator = json_generator_new();
+    json_generator_set_root(generator, body_node);
+    json = json_generator_to_data(generator, NULL);
+    g_object_unref(G_OBJECT(generator));
+    json_node_free(body_node);
+
+    purple_debug_info("matrixprpl", "creating filter\n");
+
+    fetch_data = matrix_api_start(url->str, "POST", "", json, NULL, 0, conn,
+            callback, error_callback, bad_response_callback, user_data, 0);
+    g_free(json);
+    g_string_free(url, TRUE);
+
+    return fetch_data;
+}
+
 MatrixApiRequestData *matrix_api_get_room_state(MatrixConnectionData *conn,
         const gchar *room_id,
         MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data)
 {
     GString *url;
     MatrixApiRequestData *fetch_data;
 
     url = g_string_new(conn->homeserver);
-    g_string_append(url, "/_matrix/client/r0/rooms/");
+    g_string_append(url, "_matrix/client/r0/rooms/");
     g_string_append(url, purple_url_encode(room_id));
     g_string_append(url, "/state?access_token=");
     g_string_append(url, purple_url_encode(conn->access_token));
 
     purple_debug_info("matrixprpl", "getting state for %s\n", room_id);
 
-    fetch_data = matrix_api_start(url->str, NULL, NULL, NULL, conn, callback,
-            NULL, NULL, user_data, 10*1024*1024);
+    fetch_data = matrix_api_start(url->str, "GET", "", NULL, NULL, 0, conn,
+            callback, error_callback, bad_response_callback, user_data,
+            10*1024*1024);
     g_string_free(url, TRUE);
 
     return fetch_data;
 }
-#endif
@@ -103,6 +103,41 @@ void matrix_api_bad_response(MatrixConnectionData *ma, gpointer user_data,
         int http_response_code, struct _JsonNode *json_root);
 
 
+/**
+ * Signature for functions which do some initial processing of a successful
+ * response on a worker thread, before it is handed back to the main thread.
+ *
+ * These functions must not call into libpurple (not even for debug logging),
+ * nor retain any pointers into json_root once they return, except for
+ * references they have taken themselves.
+ *
+ * @param json_root     NULL if there was no body, or it could not be
+ *                          parsed as JSON; otherwise the root of the JSON
+ *                          tree in the response
+ *
+ * @returns an opaque result, which is passed to the
+ *     MatrixApiPreprocessedCallback
+ */
+typedef gpointer (*MatrixApiPreprocessFunc)(struct _JsonNode *json_root);
+
+/**
+ * Signature for the callback for requests whose response was processed by a
+ * MatrixApiPreprocessFunc.
+ *
+ * @param conn          The MatrixConnectionData passed into the api method
+ * @param user_data     The user data that your code passed into the api
+ *                      method.
+ * @param json_root     NULL if there was no body, or it could not be
+ *                          parsed as JSON; otherwise the root of the JSON
+ *                          tree in the response
+ * @param preprocessed  The result of the MatrixApiPreprocessFunc (NULL if
+ *                          json_root is NULL). The callback takes ownership.
+ */
+typedef void (*MatrixApiPreprocessedCallback)(MatrixConnectionData *conn,
+        gpointer user_data, struct _JsonNode *json_root,
+        gpointer preprocessed);
+
+
 
 
 
@@ -114,6 +149,20 @@ void matrix_api_bad_response(MatrixConnectionData *ma, gpointer user_data,
  */
 void matrix_api_cancel(MatrixApiRequestData *request);
 
+/**
+ * Stop the thread which parses responses, and throw away any results it has
+ * not yet handed back. Called when the plugin is unloaded, after all of the
+ * connections have been closed.
+ */
+void matrix_api_shutdown(void);
+
+
+/**
+ * Check if the response to a request has arrived, and is being processed
+ * (see MatrixApiPreprocessFunc).
+ */
+gboolean matrix_api_request_has_response(MatrixApiRequestData *request);
+
 
 /**
  * call the /login API
@@ -121,12 +170,15 @@ void matrix_api_cancel(MatrixApiRequestData *request);
  * @param conn       The connection with which to make the request
  * @param username   user id to pass in request
  * @param password   password to pass in request
+ * @param device_id  If non-null, the id of an existing device to log in as
+ *                      (so that the server doesn't create a new one)
  * @param callback   Function to be called when the request completes
  * @param user_data  Opaque data to be passed to the callback
  */
 MatrixApiRequestData *matrix_api_password_login(MatrixConnectionData *conn,
         const gchar *username,
         const gchar *password,
+        const gchar *device_id,
         MatrixApiCallback callback,
         gpointer user_data);
 
@@ -140,6 +192,13 @@ MatrixApiRequestData *matrix_api_password_login(MatrixConnectionData *conn,
  *                      no events
  * @param full_state       If true, will do a full state sync instead of an
  *                             incremental sync
+ * @param filter           If non-null, a JSON-encoded filter definition to
+ *                             apply to the sync
+ * @param preprocess       Function to be called on a worker thread once the
+ *                             response has been parsed
+ * @param preprocess_free  Function to free the result of preprocess, in case
+ *                             the request is cancelled before callback is
+ *                             called
  * @param callback         Function to be called when the request completes
  * @param error_callback   Function to be called if there is an error making
  *                             the request. If NULL, matrix_api_error will be
@@ -148,10 +207,38 @@ MatrixApiRequestData *matrix_api_password_login(MatrixConnectionData *conn,
  *                            response. If NULL, matrix_api_bad_response will be
  *                            used.
  * @param user_data  Opaque data to be passed to the callback
+ *
+ * Sync responses can be large, so the JSON is parsed on a worker thread, and
+ * the callbacks are called from the main loop once that is done.
  */
 MatrixApiRequestData *matrix_api_sync(MatrixConnectionData *conn,
         const gchar *since, int timeout, gboolean full_state,
-        MatrixApiCallback callback,
+        const gchar *filter,
+        MatrixApiPreprocessFunc preprocess,
+        GDestroyNotify preprocess_free,
+        MatrixApiPreprocessedCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data);
+
+
+/**
+ * call the sliding sync API (MSC3575)
+ *
+ * @param conn       The connection with which to make the request
+ * @param pos        If non-null, the position token from the previous response
+ * @param timeout    Number of milliseconds after which the API will time out if
+ *                      no events
+ * @param request    The body of the request (lists and room subscriptions)
+ *
+ * The other parameters are as for matrix_api_sync; as there, the response is
+ * parsed on a worker thread.
+ */
+MatrixApiRequestData *matrix_api_sliding_sync(MatrixConnectionData *conn,
+        const gchar *pos, int timeout, struct _JsonObject *request,
+        MatrixApiPreprocessFunc preprocess,
+        GDestroyNotify preprocess_free,
+        MatrixApiPreprocessedCallback callback,
         MatrixApiErrorCallback error_callback,
         MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data);
@@ -249,19 +336,118 @@ MatrixApiRequestData *matrix_api_upload_file(MatrixConnectionData *conn,
         gpointer user_data);
 
 
-#if 0
+/**
+ * Get the list of members of a room
+ *
+ * @param conn             The connection with which to make the request
+ * @param room_id          The room to get the members of
+ * @param callback         Function to be called when the request completes
+ * @param error_callback   Function to be called if there is an error making
+ *                             the request. If NULL, matrix_api_error will be
+ *                             used.
+ * @param bad_response_callback Function to be called if the API gives a non-200
+ *                            response. If NULL, matrix_api_bad_response will be
+ *                            used.
+ * @param user_data        Opaque data to be passed to the callbacks
+ */
+MatrixApiRequestData *matrix_api_get_room_members(MatrixConnectionData *conn,
+        const gchar *room_id,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data);
+
+
+/**
+ * Get a page of the events in a room, going backwards in time
+ *
+ * @param conn             The connection with which to make the request
+ * @param room_id          The room to get the events for
+ * @param from             Pagination token to start from (eg the prev_batch
+ *                             from a /sync), or NULL to start from the most
+ *                             recent event
+ * @param to               If non-null, pagination token to stop at
+ * @param limit            Maximum number of events to return
+ * @param callback         Function to be called when the request completes
+ * @param error_callback   Function to be called if there is an error making
+ *                             the request. If NULL, matrix_api_error will be
+ *                             used.
+ * @param bad_response_callback Function to be called if the API gives a non-200
+ *                            response. If NULL, matrix_api_bad_response will be
+ *                            used.
+ * @param user_data        Opaque data to be passed to the callbacks
+ */
+MatrixApiRequestData *matrix_api_get_room_messages(MatrixConnectionData *conn,
+        const gchar *room_id, const gchar *from, const gchar *to, int limit,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data);
+
+
+/**
+ * Get the list of rooms the user has joined
+ *
+ * @param conn             The connection with which to make the request
+ * @param callback         Function to be called when the request completes
+ * @param error_callback   Function to be called if there is an error making
+ *                             the request. If NULL, matrix_api_error will be
+ *                             used.
+ * @param bad_response_callback Function to be called if the API gives a non-200
+ *                            response. If NULL, matrix_api_bad_response will be
+ *                            used.
+ * @param user_data        Opaque data to be passed to the callbacks
+ */
+MatrixApiRequestData *matrix_api_get_joined_rooms(MatrixConnectionData *conn,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data);
+
+
+/**
+ * Upload a filter definition, so that it can be referred to by its id in
+ * later calls to matrix_api_sync. (Filters which list a lot of rooms are too
+ * big to go in the url.)
+ *
+ * @param conn             The connection with which to make the request
+ * @param filter           The filter definition
+ * @param callback         Function to be called when the request completes
+ * @param error_callback   Function to be called if there is an error making
+ *                             the request. If NULL, matrix_api_error will be
+ *                             used.
+ * @param bad_response_callback Function to be called if the API gives a non-200
+ *                            response. If NULL, matrix_api_bad_response will be
+ *                            used.
+ * @param user_data        Opaque data to be passed to the callbacks
+ */
+MatrixApiRequestData *matrix_api_create_filter(MatrixConnectionData *conn,
+        struct _JsonObject *filter,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data);
+
+
 /**
  * Get the current state of a room
  *
  * @param conn             The connection with which to make the request
  * @param room_id          The room to get state for
  * @param callback         Function to be called when the request completes
+ * @param error_callback   Function to be called if there is an error making
+ *                             the request. If NULL, matrix_api_error will be
+ *                             used.
+ * @param bad_response_callback Function to be called if the API gives a non-200
+ *                            response. If NULL, matrix_api_bad_response will be
+ *                            used.
  * @param user_data        Opaque data to be passed to the callbacks
  */
 MatrixApiRequestData *matrix_api_get_room_state(MatrixConnectionData *conn,
         const gchar *room_id,
         MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data);
-#endif
 
 #endif
@@ -0,0 +1,390 @@
+/**
+ * matrix-backfill.c: filling in gaps in the timeline of a room
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-backfill.h"
+
+#include <string.h>
+#include <time.h>
+
+/* libpurple */
+#include "connection.h"
+#include "conversation.h"
+#include "debug.h"
+
+/* libmatrix */
+#include "libmatrix.h"
+#include "matrix-api.h"
+#include "matrix-json.h"
+#include "matrix-room.h"
+#include "matrix-roomregistry.h"
+#include "matrix-seenevents.h"
+
+/* identifier for purple_conversation_get/set_data: a MatrixBackfill * */
+#define PURPLE_CONV_DATA_BACKFILL "backfill"
+
+/* the number of events we ask for in each request */
+#define BACKFILL_PAGE_SIZE 50
+
+/* the most pages we will fetch for one gap. Beyond that, we give up and tell
+ * the user that they have missed some messages. */
+#define BACKFILL_MAX_PAGES 10
+
+/* the most /messages requests we will have in progress at once, per
+ * connection */
+#define BACKFILL_MAX_ACTIVE 4
+
+
+typedef struct _MatrixBackfill {
+    PurpleConversation *conv;
+
+    /* pagination tokens: where the next request starts, and where the gap
+     * ends */
+    gchar *from;
+    gchar *to;
+    guint pages;
+
+    /* the events we have fetched so far (JsonObject *s, oldest first) */
+    GList *events;
+
+    /* newer events which are waiting for the backfill to complete
+     * (JsonObject *s, oldest first) */
+    GQueue deferred;
+
+    /* the active request, if any */
+    MatrixApiRequestData *request;
+
+    /* TRUE if we are waiting in conn->backfill_queue for a free slot */
+    gboolean queued;
+} MatrixBackfill;
+
+
+static void _fetch_page(MatrixBackfill *backfill);
+
+
+static MatrixConnectionData *_get_connection_data(MatrixBackfill *backfill)
+{
+    return purple_connection_get_protocol_data(
+            purple_conversation_get_gc(backfill->conv));
+}
+
+
+static MatrixBackfill *_get_backfill(PurpleConversation *conv)
+{
+    return purple_conversation_get_data(conv, PURPLE_CONV_DATA_BACKFILL);
+}
+
+
+/**
+ * Start the backfill if there is a free slot; otherwise add it to the queue
+ */
+static void _start_or_queue(MatrixBackfill *backfill)
+{
+    MatrixConnectionData *conn = _get_connection_data(backfill);
+
+    if(conn->backfills_active >= BACKFILL_MAX_ACTIVE) {
+        backfill->queued = TRUE;
+        g_queue_push_tail(&conn->backfill_queue, backfill);
+        return;
+    }
+
+    conn->backfills_active++;
+    _fetch_page(backfill);
+}
+
+
+/**
+ * A backfill has finished with its slot: start the next one in the queue
+ */
+static void _release_slot(MatrixConnectionData *conn)
+{
+    MatrixBackfill *next;
+
+    conn->backfills_active--;
+
+    next = g_queue_pop_head(&conn->backfill_queue);
+    if(next != NULL) {
+        next->queued = FALSE;
+        conn->backfills_active++;
+        _fetch_page(next);
+    }
+}
+
+
+/**
+ * Show a list of events
+ *
+ * @param backfilled  TRUE if these are the events we fetched, rather than the
+ *                    newer ones from the sync
+ */
+static void _show_events(PurpleConversation *conv, GList *events,
+        gboolean backfilled)
+{
+    GList *elem;
+
+    for(elem = events; elem != NULL; elem = elem->next) {
+        JsonObject *event_obj = elem->data;
+
+        /* the room state we have is already more recent than anything in the
+         * gap, so we only want the messages */
+        if(json_object_has_member(event_obj, "state_key"))
+            continue;
+        if(backfilled)
+            matrix_room_handle_backfilled_event(conv, event_obj);
+        else
+            matrix_room_handle_timeline_event(conv, event_obj);
+    }
+}
+
+
+/**
+ * Throw away the events we have fetched so far. We don't want to show a
+ * partial backfill, since it would leave a gap in the middle.
+ */
+static void _drop_fetched(MatrixBackfill *backfill)
+{
+    GList *fetched = backfill->events;
+
+    backfill->events = NULL;
+    g_list_free_full(fetched, (GDestroyNotify) json_object_unref);
+}
+
+
+/**
+ * Finish off a backfill, and free it
+ *
+ * @param show   TRUE to display the events we have collected
+ */
+static void _finish_backfill(MatrixBackfill *backfill, gboolean show)
+{
+    PurpleConversation *conv = backfill->conv;
+    MatrixConnectionData *conn = _get_connection_data(backfill);
+
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_BACKFILL, NULL);
+
+    if(backfill->queued)
+        g_queue_remove(&conn->backfill_queue, backfill);
+    else
+        _release_slot(conn);
+
+    if(show) {
+        _show_events(conv, backfill->events, TRUE);
+        _show_events(conv, backfill->deferred.head, FALSE);
+    }
+
+    g_list_free_full(backfill->events, (GDestroyNotify) json_object_unref);
+    g_list_free_full(backfill->deferred.head,
+            (GDestroyNotify) json_object_unref);
+    g_free(backfill->from);
+    g_free(backfill->to);
+    g_free(backfill);
+}
+
+
+/**
+ * Give up on a backfill which has failed, or gone on too long: tell the user
+ * about the gap, and show only the newer events
+ */
+static void _abandon_backfill(MatrixBackfill *backfill)
+{
+    _drop_fetched(backfill);
+    purple_conversation_write(backfill->conv, NULL,
+            _("Some older messages in this room were not retrieved."),
+            PURPLE_MESSAGE_SYSTEM, time(NULL));
+    _finish_backfill(backfill, TRUE);
+}
+
+
+static void _messages_complete(MatrixConnectionData *conn,
+        gpointer user_data, JsonNode *json_root)
+{
+    MatrixBackfill *backfill = user_data;
+    PurpleConversation *conv = backfill->conv;
+    JsonObject *root_obj;
+    JsonArray *chunk;
+    const gchar *end;
+    guint i, len;
+
+    backfill->request = NULL;
+    backfill->pages++;
+
+    root_obj = matrix_json_node_get_object(json_root);
+    chunk = matrix_json_object_get_array_member(root_obj, "chunk");
+    end = matrix_json_object_get_string_member(root_obj, "end");
+    len = chunk == NULL ? 0 : json_array_get_length(chunk);
+
+    purple_debug_info("matrixprpl", "got %u missed events for %s\n", len,
+            conv->name);
+
+    /* the chunk is newest first. If we get back to an event we have already
+     * shown, the gap is filled: anything older would be shown out of order.
+     * (This happens after a sharded initial sync, for instance.) */
+    for(i = 0; i < len; i++) {
+        JsonObject *event_obj = matrix_json_node_get_object(
+                json_array_get_element(chunk, i));
+        if(event_obj == NULL)
+            continue;
+        if(matrix_seenevents_contains(conn, conv->name,
+                matrix_json_object_get_string_member(event_obj, "event_id")))
+            break;
+        backfill->events = g_list_prepend(backfill->events,
+                json_object_ref(event_obj));
+    }
+
+    if(i < len || len < BACKFILL_PAGE_SIZE || end == NULL ||
+            g_strcmp0(end, backfill->to) == 0) {
+        /* we've filled the gap */
+        _finish_backfill(backfill, TRUE);
+        return;
+    }
+
+    if(backfill->pages >= BACKFILL_MAX_PAGES) {
+        /* the pages we have are the newest part of the gap, so showing them
+         * would leave a hole in the middle of the history */
+        purple_debug_info("matrixprpl", "giving up on backfill for %s\n",
+                conv->name);
+        _abandon_backfill(backfill);
+        return;
+    }
+
+    g_free(backfill->from);
+    backfill->from = g_strdup(end);
+    _fetch_page(backfill);
+}
+
+
+static void _messages_error(MatrixConnectionData *conn, gpointer user_data,
+        const gchar *error_message)
+{
+    MatrixBackfill *backfill = user_data;
+
+    backfill->request = NULL;
+
+    /* if we were cancelled, matrix_backfill_cancel will clean up */
+    if(strcmp(error_message, "cancelled") == 0)
+        return;
+
+    purple_debug_info("matrixprpl", "unable to fetch messages for %s: %s\n",
+            backfill->conv->name, error_message);
+    _abandon_backfill(backfill);
+}
+
+
+static void _messages_bad_response(MatrixConnectionData *conn,
+        gpointer user_data, int http_response_code, JsonNode *json_root)
+{
+    MatrixBackfill *backfill = user_data;
+
+    backfill->request = NULL;
+    purple_debug_info("matrixprpl", "unable to fetch messages for %s: %i\n",
+            backfill->conv->name, http_response_code);
+    _abandon_backfill(backfill);
+}
+
+
+static void _fetch_page(MatrixBackfill *backfill)
+{
+    MatrixApiRequestData *request;
+
+    request = matrix_api_get_room_messages(_get_connection_data(backfill),
+            backfill->conv->name, backfill->from, backfill->to,
+            BACKFILL_PAGE_SIZE, _messages_complete, _messages_error,
+            _messages_bad_response, backfill);
+
+    /* if the request failed straight away, the backfill has already been
+     * freed */
+    if(request != NULL)
+        backfill->request = request;
+}
+
+
+void matrix_backfill_start(PurpleConversation *conv, const gchar *from,
+        const gchar *to)
+{
+    MatrixBackfill *backfill;
+
+    if(_get_backfill(conv) != NULL) {
+        /* we're still filling an earlier gap; the events from the new one
+         * will be deferred until that is done, which will have to do. */
+        purple_debug_info("matrixprpl", "another gap in %s during backfill\n",
+                conv->name);
+        return;
+    }
+
+    purple_debug_info("matrixprpl", "filling gap in %s from %s to %s\n",
+            conv->name, from, to);
+
+    backfill = g_new0(MatrixBackfill, 1);
+    backfill->conv = conv;
+    backfill->from = g_strdup(from);
+    backfill->to = g_strdup(to);
+    g_queue_init(&backfill->deferred);
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_BACKFILL, backfill);
+
+    _start_or_queue(backfill);
+}
+
+
+gboolean matrix_backfill_pending(PurpleConversation *conv)
+{
+    return _get_backfill(conv) != NULL;
+}
+
+
+void matrix_backfill_defer_event(PurpleConversation *conv,
+        JsonObject *json_event_obj)
+{
+    MatrixBackfill *backfill = _get_backfill(conv);
+
+    g_assert(backfill != NULL);
+    g_queue_push_tail(&backfill->deferred, json_object_ref(json_event_obj));
+}
+
+
+void matrix_backfill_cancel(PurpleConversation *conv, gboolean show_deferred)
+{
+    MatrixBackfill *backfill = _get_backfill(conv);
+
+    if(backfill == NULL)
+        return;
+
+    purple_debug_info("matrixprpl", "cancelling backfill for %s\n",
+            conv->name);
+
+    if(backfill->request != NULL)
+        matrix_api_cancel(backfill->request);
+
+    _drop_fetched(backfill);
+    _finish_backfill(backfill, show_deferred);
+}
+
+
+void matrix_backfill_cancel_all(MatrixConnectionData *conn)
+{
+    MatrixBackfill *backfill;
+    GList *conversations, *ptr;
+
+    /* empty the queue first, so that cancelling the active backfills doesn't
+     * start new ones */
+    while((backfill = g_queue_peek_head(&conn->backfill_queue)) != NULL)
+        matrix_backfill_cancel(backfill->conv, TRUE);
+
+    conversations = matrix_roomregistry_get_conversations(conn);
+    for(ptr = conversations; ptr != NULL; ptr = ptr->next)
+        matrix_backfill_cancel(ptr->data, TRUE);
+    g_list_free(conversations);
+}
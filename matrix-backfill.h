@@ -0,0 +1,77 @@
+/**
+ * matrix-backfill.h: filling in gaps in the timeline of a room
+ *
+ * If a room has had more events than the server is willing to send in a
+ * /sync, it sets the 'limited' flag on the timeline, and we will have missed
+ * some messages. This module fetches the missing messages via /messages, and
+ * displays them before any newer messages in the room.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_BACKFILL_H_
+#define MATRIX_BACKFILL_H_
+
+#include <glib.h>
+
+#include <json-glib/json-glib.h>
+
+#include "matrix-connection.h"
+
+struct _PurpleConversation;
+
+/**
+ * Start filling in a gap in the timeline of a room.
+ *
+ * Until it completes, any new messages for the room should be passed to
+ * matrix_backfill_defer_event rather than displayed.
+ *
+ * @param conv   the room
+ * @param from   the prev_batch token from the limited timeline
+ * @param to     the token from the end of the last sync, where the gap starts
+ */
+void matrix_backfill_start(struct _PurpleConversation *conv,
+        const gchar *from, const gchar *to);
+
+/**
+ * Check if we are filling in a gap in the timeline of a room
+ */
+gboolean matrix_backfill_pending(struct _PurpleConversation *conv);
+
+/**
+ * Hold back a (non-state) timeline event until the backfill for this room
+ * completes.
+ */
+void matrix_backfill_defer_event(struct _PurpleConversation *conv,
+        JsonObject *json_event_obj);
+
+/**
+ * Abandon any backfill for this room.
+ *
+ * @param conv           the room
+ * @param show_deferred  TRUE to display any deferred events now; FALSE to
+ *                           discard them (if we are leaving the room)
+ */
+void matrix_backfill_cancel(struct _PurpleConversation *conv,
+        gboolean show_deferred);
+
+/**
+ * Abandon all backfills on this connection, in preparation for disconnecting.
+ * Any deferred events are displayed.
+ */
+void matrix_backfill_cancel_all(MatrixConnectionData *conn);
+
+#endif /* MATRIX_BACKFILL_H_ */
@@ -25,15 +25,70 @@
 
 /* libpurple */
 #include <debug.h>
+#include <notify.h>
+#include <status.h>
 
 /* libmatrix */
 #include "libmatrix.h"
 #include "matrix-api.h"
+#include "matrix-backfill.h"
+#include "matrix-dormantroom.h"
+#include "matrix-ephemeral.h"
+#include "matrix-invite.h"
+#include "matrix-join.h"
 #include "matrix-json.h"
+#include "matrix-roomregistry.h"
+#include "matrix-roomtier.h"
+#include "matrix-seenevents.h"
+#include "matrix-shardedsync.h"
+#include "matrix-slidingsync.h"
+#include "matrix-statecache.h"
 #include "matrix-sync.h"
 
 static void _start_next_sync(MatrixConnectionData *ma,
         const gchar *next_batch, gboolean full_state);
+static void _schedule_next_sync(MatrixConnectionData *ma);
+static void _relogin(MatrixConnectionData *ma);
+
+/* the filter we use for /sync when lazy-loading of members is enabled: the
+ * server then only sends the m.room.member events needed to render the
+ * timeline, and we fetch the rest via /members when they are needed.
+ */
+#define LAZY_LOAD_MEMBERS_FILTER \
+    "{\"room\":{\"state\":{\"lazy_load_members\":true}}}"
+
+/* how often we write the state cache, in seconds */
+#define STATECACHE_SAVE_INTERVAL 60
+
+/* the timeout we use for /sync while the user is active, in ms. (When they are
+ * idle, we use the (longer) timeout from the account settings.) */
+#define SYNC_ACTIVE_TIMEOUT 30000
+
+/* if a /sync fails after at least this long (in ms), but before its timeout,
+ * we assume that something is dropping idle connections, and reduce the
+ * timeout accordingly. */
+#define SYNC_MIN_TIMEOUT 10000
+
+/* the longest /sync timeout, and minimum interval between syncs, that we
+ * accept from the account settings, in ms. Anything longer would be pointless
+ * (and could overflow an int). */
+#define SYNC_MAX_TIMEOUT 3600000
+#define SYNC_MAX_MIN_INTERVAL 3600000
+
+/* if a /sync fails because of a network problem or an overloaded server, we
+ * retry after this long (in ms), doubling each time up to the maximum. After
+ * SYNC_MAX_RETRIES failures in a row, we give up and let libpurple reconnect
+ * from scratch. */
+#define SYNC_RETRY_MIN_DELAY 1000
+#define SYNC_RETRY_MAX_DELAY 60000
+#define SYNC_MAX_RETRIES 8
+
+/* if a /sync hasn't completed this long (in ms) after its timeout, we assume
+ * that the connection has been silently dropped, and start again. Initial
+ * and full_state syncs can take the server a long time to put together, so
+ * we give them longer. */
+#define SYNC_WATCHDOG_MARGIN 30000
+#define SYNC_WATCHDOG_INITIAL_MARGIN 600000
 
 
 void matrix_connection_new(PurpleConnection *pc)
@@ -43,7 +98,9 @@ void matrix_connection_new(PurpleConnection *pc)
      g_assert(purple_connection_get_protocol_data(pc) == NULL);
      conn = g_new0(MatrixConnectionData, 1);
      conn->pc = pc;
+     conn->slidingsync_count = -1;
      purple_connection_set_protocol_data(pc, conn);
+     matrix_roomregistry_init(conn);
 }
 
 
@@ -53,14 +110,67 @@ void matrix_connection_free(PurpleConnection *pc)
 
     g_assert(conn != NULL);
 
+    /* make sure the state cache is up to date before we go - unless we
+     * are part-way through applying a sync, in which case the state would not
+     * match the token.
+     */
+    if(conn->statecache_timer != 0) {
+        purple_timeout_remove(conn->statecache_timer);
+        conn->statecache_timer = 0;
+        if(!matrix_sync_pending(pc))
+            matrix_statecache_save(pc, conn->next_batch);
+    }
+    matrix_statecache_flush_next_batch(pc);
+
+    if(conn->sync_delay_timer != 0) {
+        purple_timeout_remove(conn->sync_delay_timer);
+        conn->sync_delay_timer = 0;
+    }
+
+    if(conn->sync_retry_timer != 0) {
+        purple_timeout_remove(conn->sync_retry_timer);
+        conn->sync_retry_timer = 0;
+    }
+
+    if(conn->sync_watchdog_timer != 0) {
+        purple_timeout_remove(conn->sync_watchdog_timer);
+        conn->sync_watchdog_timer = 0;
+    }
+
+    matrix_shardedsync_cancel(conn);
+    if(conn->sync_skip_events != NULL) {
+        g_hash_table_destroy(conn->sync_skip_events);
+        conn->sync_skip_events = NULL;
+    }
+
+    matrix_sync_cancel(pc);
+    matrix_backfill_cancel_all(conn);
+    matrix_join_cancel_all(conn);
+    matrix_roomregistry_free(conn);
+    matrix_slidingsync_free(conn);
+    matrix_invite_free_all(conn);
+    matrix_dormantroom_free_all(conn);
+    matrix_seenevents_free_all(conn);
+    matrix_roomtier_free(conn);
+    if(conn->ephemeral != NULL) {
+        matrix_ephemeral_free_global(conn->ephemeral);
+        conn->ephemeral = NULL;
+    }
+
     purple_connection_set_protocol_data(pc, NULL);
 
+    g_free(conn->next_batch);
+    conn->next_batch = NULL;
+
     g_free(conn->homeserver);
     conn->homeserver = NULL;
 
     g_free(conn->access_token);
     conn->access_token = NULL;
 
+    g_free(conn->device_id);
+    conn->device_id = NULL;
+
     g_free(conn->user_id);
     conn->user_id = NULL;
 
@@ -81,13 +191,167 @@ void matrix_connection_cancel_sync(PurpleConnection *pc)
     return;
 }
 
+
+void matrix_connection_show_sync_stats(PurpleConnection *pc)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    gchar *stats;
+
+    stats = g_strdup_printf(_("Completed: %u\nStalled: %u\nRetried after "
+            "errors: %u\nCurrent timeout: %ims"), conn->sync_count,
+            conn->sync_stalls, conn->sync_retries_total, conn->sync_timeout);
+    purple_notify_info(pc, _("Sync statistics"), pc->account->username,
+            stats);
+    g_free(stats);
+}
+
+
+/**
+ * The active /sync has finished (one way or another)
+ */
+static void _sync_finished(MatrixConnectionData *ma)
+{
+    ma->active_sync = NULL;
+
+    if(ma->sync_watchdog_timer != 0) {
+        purple_timeout_remove(ma->sync_watchdog_timer);
+        ma->sync_watchdog_timer = 0;
+    }
+}
+
+
+static gboolean _sync_watchdog_cb(gpointer user_data)
+{
+    MatrixConnectionData *ma = user_data;
+    MatrixApiRequestData *sync = ma->active_sync;
+
+    if(sync == NULL) {
+        ma->sync_watchdog_timer = 0;
+        return FALSE;
+    }
+
+    /* if the response has arrived, and is just taking a while to parse, that's
+     * fine; check again later */
+    if(matrix_api_request_has_response(sync))
+        return TRUE;
+
+    ma->sync_watchdog_timer = 0;
+    ma->sync_stalls++;
+    purple_debug_warning("matrixprpl", "/sync on %s has stalled (%u so "
+            "far): restarting\n", ma->pc->account->username, ma->sync_stalls);
+
+    /* our error callback ignores the cancellation */
+    matrix_api_cancel(sync);
+    _start_next_sync(ma, ma->next_batch, ma->sync_full_state);
+    return FALSE;
+}
+
+
+/**
+ * Start watching for the active /sync stalling
+ */
+static void _start_sync_watchdog(MatrixConnectionData *ma)
+{
+    int margin = SYNC_WATCHDOG_MARGIN;
+
+    if(ma->next_batch == NULL || ma->sync_full_state)
+        margin = SYNC_WATCHDOG_INITIAL_MARGIN;
+
+    ma->sync_watchdog_timer = purple_timeout_add(ma->sync_timeout + margin,
+            _sync_watchdog_cb, ma);
+}
+
+/**
+ * Check if a failed /sync looks like it was cut off by a proxy which drops
+ * idle connections. If so, reduce the timeout so that we stay under its limit.
+ *
+ * @returns TRUE if we have reduced the timeout, and it is worth retrying
+ */
+static gboolean _check_sync_cutoff(MatrixConnectionData *ma)
+{
+    int elapsed, limit;
+
+    elapsed = (g_get_monotonic_time() - ma->sync_started) / 1000;
+    if(elapsed < SYNC_MIN_TIMEOUT || elapsed >= ma->sync_timeout)
+        return FALSE;
+
+    /* leave a margin, since the time at which the connection is dropped will
+     * vary a bit */
+    limit = elapsed * 3 / 4;
+    if(limit < SYNC_MIN_TIMEOUT)
+        limit = SYNC_MIN_TIMEOUT;
+    if(limit >= ma->sync_timeout)
+        return FALSE;
+
+    purple_debug_info("matrixprpl", "/sync with timeout %ims failed after "
+            "%ims: reducing timeout to %ims\n", ma->sync_timeout, elapsed,
+            limit);
+    ma->sync_timeout_limit = limit;
+    return TRUE;
+}
+
+
+static gboolean _sync_retry_cb(gpointer user_data)
+{
+    MatrixConnectionData *ma = user_data;
+
+    ma->sync_retry_timer = 0;
+    _start_next_sync(ma, ma->next_batch, ma->sync_full_state);
+    return FALSE;
+}
+
+
+/**
+ * Arrange to retry a /sync which failed for what is hopefully a temporary
+ * reason, picking up from the same token. The rooms and conversations are
+ * left alone, so once the network comes back we are up and running again with
+ * a single request.
+ *
+ * @param min_delay  the shortest time to wait (in ms), if the server has
+ *                   asked us to wait; otherwise 0
+ *
+ * @returns FALSE if we have already retried too many times
+ */
+static gboolean _schedule_sync_retry(MatrixConnectionData *ma,
+        const gchar *reason, gint64 min_delay)
+{
+    gint64 delay;
+
+    if(ma->sync_retries >= SYNC_MAX_RETRIES)
+        return FALSE;
+
+    delay = SYNC_RETRY_MIN_DELAY << ma->sync_retries;
+    if(delay > SYNC_RETRY_MAX_DELAY)
+        delay = SYNC_RETRY_MAX_DELAY;
+    if(delay < min_delay)
+        delay = MIN(min_delay, G_MAXINT);
+    ma->sync_retries++;
+    ma->sync_retries_total++;
+
+    purple_debug_info("matrixprpl", "/sync failed (%s): retrying in %"
+            G_GINT64_FORMAT "ms\n", reason, delay);
+    ma->sync_retry_timer = purple_timeout_add(delay, _sync_retry_cb, ma);
+    return TRUE;
+}
+
+
 /**
  * /sync failed
  */
 void _sync_error(MatrixConnectionData *ma, gpointer user_data,
         const gchar *error_message)
 {
-    ma->active_sync = NULL;
+    _sync_finished(ma);
+
+    if(strcmp(error_message, "cancelled") != 0) {
+        if(_check_sync_cutoff(ma)) {
+            _start_next_sync(ma, ma->next_batch, ma->sync_full_state);
+            return;
+        }
+        if(_schedule_sync_retry(ma, error_message, 0))
+            return;
+    }
+
     matrix_api_error(ma, user_data, error_message);
 }
 
@@ -97,19 +361,103 @@ void _sync_error(MatrixConnectionData *ma, gpointer user_data,
 void _sync_bad_response(MatrixConnectionData *ma, gpointer user_data,
         int http_response_code, JsonNode *json_root)
 {
-    ma->active_sync = NULL;
+    _sync_finished(ma);
+
+    /* a proxy giving up waiting for the homeserver looks much the same as one
+     * dropping the connection */
+    if((http_response_code == 502 || http_response_code == 504) &&
+            _check_sync_cutoff(ma)) {
+        _start_next_sync(ma, ma->next_batch, ma->sync_full_state);
+        return;
+    }
+
+    /* our access token has expired or been revoked (or the server has
+     * forgotten the one we saved last time): log in again, and carry on from
+     * where we were. If that doesn't help, give up. */
+    if(http_response_code == 401 && !ma->relogged_in) {
+        _relogin(ma);
+        return;
+    }
+
+    /* sliding sync positions expire after a while; if ours has, start again
+     * from scratch */
+    if(ma->sliding_sync && matrix_slidingsync_position_expired(ma,
+            http_response_code, json_root)) {
+        g_free(ma->next_batch);
+        ma->next_batch = NULL;
+        _start_next_sync(ma, NULL, FALSE);
+        return;
+    }
+
+    /* the server may just be overloaded or restarting; if it is rate-limiting
+     * us, it may tell us how long to wait */
+    if(http_response_code >= 500 || http_response_code == 429) {
+        gchar *reason = g_strdup_printf("%i", http_response_code);
+        gint64 retry_after = 0;
+        gboolean retrying;
+
+        if(http_response_code == 429)
+            retry_after = matrix_json_object_get_int_member(
+                    matrix_json_node_get_object(json_root), "retry_after_ms");
+        retrying = _schedule_sync_retry(ma, reason, retry_after);
+        g_free(reason);
+        if(retrying)
+            return;
+    }
+
+    /* if the server didn't like our request, it may be because the sync token
+     * from the state cache is no good; make sure we don't try it again.
+     * (Other failures, such as rate-limiting, say nothing about the token.)
+     */
+    if(http_response_code == 400 || http_response_code == 404)
+        matrix_statecache_clear(ma->pc->account);
+
     matrix_api_bad_response(ma, user_data, http_response_code, json_root);
 }
 
 
+static gboolean _save_statecache(gpointer user_data)
+{
+    MatrixConnectionData *ma = user_data;
+
+    if(matrix_sync_pending(ma->pc)) {
+        /* the room state doesn't match next_batch yet; try again later */
+        return TRUE;
+    }
+
+    ma->statecache_timer = 0;
+    matrix_statecache_save(ma->pc, ma->next_batch);
+    return FALSE;
+}
+
+
+/**
+ * Arrange for the state cache to be written soon, if that isn't already
+ * arranged. We batch up writes because they involve serialising the state of
+ * every room.
+ */
+static void _schedule_statecache_save(MatrixConnectionData *ma)
+{
+    if(ma->statecache_timer != 0)
+        return;
+
+    ma->statecache_timer = purple_timeout_add_seconds(
+            STATECACHE_SAVE_INTERVAL, _save_statecache, ma);
+}
+
+
 /* callback which is called when a /sync request completes */
 static void _sync_complete(MatrixConnectionData *ma, gpointer user_data,
-    JsonNode *body)
+    JsonNode *body, gpointer preprocessed)
 {
     PurpleConnection *pc = ma->pc;
-    const gchar *next_batch;
+    MatrixSyncJob *job = preprocessed;
+    gchar *next_batch;
 
-    ma->active_sync = NULL;
+    _sync_finished(ma);
+    ma->sync_retries = 0;
+    ma->sync_count++;
+    ma->relogged_in = FALSE;
 
     if(body == NULL) {
         purple_connection_error_reason(pc, PURPLE_CONNECTION_ERROR_OTHER_ERROR,
@@ -120,77 +468,283 @@ static void _sync_complete(MatrixConnectionData *ma, gpointer user_data,
     purple_connection_update_progress(pc, _("Connected"), 2, 3);
     purple_connection_set_state(pc, PURPLE_CONNECTED);
 
-    matrix_sync_parse(pc, body, &next_batch);
-
-    /* Start the next sync */
+    /* ma->next_batch is still the token this sync started from. (Sliding
+     * sync positions can't be used to fill in gaps, so there's no point
+     * recording them.) */
+    if(!ma->sliding_sync)
+        matrix_sync_job_set_since(job, ma->next_batch);
+
+    /* the first sync after a sharded initial sync goes back over some of the
+     * same ground */
+    if(ma->sync_skip_events != NULL) {
+        matrix_sync_job_drop_events(job, ma->sync_skip_events);
+        g_hash_table_destroy(ma->sync_skip_events);
+        ma->sync_skip_events = NULL;
+    }
+    next_batch = g_strdup(matrix_sync_job_get_next_batch(job));
     if(next_batch == NULL) {
+        matrix_sync_apply(pc, job);
         purple_connection_error_reason(pc, PURPLE_CONNECTION_ERROR_OTHER_ERROR,
                 "No next_batch field");
         return;
     }
-    purple_account_set_string(pc->account, PRPL_ACCOUNT_OPT_NEXT_BATCH,
-            next_batch);
 
-    _start_next_sync(ma, next_batch, FALSE);
+    g_free(ma->next_batch);
+    ma->next_batch = next_batch;
+
+    /* the state cache would be no use without a /sync token to go with it */
+    if(!ma->sliding_sync)
+        _schedule_statecache_save(ma);
+
+    /* Start the next sync straight away (unless we're pacing them), so that
+     * we are waiting for the next batch of events while we apply this one.
+     * matrix_sync_apply makes sure that the results are applied in order (and
+     * saves next_batch once they have been).
+     */
+    _schedule_next_sync(ma);
+
+    matrix_sync_apply(pc, job);
+}
+
+
+/**
+ * Work out the timeout to use for the next /sync, in ms.
+ *
+ * While the user is active, we use a shorter timeout, so that we notice a
+ * dead connection sooner. While they are idle, that matters less, so we use a
+ * longer one to cut down on the number of requests.
+ */
+static int _get_sync_timeout(MatrixConnectionData *ma)
+{
+    PurpleAccount *account = ma->pc->account;
+    gint64 timeout;
+
+    timeout = (gint64) purple_account_get_int(account,
+            PRPL_ACCOUNT_OPT_SYNC_TIMEOUT, DEFAULT_SYNC_TIMEOUT) * 1000;
+    if(timeout > SYNC_MAX_TIMEOUT)
+        timeout = SYNC_MAX_TIMEOUT;
+
+    if(timeout > SYNC_ACTIVE_TIMEOUT &&
+            !purple_presence_is_idle(purple_account_get_presence(account)))
+        timeout = SYNC_ACTIVE_TIMEOUT;
+
+    if(ma->sync_timeout_limit > 0 && timeout > ma->sync_timeout_limit)
+        timeout = ma->sync_timeout_limit;
+
+    /* a shorter timeout than this (including a zero or negative one from the
+     * account settings) would have us polling the server */
+    if(timeout < SYNC_MIN_TIMEOUT)
+        timeout = SYNC_MIN_TIMEOUT;
+
+    return timeout;
+}
+
+
+static gboolean _delayed_sync_cb(gpointer user_data)
+{
+    MatrixConnectionData *ma = user_data;
+
+    ma->sync_delay_timer = 0;
+    _start_next_sync(ma, ma->next_batch, FALSE);
+    return FALSE;
+}
+
+
+/**
+ * Start the next /sync after a successful one. If the account has a minimum
+ * interval between syncs, we may wait a bit first, so that events are
+ * batched up into fewer responses.
+ */
+static void _schedule_next_sync(MatrixConnectionData *ma)
+{
+    gint64 min_interval, elapsed;
+
+    min_interval = (gint64) purple_account_get_int(ma->pc->account,
+            PRPL_ACCOUNT_OPT_SYNC_MIN_INTERVAL,
+            DEFAULT_SYNC_MIN_INTERVAL) * 1000;
+    if(min_interval < 0)
+        min_interval = 0;
+    if(min_interval > SYNC_MAX_MIN_INTERVAL)
+        min_interval = SYNC_MAX_MIN_INTERVAL;
+    elapsed = (g_get_monotonic_time() - ma->sync_started) / 1000;
+
+    if(elapsed >= min_interval) {
+        _start_next_sync(ma, ma->next_batch, FALSE);
+        return;
+    }
+
+    purple_debug_info("matrixprpl", "delaying next sync by %" G_GINT64_FORMAT
+            "ms\n", min_interval - elapsed);
+    ma->sync_delay_timer = purple_timeout_add(min_interval - elapsed,
+            _delayed_sync_cb, ma);
 }
 
 
 static void _start_next_sync(MatrixConnectionData *ma,
         const gchar *next_batch, gboolean full_state)
 {
-    ma->active_sync = matrix_api_sync(ma, next_batch, 30000, full_state,
-            _sync_complete, _sync_error, _sync_bad_response, NULL);
+    const gchar *filter = NULL;
+
+    if(purple_account_get_bool(ma->pc->account,
+            PRPL_ACCOUNT_OPT_LAZY_LOAD_MEMBERS, TRUE))
+        filter = LAZY_LOAD_MEMBERS_FILTER;
+
+    ma->sync_started = g_get_monotonic_time();
+    ma->sync_timeout = _get_sync_timeout(ma);
+
+    ma->sync_full_state = full_state;
+
+    if(ma->sliding_sync) {
+        ma->active_sync = matrix_slidingsync_request(ma, next_batch,
+                ma->sync_timeout, _sync_complete, _sync_error,
+                _sync_bad_response, NULL);
+    } else {
+        ma->active_sync = matrix_api_sync(ma, next_batch, ma->sync_timeout,
+                full_state, filter, matrix_sync_preprocess,
+                (GDestroyNotify) matrix_sync_job_free,
+                _sync_complete, _sync_error, _sync_bad_response, NULL);
+    }
+
+    if(ma->active_sync != NULL)
+        _start_sync_watchdog(ma);
 }
 
 
-static gboolean _account_has_active_conversations(PurpleAccount *account)
+/**
+ * The sharded initial sync has finished; carry on with the normal sync loop
+ */
+static void _sharded_sync_done(MatrixConnectionData *ma, const gchar *since,
+        GHashTable *seen_events)
 {
-    GList *ptr;
+    ma->sync_skip_events = seen_events;
 
-    for(ptr = purple_get_conversations(); ptr != NULL; ptr = g_list_next(ptr))
-    {
-        PurpleConversation *conv = ptr->data;
-        if(conv -> account == account)
-            return TRUE;
-    }
-    return FALSE;
+    g_free(ma->next_batch);
+    ma->next_batch = g_strdup(since);
+    _start_next_sync(ma, ma->next_batch, since == NULL);
 }
 
 
-static void _login_completed(MatrixConnectionData *conn,
-        gpointer user_data,
+/**
+ * Pick out the access token etc from a /login response, and save them for
+ * later connections.
+ *
+ * @returns FALSE if the response was no good (in which case the connection
+ *    is now in the error state)
+ */
+static gboolean _handle_login_response(MatrixConnectionData *conn,
         JsonNode *json_root)
 {
-    PurpleConnection *pc = conn->pc;
     JsonObject *root_obj;
-    const gchar *access_token;
-    const gchar *next_batch;
-    gboolean needs_full_state_sync = TRUE;
+    const gchar *access_token, *device_id;
 
     root_obj = matrix_json_node_get_object(json_root);
     access_token = matrix_json_object_get_string_member(root_obj,
             "access_token");
     if(access_token == NULL) {
-        purple_connection_error_reason(pc,
+        purple_connection_error_reason(conn->pc,
                 PURPLE_CONNECTION_ERROR_OTHER_ERROR,
                 "No access_token in /login response");
-        return;
+        return FALSE;
     }
+
+    g_free(conn->access_token);
     conn->access_token = g_strdup(access_token);
+    g_free(conn->user_id);
     conn->user_id = g_strdup(matrix_json_object_get_string_member(root_obj,
             "user_id"));
 
+    device_id = matrix_json_object_get_string_member(root_obj, "device_id");
+    if(device_id != NULL) {
+        g_free(conn->device_id);
+        conn->device_id = g_strdup(device_id);
+    }
+
+    matrix_statecache_save_session(conn);
+    return TRUE;
+}
+
+
+static void _relogin_completed(MatrixConnectionData *ma, gpointer user_data,
+        JsonNode *json_root)
+{
+    if(!_handle_login_response(ma, json_root))
+        return;
+
+    _start_next_sync(ma, ma->next_batch, ma->sync_full_state);
+}
+
+
+/**
+ * The server has rejected our access token: log in with the password to get
+ * a new one (on the same device).
+ */
+static void _relogin(MatrixConnectionData *ma)
+{
+    PurpleAccount *acct = ma->pc->account;
+
+    purple_debug_info("matrixprpl", "access token for %s was rejected: "
+            "logging in again\n", acct->username);
+
+    /* make sure we don't try the old token again on the next connection */
+    g_free(ma->access_token);
+    ma->access_token = NULL;
+    matrix_statecache_save_session(ma);
+
+    ma->relogged_in = TRUE;
+    matrix_api_password_login(ma, acct->username,
+            purple_account_get_password(acct), ma->device_id,
+            _relogin_completed, ma);
+}
+
+
+/**
+ * We have an access token: rebuild the rooms, and start the sync loop
+ */
+static void _start_session(MatrixConnectionData *conn)
+{
+    PurpleConnection *pc = conn->pc;
+    const gchar *next_batch;
+    gchar *cached_next_batch = NULL, *stored_next_batch;
+    gboolean needs_full_state_sync = TRUE;
+
+    /* sliding sync has no equivalent of the state cache or a stored
+     * next_batch, so it always starts from scratch */
+    conn->sliding_sync = purple_account_get_bool(pc->account,
+            PRPL_ACCOUNT_OPT_SLIDING_SYNC, FALSE);
+    if(conn->sliding_sync) {
+        purple_connection_update_progress(pc, _("Initial Sync"), 1, 3);
+        g_free(conn->next_batch);
+        conn->next_batch = NULL;
+        _start_next_sync(conn, NULL, FALSE);
+        return;
+    }
+
     /* start the sync loop */
-    next_batch = purple_account_get_string(pc->account,
-            PRPL_ACCOUNT_OPT_NEXT_BATCH, NULL);
+    stored_next_batch = matrix_statecache_get_next_batch(pc->account);
+    next_batch = stored_next_batch;
 
-    if(next_batch != NULL) {
+    /* the events we had already shown, as of the stored sync token */
+    matrix_statecache_load_seen_events(pc);
+
+    /* If we have a cached copy of the room state, we can rebuild the rooms
+     * from that instead of doing a full_state sync. We do this even if there
+     * are already conversations for this account (because we have connected
+     * before on this invocation of pidgin), since the dormant rooms (see
+     * matrix-dormantroom.c) went away with the old connection.
+     */
+    purple_connection_update_progress(pc, _("Loading cached state"), 1, 3);
+    cached_next_batch = matrix_statecache_restore(pc);
+
+    if(cached_next_batch != NULL) {
+        next_batch = cached_next_batch;
+        needs_full_state_sync = FALSE;
+    } else if(next_batch != NULL) {
         /* if we have previously done a full_state sync on this account, there's
          * no need to do another. If there are already conversations associated
          * with this account, that is a pretty good indication that we have
          * previously done a full_state sync.
          */
-        if(_account_has_active_conversations(pc->account)) {
+        if(matrix_roomregistry_has_conversations(conn)) {
             needs_full_state_sync = FALSE;
         } else {
             /* this appears to be the first time we have connected to this account
@@ -210,7 +764,32 @@ static void _login_completed(MatrixConnectionData *conn,
         purple_connection_set_state(pc, PURPLE_CONNECTED);
     }
 
-    _start_next_sync(conn, next_batch, needs_full_state_sync);
+    /* remember where we started from, in case we need to retry */
+    g_free(conn->next_batch);
+    conn->next_batch = g_strdup(next_batch);
+    g_free(cached_next_batch);
+    g_free(stored_next_batch);
+
+    /* starting from scratch on a big account is quicker in pieces */
+    if(conn->next_batch == NULL && purple_account_get_bool(pc->account,
+            PRPL_ACCOUNT_OPT_SHARDED_SYNC, TRUE)) {
+        matrix_shardedsync_start(conn, purple_account_get_bool(pc->account,
+                PRPL_ACCOUNT_OPT_LAZY_LOAD_MEMBERS, TRUE), _sharded_sync_done);
+        return;
+    }
+
+    _start_next_sync(conn, conn->next_batch, needs_full_state_sync);
+}
+
+
+static void _login_completed(MatrixConnectionData *conn,
+        gpointer user_data,
+        JsonNode *json_root)
+{
+    if(!_handle_login_response(conn, json_root))
+        return;
+
+    _start_session(conn);
 }
 
 
@@ -228,10 +807,22 @@ void matrix_connection_start_login(PurpleConnection *pc)
     }
 
     purple_connection_set_state(pc, PURPLE_CONNECTING);
+
+    /* if we still have the access token from last time, go straight to
+     * syncing. If it is no longer valid, we'll find out from the first sync,
+     * and log in then (see _sync_bad_response). */
+    if(matrix_statecache_load_session(conn)) {
+        purple_debug_info("matrixprpl", "reusing access token for %s\n",
+                acct->username);
+        _start_session(conn);
+        return;
+    }
+
     purple_connection_update_progress(pc, _("Logging in"), 0, 3);
 
     matrix_api_password_login(conn, acct->username,
-            purple_account_get_password(acct), _login_completed, conn);
+            purple_account_get_password(acct), conn->device_id,
+            _login_completed, conn);
 }
 
 
@@ -245,7 +836,11 @@ static void _join_completed(MatrixConnectionData *conn,
 
     root_obj = matrix_json_node_get_object(json_root);
     room_id = matrix_json_object_get_string_member(root_obj, "room_id");
-    purple_debug_info("matrixprpl", "join %s completed", room_id);
+    purple_debug_info("matrixprpl", "join %s completed\n", room_id);
+
+    /* don't wait for the room to turn up in /sync */
+    if(room_id != NULL)
+        matrix_join_populate(conn, room_id);
 
     g_hash_table_destroy(components);
 }
@@ -309,5 +904,6 @@ void matrix_connection_reject_invite(struct _PurpleConnection *pc,
 {
     MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
 
+    matrix_invite_forget(conn, room_id);
     matrix_api_leave_room(conn, room_id, NULL, NULL, NULL, NULL);
 }
@@ -35,9 +35,117 @@ typedef struct _MatrixConnectionData {
     gchar *homeserver;      /* URL of the homeserver. Always ends in '/' */
     gchar *user_id;         /* our full user id ("@user:server") */
     gchar *access_token;    /* access token corresponding to our user */
+    gchar *device_id;       /* the device our access token belongs to */
+
+    /* TRUE if we have logged in again since the last successful /sync,
+     * because the server rejected our access token */
+    gboolean relogged_in;
 
     /* the active sync request */
     struct _MatrixApiRequestData *active_sync;
+
+    /* when the active (or most recent) sync request was started, from
+     * g_get_monotonic_time, the timeout we gave it, in ms, and whether it was
+     * a full_state sync */
+    gint64 sync_started;
+    int sync_timeout;
+    gboolean sync_full_state;
+
+    /* if we have found that something between us and the homeserver drops
+     * connections which are idle for too long, the longest timeout we can use
+     * for /sync, in ms. 0 if we haven't found a limit. */
+    int sync_timeout_limit;
+
+    /* timer for starting the next sync, when we are pacing them (0 if none
+     * scheduled) */
+    guint sync_delay_timer;
+
+    /* the number of times in a row that /sync has failed, and the timer for
+     * retrying it (0 if none scheduled) */
+    guint sync_retries;
+    guint sync_retry_timer;
+
+    /* timer for checking that the active sync hasn't stalled (0 if none
+     * scheduled) */
+    guint sync_watchdog_timer;
+
+    /* statistics: the number of syncs which have completed, the number which
+     * have stalled, and the number which have been retried after an error */
+    guint sync_count;
+    guint sync_stalls;
+    guint sync_retries_total;
+
+    /* queue of MatrixSyncJob *s: results from /sync which have yet to be
+     * applied (see matrix-sync.c) */
+    GQueue sync_jobs;
+
+    /* timer for applying the next slice of sync_jobs (0 if none scheduled) */
+    guint sync_timer;
+
+    /* the next_batch token from the last /sync we processed (or the token we
+     * started the sync loop with) */
+    gchar *next_batch;
+
+    /* timer for the next write of the state cache (0 if none scheduled) */
+    guint statecache_timer;
+
+    /* a sync token which has yet to be written to disk, and the timer for
+     * writing it (see matrix_statecache_set_next_batch) */
+    gchar *next_batch_pending;
+    guint next_batch_timer;
+
+    /* map from room id to the buddy list entry and conversation for the room;
+     * see matrix-roomregistry.c */
+    GHashTable *rooms;
+    guint nconversations;
+
+    /* backfills waiting to start, and the number in progress; see
+     * matrix-backfill.c */
+    GQueue backfill_queue;
+    guint backfills_active;
+
+    /* map from room id to the fetch of its state and messages after we
+     * joined it; see matrix-join.c */
+    GHashTable *join_fetches;
+
+    /* map from room id to the rooms we have joined but not yet created a
+     * conversation for; see matrix-dormantroom.c */
+    GHashTable *dormant_rooms;
+
+    /* map from room id to the summary of our invitation to that room; see
+     * matrix-invite.c */
+    GHashTable *invites;
+
+    /* the ids of the events we have recently shown in each room, and whether
+     * they have changed since we last saved them; see matrix-seenevents.c */
+    GHashTable *seen_events;
+    gboolean seen_events_dirty;
+
+    /* the latest global account data; see matrix-ephemeral.c */
+    struct _MatrixGlobalEphemeral *ephemeral;
+
+    /* map from room id to the tier its push rules put it in, and the push
+     * rules the map was built from; see matrix-roomtier.c */
+    GHashTable *room_tiers;
+    struct _JsonObject *room_tiers_rules;
+
+    /* TRUE if we are using sliding sync rather than /sync */
+    gboolean sliding_sync;
+
+    /* sliding sync state (see matrix-slidingsync.c): how much of the room list
+     * we are asking for, how long the list is (-1 if not yet known), and the
+     * set of room ids the user has open */
+    guint slidingsync_window;
+    gint64 slidingsync_count;
+    GHashTable *slidingsync_subscriptions;
+
+    /* a sharded initial sync in progress (see matrix-shardedsync.c), or
+     * NULL */
+    struct _MatrixShardedSync *sharded_sync;
+
+    /* event ids which the next /sync response may repeat, because they were
+     * in the results of the sharded initial sync; or NULL */
+    GHashTable *sync_skip_events;
 } MatrixConnectionData;
 
 
@@ -63,6 +171,12 @@ void matrix_connection_free(struct _PurpleConnection *pc);
 void matrix_connection_cancel_sync(struct _PurpleConnection *pc);
 
 
+/**
+ * show the user some statistics about the health of the /sync loop
+ */
+void matrix_connection_show_sync_stats(struct _PurpleConnection *pc);
+
+
 /**
  * start the process for joining a room
  */
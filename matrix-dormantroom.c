@@ -0,0 +1,429 @@
+/**
+ * matrix-dormantroom.c: rooms which we haven't shown to the user yet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-dormantroom.h"
+
+/* libpurple */
+#include "blist.h"
+#include "connection.h"
+#include "conversation.h"
+#include "debug.h"
+
+/* libmatrix */
+#include "libmatrix.h"
+#include "matrix-event.h"
+#include "matrix-json.h"
+#include "matrix-room.h"
+#include "matrix-roomregistry.h"
+#include "matrix-roomtier.h"
+
+
+typedef struct _MatrixDormantRoom {
+    MatrixRoomStateEventTable *state_table;
+
+    /* the timeline events from the last sync which included the room, or
+     * NULL. We hold a reference. */
+    JsonArray *timeline;
+
+    /* the number of unread notifications and highlights, according to the
+     * server */
+    gint64 unread;
+    gint64 highlights;
+
+    /* the room summary, or NULL if the server hasn't sent one */
+    MatrixRoomSummary *summary;
+} MatrixDormantRoom;
+
+
+static void _free_room(MatrixDormantRoom *room)
+{
+    matrix_statetable_destroy(room->state_table);
+    if(room->summary != NULL)
+        matrix_roomsummary_free(room->summary);
+    if(room->timeline != NULL)
+        json_array_unref(room->timeline);
+    g_free(room);
+}
+
+
+static MatrixDormantRoom *_get_room(MatrixConnectionData *conn,
+        const gchar *room_id)
+{
+    if(conn->dormant_rooms == NULL)
+        return NULL;
+    return g_hash_table_lookup(conn->dormant_rooms, room_id);
+}
+
+
+static JsonArray *_get_timeline(JsonObject *room_data)
+{
+    return matrix_json_object_get_array_member(
+            matrix_json_object_get_object_member(room_data, "timeline"),
+            "events");
+}
+
+
+/**
+ * Get one of the unread counts ("notification_count" or "highlight_count")
+ * from a room's entry in a sync response
+ *
+ * @returns the count, or -1 if the server didn't tell us
+ */
+static gint64 _get_unread(JsonObject *room_data, const gchar *count)
+{
+    JsonObject *unread;
+
+    unread = matrix_json_object_get_object_member(room_data,
+            "unread_notifications");
+    if(unread == NULL || !json_object_has_member(unread, count))
+        return -1;
+    return matrix_json_object_get_int_member(unread, count);
+}
+
+
+/**
+ * Check if a timeline includes a message from someone else
+ */
+static gboolean _has_new_message(MatrixConnectionData *conn,
+        JsonArray *timeline)
+{
+    guint i, len;
+
+    len = timeline == NULL ? 0 : json_array_get_length(timeline);
+    for(i = 0; i < len; i++) {
+        JsonObject *event_obj = matrix_json_node_get_object(
+                json_array_get_element(timeline, i));
+        if(g_strcmp0(matrix_json_object_get_string_member(event_obj, "type"),
+                "m.room.message") == 0 &&
+                g_strcmp0(matrix_json_object_get_string_member(event_obj,
+                        "sender"), conn->user_id) != 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+/**
+ * Look up the displayname of a member in the state table (as a
+ * MatrixRoomSummaryDisplaynameFunc)
+ */
+static const gchar *_get_member_displayname(const gchar *user_id,
+        gpointer user_data)
+{
+    MatrixRoomStateEventTable *state_table = user_data;
+    MatrixRoomEvent *event;
+
+    event = matrix_statetable_get_event(state_table, "m.room.member", user_id);
+    if(event == NULL)
+        return NULL;
+    return matrix_json_object_get_string_member(event->content, "displayname");
+}
+
+
+/**
+ * Pick a name for a room based on its members, in the same way as
+ * matrix-room.c does (although without disambiguating displaynames).
+ *
+ * @returns a string which should be freed, or NULL if there are no other
+ *    members
+ */
+static gchar *_get_room_name_from_members(MatrixConnectionData *conn,
+        MatrixRoomStateEventTable *state_table)
+{
+    GHashTable *members;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *user_ids = NULL;
+    gchar *res;
+
+    members = g_hash_table_lookup(state_table, "m.room.member");
+    if(members == NULL)
+        return NULL;
+
+    g_hash_table_iter_init(&iter, members);
+    while(g_hash_table_iter_next(&iter, &key, &value)) {
+        MatrixRoomEvent *event = value;
+        const gchar *membership;
+
+        if(g_strcmp0(key, conn->user_id) == 0)
+            continue;
+
+        membership = matrix_json_object_get_string_member(event->content,
+                "membership");
+        if(g_strcmp0(membership, "join") == 0 ||
+                g_strcmp0(membership, "invite") == 0)
+            user_ids = g_list_prepend(user_ids, key);
+    }
+
+    res = matrix_roomsummary_get_name_from_members(user_ids,
+            _get_member_displayname, state_table);
+    g_list_free(user_ids);
+    return res;
+}
+
+
+/**
+ * Check if we should keep a member's state event for a room whose members we
+ * otherwise skip: we need the heroes' displaynames to name the room.
+ */
+static gboolean _keep_member(MatrixDormantRoom *room, const gchar *user_id)
+{
+    return room->summary != NULL &&
+            matrix_roomsummary_is_hero(room->summary, user_id);
+}
+
+
+/**
+ * Drop the member events from a state table, other than those we keep (see
+ * _keep_member)
+ */
+static void _skip_members(MatrixDormantRoom *room,
+        MatrixRoomStateEventTable *state_events)
+{
+    GHashTable *members;
+    GHashTableIter iter;
+    gpointer key;
+
+    members = g_hash_table_lookup(state_events, "m.room.member");
+    if(members == NULL)
+        return;
+
+    g_hash_table_iter_init(&iter, members);
+    while(g_hash_table_iter_next(&iter, &key, NULL)) {
+        if(!_keep_member(room, key))
+            g_hash_table_iter_remove(&iter);
+    }
+}
+
+
+/**
+ * Update the name of the room in the buddy list
+ */
+static void _update_room_alias(MatrixConnectionData *conn,
+        const gchar *room_id, MatrixDormantRoom *room)
+{
+    PurpleChat *chat = matrix_roomregistry_get_chat(conn, room_id);
+    gchar *room_name;
+
+    if(chat == NULL)
+        return;
+
+    room_name = matrix_statetable_get_room_alias(room->state_table);
+    if(room_name == NULL && room->summary != NULL)
+        room_name = matrix_roomsummary_get_name(room->summary,
+                _get_member_displayname, room->state_table);
+    if(room_name == NULL)
+        room_name = _get_room_name_from_members(conn, room->state_table);
+
+    if(room_name != NULL &&
+            g_strcmp0(room_name, purple_chat_get_name(chat)) != 0)
+        purple_blist_alias_chat(chat, room_name);
+    g_free(room_name);
+}
+
+
+/******************************************************************************
+ *
+ * public api
+ */
+
+gboolean matrix_dormantroom_exists(MatrixConnectionData *conn,
+        const gchar *room_id)
+{
+    return _get_room(conn, room_id) != NULL;
+}
+
+
+gboolean matrix_dormantroom_should_promote(MatrixConnectionData *conn,
+        const gchar *room_id, JsonObject *room_data)
+{
+    MatrixDormantRoom *room = _get_room(conn, room_id);
+    gint64 unread;
+
+    switch(matrix_roomtier_get(conn, room_id)) {
+        case MATRIX_ROOM_TIER_FULL:
+            /* any new message from someone else will do - but, as below,
+             * not the history we get the first time we see the room */
+            return room != NULL &&
+                    _has_new_message(conn, _get_timeline(room_data));
+
+        case MATRIX_ROOM_TIER_MUTED:
+            /* only a mention will do */
+            return _get_unread(room_data, "highlight_count") >
+                    (room == NULL ? 0 : room->highlights);
+    }
+
+    unread = _get_unread(room_data, "notification_count");
+    if(unread >= 0)
+        return unread > (room == NULL ? 0 : room->unread);
+
+    /* if the server doesn't keep count for us, look for new messages - but
+     * only once we have seen the room before, since otherwise they are just
+     * history. */
+    return room != NULL && _has_new_message(conn, _get_timeline(room_data));
+}
+
+
+void matrix_dormantroom_update(PurpleConnection *pc, const gchar *room_id,
+        MatrixRoomStateEventTable *state_events, JsonObject *room_data)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    MatrixDormantRoom *room = _get_room(conn, room_id);
+    JsonArray *timeline;
+    JsonObject *summary_obj;
+    gint64 unread;
+    guint i, len;
+    gboolean muted, skip_members;
+
+    if(room == NULL) {
+        if(conn->dormant_rooms == NULL)
+            conn->dormant_rooms = g_hash_table_new_full(g_str_hash,
+                    g_str_equal, g_free, (GDestroyNotify) _free_room);
+        room = g_new0(MatrixDormantRoom, 1);
+        room->state_table = matrix_statetable_new();
+        g_hash_table_insert(conn->dormant_rooms, g_strdup(room_id), room);
+    }
+
+    /* the summary goes first, so that we know which members are heroes */
+    summary_obj = matrix_json_object_get_object_member(room_data, "summary");
+    if(summary_obj != NULL) {
+        if(room->summary == NULL)
+            room->summary = matrix_roomsummary_new();
+        matrix_roomsummary_update(room->summary, summary_obj);
+    }
+
+    /* for a muted room, we don't keep the timeline; nor the members (other
+     * than the heroes), if we can fetch them when the room is opened */
+    muted = matrix_roomtier_get(conn, room_id) == MATRIX_ROOM_TIER_MUTED;
+    skip_members = muted && purple_account_get_bool(pc->account,
+            PRPL_ACCOUNT_OPT_LAZY_LOAD_MEMBERS, TRUE);
+
+    if(state_events != NULL) {
+        if(skip_members)
+            _skip_members(room, state_events);
+        matrix_statetable_merge(room->state_table, state_events, NULL, NULL);
+    }
+
+    timeline = _get_timeline(room_data);
+    len = timeline == NULL ? 0 : json_array_get_length(timeline);
+    for(i = 0; i < len; i++) {
+        JsonObject *event_obj = matrix_json_node_get_object(
+                json_array_get_element(timeline, i));
+        if(event_obj == NULL || !json_object_has_member(event_obj, "state_key"))
+            continue;
+        if(skip_members && g_strcmp0(matrix_json_object_get_string_member(
+                event_obj, "type"), "m.room.member") == 0 &&
+                !_keep_member(room, matrix_json_object_get_string_member(
+                        event_obj, "state_key")))
+            continue;
+        matrix_statetable_add(room->state_table, event_obj);
+    }
+
+    if(muted) {
+        if(room->timeline != NULL)
+            json_array_unref(room->timeline);
+        room->timeline = NULL;
+    } else if(len > 0) {
+        if(room->timeline != NULL)
+            json_array_unref(room->timeline);
+        room->timeline = json_array_ref(timeline);
+    }
+
+    unread = _get_unread(room_data, "notification_count");
+    if(unread >= 0)
+        room->unread = unread;
+    unread = _get_unread(room_data, "highlight_count");
+    if(unread >= 0)
+        room->highlights = unread;
+
+    _update_room_alias(conn, room_id, room);
+}
+
+
+PurpleConversation *matrix_dormantroom_promote(PurpleConnection *pc,
+        const gchar *room_id)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    PurpleConversation *conv;
+    MatrixDormantRoom *room;
+    gpointer key;
+    guint i, len;
+
+    conv = matrix_room_create_conversation(pc, room_id);
+
+    if(conn->dormant_rooms == NULL || !g_hash_table_lookup_extended(
+            conn->dormant_rooms, room_id, &key, (gpointer *) &room))
+        return conv;
+
+    purple_debug_info("matrixprpl", "promoting dormant room %s\n", room_id);
+    g_hash_table_steal(conn->dormant_rooms, room_id);
+    g_free(key);
+
+    matrix_room_handle_state_table(conv, room->state_table);
+    if(room->summary != NULL) {
+        matrix_room_set_summary(conv, room->summary);
+        room->summary = NULL;
+    }
+    matrix_room_complete_state_update(conv, FALSE);
+
+    /* the state we have is already up to date, so we only want the messages
+     * from the timeline */
+    len = room->timeline == NULL ? 0 : json_array_get_length(room->timeline);
+    for(i = 0; i < len; i++) {
+        JsonObject *event_obj = matrix_json_node_get_object(
+                json_array_get_element(room->timeline, i));
+        if(event_obj != NULL && !json_object_has_member(event_obj, "state_key"))
+            matrix_room_handle_timeline_event(conv, event_obj);
+    }
+
+    _free_room(room);
+    return conv;
+}
+
+
+void matrix_dormantroom_foreach(MatrixConnectionData *conn,
+        MatrixDormantRoomFunc func, gpointer user_data)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if(conn->dormant_rooms == NULL)
+        return;
+
+    g_hash_table_iter_init(&iter, conn->dormant_rooms);
+    while(g_hash_table_iter_next(&iter, &key, &value)) {
+        MatrixDormantRoom *room = value;
+        func(key, room->state_table, room->summary, user_data);
+    }
+}
+
+
+void matrix_dormantroom_forget(MatrixConnectionData *conn,
+        const gchar *room_id)
+{
+    if(conn->dormant_rooms != NULL)
+        g_hash_table_remove(conn->dormant_rooms, room_id);
+}
+
+
+void matrix_dormantroom_free_all(MatrixConnectionData *conn)
+{
+    if(conn->dormant_rooms != NULL)
+        g_hash_table_destroy(conn->dormant_rooms);
+    conn->dormant_rooms = NULL;
+}
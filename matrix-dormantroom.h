@@ -0,0 +1,101 @@
+/**
+ * matrix-dormantroom.h: rooms which we haven't shown to the user yet
+ *
+ * Creating a PurpleConversation for every room we are in is expensive for
+ * accounts in hundreds of rooms, and clutters up the UI with chats the user
+ * isn't interested in right now. Instead, a room starts off 'dormant': we keep
+ * its state and the last few events from its timeline on the connection, and
+ * keep its buddy list entry up to date. It is only promoted to a
+ * conversation when the server tells us there is something in it for the user
+ * to see (its unread notification count goes up), or the user opens it. How
+ * readily that happens depends on the room's tier; see matrix-roomtier.h.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_DORMANTROOM_H_
+#define MATRIX_DORMANTROOM_H_
+
+#include <glib.h>
+
+#include <json-glib/json-glib.h>
+
+#include "matrix-connection.h"
+#include "matrix-roomsummary.h"
+#include "matrix-statetable.h"
+
+struct _PurpleConnection;
+struct _PurpleConversation;
+
+/**
+ * The type of a function which can be passed to matrix_dormantroom_foreach
+ */
+typedef void (*MatrixDormantRoomFunc)(const gchar *room_id,
+        MatrixRoomStateEventTable *state_table, MatrixRoomSummary *summary,
+        gpointer user_data);
+
+/**
+ * Check if we have a dormant room with the given id
+ */
+gboolean matrix_dormantroom_exists(MatrixConnectionData *conn,
+        const gchar *room_id);
+
+/**
+ * Decide whether a room without a conversation should be promoted to one, on
+ * the basis of its entry in a sync response.
+ *
+ * @param room_data   the room's entry in rooms.join
+ */
+gboolean matrix_dormantroom_should_promote(MatrixConnectionData *conn,
+        const gchar *room_id, JsonObject *room_data);
+
+/**
+ * Apply a room's entry in a sync response to the dormant room (creating it
+ * if necessary).
+ *
+ * @param state_events  the state from the sync response, as built by
+ *                          matrix_statetable_add. It is left empty.
+ * @param room_data     the room's entry in rooms.join
+ */
+void matrix_dormantroom_update(struct _PurpleConnection *pc,
+        const gchar *room_id, MatrixRoomStateEventTable *state_events,
+        JsonObject *room_data);
+
+/**
+ * Create the conversation for a room, and hand over the state and timeline
+ * of the dormant room (if there is one).
+ */
+struct _PurpleConversation *matrix_dormantroom_promote(
+        struct _PurpleConnection *pc, const gchar *room_id);
+
+/**
+ * Call a function for each dormant room
+ */
+void matrix_dormantroom_foreach(MatrixConnectionData *conn,
+        MatrixDormantRoomFunc func, gpointer user_data);
+
+/**
+ * Forget about a dormant room, if we have one with this id
+ */
+void matrix_dormantroom_forget(MatrixConnectionData *conn,
+        const gchar *room_id);
+
+/**
+ * Free all of the dormant rooms on this connection
+ */
+void matrix_dormantroom_free_all(MatrixConnectionData *conn);
+
+#endif /* MATRIX_DORMANTROOM_H_ */
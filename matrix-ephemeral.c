@@ -0,0 +1,281 @@
+/**
+ * matrix-ephemeral.c: typing notifications and account data
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-ephemeral.h"
+
+#include <string.h>
+
+/* libmatrix */
+#include "matrix-json.h"
+
+
+static GHashTable *_new_account_data_table()
+{
+    return g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+            (GDestroyNotify) json_object_unref);
+}
+
+
+/**
+ * Get the list of events from a section of a /sync response
+ */
+static JsonArray *_get_events(JsonObject *parent, const gchar *section)
+{
+    return matrix_json_object_get_array_member(
+            matrix_json_object_get_object_member(parent, section), "events");
+}
+
+
+/**
+ * Collapse a list of account data events into a table of the latest content
+ * of each type
+ *
+ * @returns the table, or NULL if there were no events
+ */
+static GHashTable *_parse_account_data(JsonArray *events)
+{
+    GHashTable *table = NULL;
+    guint i, len;
+
+    len = events == NULL ? 0 : json_array_get_length(events);
+    for(i = 0; i < len; i++) {
+        JsonObject *event_obj = matrix_json_node_get_object(
+                json_array_get_element(events, i));
+        const gchar *event_type;
+        JsonObject *content;
+
+        event_type = matrix_json_object_get_string_member(event_obj, "type");
+        content = matrix_json_object_get_object_member(event_obj, "content");
+        if(event_type == NULL || content == NULL)
+            continue;
+
+        if(table == NULL)
+            table = _new_account_data_table();
+        g_hash_table_replace(table, g_strdup(event_type),
+                json_object_ref(content));
+    }
+    return table;
+}
+
+
+/**
+ * Build the set of typing users from the contents of an m.typing event
+ */
+static GHashTable *_parse_typing_event(JsonObject *content)
+{
+    GHashTable *typing;
+    JsonArray *user_ids;
+    guint i, len;
+
+    typing = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    user_ids = matrix_json_object_get_array_member(content, "user_ids");
+    len = user_ids == NULL ? 0 : json_array_get_length(user_ids);
+    for(i = 0; i < len; i++) {
+        const gchar *user_id = matrix_json_array_get_string_element(user_ids,
+                i);
+        if(user_id != NULL)
+            g_hash_table_replace(typing, g_strdup(user_id),
+                    GINT_TO_POINTER(1));
+    }
+    return typing;
+}
+
+
+/**
+ * Move all of the entries from one table into another
+ */
+static void _move_entries(GHashTable *dest, GHashTable *src)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, src);
+    while(g_hash_table_iter_next(&iter, &key, &value)) {
+        g_hash_table_iter_steal(&iter);
+        g_hash_table_replace(dest, key, value);
+    }
+}
+
+
+/******************************************************************************
+ *
+ * rooms
+ */
+
+MatrixRoomEphemeral *matrix_ephemeral_parse_room(JsonObject *room_data)
+{
+    MatrixRoomEphemeral *ephemeral;
+    JsonArray *events;
+    guint i, len;
+
+    ephemeral = g_new0(MatrixRoomEphemeral, 1);
+
+    events = _get_events(room_data, "ephemeral");
+    len = events == NULL ? 0 : json_array_get_length(events);
+    for(i = 0; i < len; i++) {
+        JsonObject *event_obj = matrix_json_node_get_object(
+                json_array_get_element(events, i));
+        const gchar *event_type;
+        JsonObject *content;
+
+        event_type = matrix_json_object_get_string_member(event_obj, "type");
+        content = matrix_json_object_get_object_member(event_obj, "content");
+        if(event_type == NULL || content == NULL)
+            continue;
+
+        if(strcmp(event_type, "m.typing") == 0) {
+            /* each m.typing event replaces the last */
+            if(ephemeral->typing != NULL)
+                g_hash_table_destroy(ephemeral->typing);
+            ephemeral->typing = _parse_typing_event(content);
+        }
+    }
+
+    ephemeral->account_data = _parse_account_data(
+            _get_events(room_data, "account_data"));
+
+    if(ephemeral->typing == NULL && ephemeral->account_data == NULL) {
+        g_free(ephemeral);
+        return NULL;
+    }
+    return ephemeral;
+}
+
+
+GHashTable *matrix_ephemeral_merge_room(MatrixRoomEphemeral *dest,
+        MatrixRoomEphemeral *src)
+{
+    GHashTable *changed = NULL;
+
+    if(src->typing != NULL) {
+        GHashTableIter iter;
+        gpointer key;
+
+        /* the users who have started or stopped typing */
+        changed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                NULL);
+        g_hash_table_iter_init(&iter, src->typing);
+        while(g_hash_table_iter_next(&iter, &key, NULL)) {
+            if(dest->typing == NULL ||
+                    g_hash_table_lookup(dest->typing, key) == NULL)
+                g_hash_table_replace(changed, g_strdup(key),
+                        GINT_TO_POINTER(1));
+        }
+        if(dest->typing != NULL) {
+            g_hash_table_iter_init(&iter, dest->typing);
+            while(g_hash_table_iter_next(&iter, &key, NULL)) {
+                if(g_hash_table_lookup(src->typing, key) == NULL)
+                    g_hash_table_replace(changed, g_strdup(key),
+                            GINT_TO_POINTER(1));
+            }
+            g_hash_table_destroy(dest->typing);
+        }
+
+        if(g_hash_table_size(changed) == 0) {
+            g_hash_table_destroy(changed);
+            changed = NULL;
+        }
+
+        dest->typing = src->typing;
+        src->typing = NULL;
+    }
+
+    if(src->account_data != NULL) {
+        if(dest->account_data == NULL) {
+            dest->account_data = src->account_data;
+        } else {
+            _move_entries(dest->account_data, src->account_data);
+            g_hash_table_destroy(src->account_data);
+        }
+        src->account_data = NULL;
+    }
+
+    return changed;
+}
+
+
+void matrix_ephemeral_free_room(MatrixRoomEphemeral *ephemeral)
+{
+    if(ephemeral->typing != NULL)
+        g_hash_table_destroy(ephemeral->typing);
+    if(ephemeral->account_data != NULL)
+        g_hash_table_destroy(ephemeral->account_data);
+    g_free(ephemeral);
+}
+
+
+/******************************************************************************
+ *
+ * global account data
+ */
+
+MatrixGlobalEphemeral *matrix_ephemeral_parse_global(JsonObject *root_obj)
+{
+    MatrixGlobalEphemeral *ephemeral;
+    GHashTable *account_data;
+
+    /* we don't show presence yet, so we ignore it rather than keeping an
+     * entry for everyone we share a room with */
+    account_data = _parse_account_data(_get_events(root_obj, "account_data"));
+    if(account_data == NULL)
+        return NULL;
+
+    ephemeral = g_new0(MatrixGlobalEphemeral, 1);
+    ephemeral->account_data = account_data;
+    return ephemeral;
+}
+
+
+void matrix_ephemeral_apply_global(MatrixConnectionData *conn,
+        MatrixGlobalEphemeral *ephemeral)
+{
+    MatrixGlobalEphemeral *dest = conn->ephemeral;
+
+    if(dest == NULL) {
+        conn->ephemeral = ephemeral;
+        return;
+    }
+
+    if(ephemeral->account_data != NULL) {
+        if(dest->account_data == NULL) {
+            dest->account_data = ephemeral->account_data;
+            ephemeral->account_data = NULL;
+        } else {
+            _move_entries(dest->account_data, ephemeral->account_data);
+        }
+    }
+
+    matrix_ephemeral_free_global(ephemeral);
+}
+
+
+void matrix_ephemeral_free_global(MatrixGlobalEphemeral *ephemeral)
+{
+    if(ephemeral->account_data != NULL)
+        g_hash_table_destroy(ephemeral->account_data);
+    g_free(ephemeral);
+}
+
+
+JsonObject *matrix_ephemeral_get_account_data(MatrixConnectionData *conn,
+        const gchar *event_type)
+{
+    if(conn->ephemeral == NULL || conn->ephemeral->account_data == NULL)
+        return NULL;
+    return g_hash_table_lookup(conn->ephemeral->account_data, event_type);
+}
@@ -0,0 +1,101 @@
+/**
+ * matrix-ephemeral.h: typing notifications and account data
+ *
+ * Unlike the timeline, we don't care about each of these events in turn: only
+ * the latest state for each user (or each type of account data) matters. So
+ * rather than handling the events one at a time (and updating the UI each
+ * time), we collapse the events in each /sync response down to that latest
+ * state on the worker thread, and then apply the result in one go.
+ *
+ * We don't show read receipts, so they are dropped here, rather than keeping
+ * one for everyone in every room.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_EPHEMERAL_H_
+#define MATRIX_EPHEMERAL_H_
+
+#include <glib.h>
+
+#include <json-glib/json-glib.h>
+
+#include "matrix-connection.h"
+
+/* the latest ephemeral state and account data for a room */
+typedef struct _MatrixRoomEphemeral {
+    /* the set of user ids who are typing; NULL if we haven't been told */
+    GHashTable *typing;
+
+    /* map from event type to the content (JsonObject *) of the room's
+     * account data of that type; NULL if none */
+    GHashTable *account_data;
+} MatrixRoomEphemeral;
+
+/* the latest global account data */
+typedef struct _MatrixGlobalEphemeral {
+    /* map from event type to the content (JsonObject *) of the account data
+     * of that type; NULL if none */
+    GHashTable *account_data;
+} MatrixGlobalEphemeral;
+
+
+/**
+ * Collapse the 'ephemeral' and 'account_data' sections of a room in a /sync
+ * response. This is thread-safe.
+ *
+ * @returns a new MatrixRoomEphemeral, or NULL if there was nothing of
+ *    interest
+ */
+MatrixRoomEphemeral *matrix_ephemeral_parse_room(JsonObject *room_data);
+
+/**
+ * Merge the state from one MatrixRoomEphemeral into another. The entries are
+ * moved from src, which should then be freed.
+ *
+ * @returns the set of user ids whose typing state changed (which should be
+ *    freed by the caller), or NULL if none did
+ */
+GHashTable *matrix_ephemeral_merge_room(MatrixRoomEphemeral *dest,
+        MatrixRoomEphemeral *src);
+
+void matrix_ephemeral_free_room(MatrixRoomEphemeral *ephemeral);
+
+/**
+ * Collapse the 'account_data' section of a /sync response. This is
+ * thread-safe.
+ *
+ * @returns a new MatrixGlobalEphemeral, or NULL if there was nothing of
+ *    interest
+ */
+MatrixGlobalEphemeral *matrix_ephemeral_parse_global(JsonObject *root_obj);
+
+/**
+ * Apply the results of matrix_ephemeral_parse_global to the connection.
+ * Takes ownership of the MatrixGlobalEphemeral.
+ */
+void matrix_ephemeral_apply_global(MatrixConnectionData *conn,
+        MatrixGlobalEphemeral *ephemeral);
+
+void matrix_ephemeral_free_global(MatrixGlobalEphemeral *ephemeral);
+
+/**
+ * Get the content of an account data event, or NULL if none
+ */
+JsonObject *matrix_ephemeral_get_account_data(MatrixConnectionData *conn,
+        const gchar *event_type);
+
+#endif /* MATRIX_EPHEMERAL_H_ */
@@ -0,0 +1,231 @@
+/**
+ * matrix-invite.c: handling of invitations to rooms
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-invite.h"
+
+#include <string.h>
+
+/* libpurple */
+#include "connection.h"
+#include "debug.h"
+#include "server.h"
+
+/* libmatrix */
+#include "libmatrix.h"
+#include "matrix-json.h"
+
+
+/* what we know about an invitation */
+typedef struct _MatrixInviteSummary {
+    /* a hash of the parts of the invite state we look at, so that we can tell
+     * if it has changed */
+    guint fingerprint;
+
+    gchar *inviter;
+    gchar *room_name;
+
+    /* from the room summary; 0 if the server didn't give us one */
+    guint member_count;
+} MatrixInviteSummary;
+
+
+/* the fields of interest from the invite state, pointing into the sync
+ * response */
+typedef struct {
+    guint fingerprint;
+    const gchar *inviter;
+    const gchar *name;
+    const gchar *canonical_alias;
+    const gchar *alias;
+} MatrixInviteScan;
+
+
+static void _free_summary(MatrixInviteSummary *summary)
+{
+    g_free(summary->inviter);
+    g_free(summary->room_name);
+    g_free(summary);
+}
+
+
+static guint _hash_str(guint hash, const gchar *str)
+{
+    return hash * 31 + (str == NULL ? 0 : g_str_hash(str));
+}
+
+
+/**
+ * Pick out the fields of interest from a single stripped state event
+ */
+static void _scan_event(MatrixConnectionData *conn, JsonObject *event_obj,
+        MatrixInviteScan *scan)
+{
+    const gchar *event_type, *state_key, *sender;
+    JsonObject *content;
+    const gchar *value = NULL;
+
+    event_type = matrix_json_object_get_string_member(event_obj, "type");
+    state_key = matrix_json_object_get_string_member(event_obj, "state_key");
+    sender = matrix_json_object_get_string_member(event_obj, "sender");
+    content = matrix_json_object_get_object_member(event_obj, "content");
+    if(event_type == NULL || state_key == NULL || content == NULL)
+        return;
+
+    if(strcmp(event_type, "m.room.member") == 0) {
+        value = matrix_json_object_get_string_member(content, "membership");
+        if(g_strcmp0(state_key, conn->user_id) == 0)
+            scan->inviter = sender;
+    } else if(strcmp(event_type, "m.room.name") == 0) {
+        value = matrix_json_object_get_string_member(content, "name");
+        scan->name = value;
+    } else if(strcmp(event_type, "m.room.canonical_alias") == 0) {
+        value = matrix_json_object_get_string_member(content, "alias");
+        scan->canonical_alias = value;
+    } else if(strcmp(event_type, "m.room.aliases") == 0) {
+        JsonArray *aliases = matrix_json_object_get_array_member(content,
+                "aliases");
+        if(aliases != NULL && json_array_get_length(aliases) > 0)
+            value = matrix_json_array_get_string_element(aliases, 0);
+        if(scan->alias == NULL)
+            scan->alias = value;
+    }
+
+    scan->fingerprint = _hash_str(scan->fingerprint, event_type);
+    scan->fingerprint = _hash_str(scan->fingerprint, state_key);
+    scan->fingerprint = _hash_str(scan->fingerprint, sender);
+    scan->fingerprint = _hash_str(scan->fingerprint, value);
+}
+
+
+/**
+ * Work out the room name in the same way as
+ * matrix_statetable_get_room_alias, falling back to the inviter.
+ */
+static const gchar *_get_room_name(MatrixInviteScan *scan,
+        const gchar *inviter)
+{
+    if(scan->name != NULL && scan->name[0] != '\0')
+        return scan->name;
+    if(scan->canonical_alias != NULL)
+        return scan->canonical_alias;
+    if(scan->alias != NULL)
+        return scan->alias;
+    return inviter;
+}
+
+
+/**
+ * tell purple about our incoming invitation
+ */
+static void _raise_invite_request(PurpleConnection *pc,
+        const gchar *room_id, MatrixInviteSummary *summary)
+{
+    GHashTable *components;
+    gchar *message = NULL;
+
+    /* libpurple destroys the hashtable when the invite is dealt with. */
+    components = g_hash_table_new_full(g_str_hash, g_str_equal,
+            NULL, g_free);
+    g_hash_table_insert(components, PRPL_CHAT_INFO_ROOM_ID, g_strdup(room_id));
+
+    if(summary->member_count > 0)
+        message = g_strdup_printf(ngettext("%u member", "%u members",
+                summary->member_count), summary->member_count);
+
+    serv_got_chat_invite(pc, summary->room_name, summary->inviter, message,
+            components);
+    g_free(message);
+}
+
+
+/******************************************************************************
+ *
+ * public api
+ */
+
+void matrix_invite_handle(MatrixConnectionData *conn, const gchar *room_id,
+        JsonObject *invite_data)
+{
+    JsonObject *invite_state_object;
+    JsonArray *events;
+    MatrixInviteScan scan;
+    MatrixInviteSummary *summary;
+    const gchar *inviter;
+    guint i, len;
+
+    invite_state_object = matrix_json_object_get_object_member(invite_data,
+            "invite_state");
+    events = matrix_json_object_get_array_member(invite_state_object,
+            "events");
+
+    if(events == NULL) {
+        purple_debug_warning("prplmatrix", "no events array in invite event\n");
+        return;
+    }
+
+    memset(&scan, 0, sizeof(scan));
+    len = json_array_get_length(events);
+    scan.fingerprint = len;
+    for(i = 0; i < len; i++) {
+        JsonObject *event_obj = matrix_json_node_get_object(
+                json_array_get_element(events, i));
+        if(event_obj == NULL) {
+            purple_debug_warning("prplmatrix", "non-object event");
+            continue;
+        }
+        _scan_event(conn, event_obj, &scan);
+    }
+
+    if(conn->invites == NULL)
+        conn->invites = g_hash_table_new_full(g_str_hash, g_str_equal,
+                g_free, (GDestroyNotify) _free_summary);
+
+    summary = g_hash_table_lookup(conn->invites, room_id);
+    if(summary != NULL && summary->fingerprint == scan.fingerprint) {
+        purple_debug_info("matrixprpl", "invite to %s unchanged\n", room_id);
+        return;
+    }
+
+    inviter = scan.inviter != NULL ? scan.inviter : "?";
+
+    summary = g_new0(MatrixInviteSummary, 1);
+    summary->fingerprint = scan.fingerprint;
+    summary->inviter = g_strdup(inviter);
+    summary->room_name = g_strdup(_get_room_name(&scan, inviter));
+    summary->member_count = matrix_json_object_get_int_member(
+            matrix_json_object_get_object_member(invite_data, "summary"),
+            "m.joined_member_count");
+    g_hash_table_replace(conn->invites, g_strdup(room_id), summary);
+
+    _raise_invite_request(conn->pc, room_id, summary);
+}
+
+
+void matrix_invite_forget(MatrixConnectionData *conn, const gchar *room_id)
+{
+    if(conn->invites != NULL)
+        g_hash_table_remove(conn->invites, room_id);
+}
+
+
+void matrix_invite_free_all(MatrixConnectionData *conn)
+{
+    if(conn->invites != NULL)
+        g_hash_table_destroy(conn->invites);
+    conn->invites = NULL;
+}
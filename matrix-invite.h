@@ -0,0 +1,64 @@
+/**
+ * matrix-invite.h: handling of invitations to rooms
+ *
+ * The sync response gives us a few 'stripped' state events for each room we
+ * have been invited to. Rather than building a state table for each one, we
+ * pick out the few things we need (who invited us, and what the room is
+ * called) in a single pass over the events. The stripped state only has a few
+ * of the members, so the member count comes from the room summary, if the
+ * server gives us one.
+ *
+ * The summaries are kept until we join or reject the room, so that when an
+ * invite turns up again unchanged on the same connection (as it does when the
+ * sync starts again from scratch, or when a room comes back into the sliding
+ * sync window) we neither rebuild the summary nor ask the user about it again.
+ * They go with the connection, though, so the user is asked about each
+ * outstanding invite once per login.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_INVITE_H_
+#define MATRIX_INVITE_H_
+
+#include <glib.h>
+
+#include <json-glib/json-glib.h>
+
+#include "matrix-connection.h"
+
+/**
+ * Handle a room from the 'invite' section of a sync response: tell purple
+ * about the invitation, unless we already have done so.
+ *
+ * @param conn         the connection
+ * @param room_id      the room we have been invited to
+ * @param invite_data  the object for the room from the sync response
+ */
+void matrix_invite_handle(MatrixConnectionData *conn, const gchar *room_id,
+        JsonObject *invite_data);
+
+/**
+ * Forget about an invitation, because we have joined or rejected the room.
+ */
+void matrix_invite_forget(MatrixConnectionData *conn, const gchar *room_id);
+
+/**
+ * Free all of the invitation summaries on this connection
+ */
+void matrix_invite_free_all(MatrixConnectionData *conn);
+
+#endif /* MATRIX_INVITE_H_ */
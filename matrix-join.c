@@ -0,0 +1,295 @@
+/**
+ * matrix-join.c: populating rooms we have just joined
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-join.h"
+
+#include <string.h>
+
+/* json-glib */
+#include <json-glib/json-glib.h>
+
+/* libpurple */
+#include "connection.h"
+#include "conversation.h"
+#include "debug.h"
+
+/* libmatrix */
+#include "matrix-api.h"
+#include "matrix-dormantroom.h"
+#include "matrix-json.h"
+#include "matrix-room.h"
+#include "matrix-roomregistry.h"
+#include "matrix-statetable.h"
+
+/* the number of recent messages we fetch for a room we have joined */
+#define JOIN_MESSAGES_LIMIT 20
+
+
+typedef struct _MatrixJoinFetch {
+    MatrixConnectionData *conn;
+    gchar *room_id;
+
+    /* the active requests, if any */
+    MatrixApiRequestData *state_request;
+    MatrixApiRequestData *messages_request;
+
+    /* the number of requests which haven't yet called back */
+    guint pending;
+
+    /* the results so far: the state events, and the latest timeline events
+     * (newest first) */
+    JsonArray *state;
+    JsonArray *messages;
+
+    /* TRUE if either request failed (or was cancelled) */
+    gboolean failed;
+} MatrixJoinFetch;
+
+
+static void _free_fetch(MatrixJoinFetch *fetch)
+{
+    if(fetch->state != NULL)
+        json_array_unref(fetch->state);
+    if(fetch->messages != NULL)
+        json_array_unref(fetch->messages);
+    g_free(fetch->room_id);
+    g_free(fetch);
+}
+
+
+/**
+ * Build the conversation for the room from the fetched state and messages
+ */
+static void _populate_room(MatrixJoinFetch *fetch)
+{
+    MatrixConnectionData *conn = fetch->conn;
+    PurpleConversation *conv;
+    MatrixRoomStateEventTable *state_table;
+    guint i, len, invalid = 0;
+
+    if(matrix_roomregistry_get_conversation(conn, fetch->room_id) != NULL) {
+        /* the room turned up in a /sync first */
+        purple_debug_info("matrixprpl", "already have room %s\n",
+                fetch->room_id);
+        return;
+    }
+
+    purple_debug_info("matrixprpl", "populating room %s after join\n",
+            fetch->room_id);
+
+    state_table = matrix_statetable_new();
+    len = json_array_get_length(fetch->state);
+    for(i = 0; i < len; i++) {
+        JsonObject *event = matrix_json_node_get_object(
+                json_array_get_element(fetch->state, i));
+        if(event == NULL || !matrix_statetable_add(state_table, event))
+            invalid++;
+    }
+    if(invalid > 0)
+        purple_debug_warning("matrixprpl",
+                "%u state events in %s missing fields\n", invalid,
+                fetch->room_id);
+
+    conv = matrix_dormantroom_promote(conn->pc, fetch->room_id);
+    matrix_room_handle_state_table(conv, state_table);
+    matrix_statetable_destroy(state_table);
+    matrix_room_complete_state_update(conv, FALSE);
+
+    /* the state we have is already up to date, so we only want the messages.
+     * The events are newest first. */
+    len = fetch->messages == NULL ? 0 : json_array_get_length(fetch->messages);
+    for(i = len; i > 0; i--) {
+        JsonObject *event_obj = matrix_json_node_get_object(
+                json_array_get_element(fetch->messages, i-1));
+        if(event_obj != NULL && !json_object_has_member(event_obj, "state_key"))
+            matrix_room_handle_timeline_event(conv, event_obj);
+    }
+}
+
+
+/**
+ * One of the requests has called back: if that was the last, finish off the
+ * fetch and free it
+ */
+static void _request_done(MatrixJoinFetch *fetch)
+{
+    if(--fetch->pending > 0)
+        return;
+
+    g_hash_table_remove(fetch->conn->join_fetches, fetch->room_id);
+
+    /* we can do without the messages, but not the state */
+    if(fetch->state != NULL && !fetch->failed)
+        _populate_room(fetch);
+
+    _free_fetch(fetch);
+}
+
+
+static void _state_complete(MatrixConnectionData *conn, gpointer user_data,
+        JsonNode *json_root)
+{
+    MatrixJoinFetch *fetch = user_data;
+    JsonArray *state = matrix_json_node_get_array(json_root);
+
+    fetch->state_request = NULL;
+    if(state != NULL)
+        fetch->state = json_array_ref(state);
+    _request_done(fetch);
+}
+
+
+static void _state_error(MatrixConnectionData *conn, gpointer user_data,
+        const gchar *error_message)
+{
+    MatrixJoinFetch *fetch = user_data;
+
+    fetch->state_request = NULL;
+    if(strcmp(error_message, "cancelled") != 0)
+        purple_debug_info("matrixprpl", "unable to fetch state for %s: %s\n",
+                fetch->room_id, error_message);
+    fetch->failed = TRUE;
+    _request_done(fetch);
+}
+
+
+static void _state_bad_response(MatrixConnectionData *conn,
+        gpointer user_data, int http_response_code, JsonNode *json_root)
+{
+    MatrixJoinFetch *fetch = user_data;
+
+    fetch->state_request = NULL;
+    purple_debug_info("matrixprpl", "unable to fetch state for %s: %i\n",
+            fetch->room_id, http_response_code);
+    fetch->failed = TRUE;
+    _request_done(fetch);
+}
+
+
+static void _messages_complete(MatrixConnectionData *conn, gpointer user_data,
+        JsonNode *json_root)
+{
+    MatrixJoinFetch *fetch = user_data;
+    JsonArray *chunk;
+
+    fetch->messages_request = NULL;
+    chunk = matrix_json_object_get_array_member(
+            matrix_json_node_get_object(json_root), "chunk");
+    if(chunk != NULL)
+        fetch->messages = json_array_ref(chunk);
+    _request_done(fetch);
+}
+
+
+static void _messages_error(MatrixConnectionData *conn, gpointer user_data,
+        const gchar *error_message)
+{
+    MatrixJoinFetch *fetch = user_data;
+
+    fetch->messages_request = NULL;
+
+    /* the room is still usable without the messages, unless we have been
+     * cancelled */
+    if(strcmp(error_message, "cancelled") == 0)
+        fetch->failed = TRUE;
+    else
+        purple_debug_info("matrixprpl", "unable to fetch messages for %s: %s\n",
+                fetch->room_id, error_message);
+    _request_done(fetch);
+}
+
+
+static void _messages_bad_response(MatrixConnectionData *conn,
+        gpointer user_data, int http_response_code, JsonNode *json_root)
+{
+    MatrixJoinFetch *fetch = user_data;
+
+    fetch->messages_request = NULL;
+    purple_debug_info("matrixprpl", "unable to fetch messages for %s: %i\n",
+            fetch->room_id, http_response_code);
+    _request_done(fetch);
+}
+
+
+/******************************************************************************
+ *
+ * public api
+ */
+
+void matrix_join_populate(MatrixConnectionData *conn, const gchar *room_id)
+{
+    MatrixJoinFetch *fetch;
+    MatrixApiRequestData *request;
+
+    if(matrix_roomregistry_get_conversation(conn, room_id) != NULL)
+        return;
+
+    if(conn->join_fetches == NULL)
+        conn->join_fetches = g_hash_table_new(g_str_hash, g_str_equal);
+    else if(g_hash_table_lookup(conn->join_fetches, room_id) != NULL)
+        return;
+
+    fetch = g_new0(MatrixJoinFetch, 1);
+    fetch->conn = conn;
+    fetch->room_id = g_strdup(room_id);
+    g_hash_table_insert(conn->join_fetches, fetch->room_id, fetch);
+
+    /* hold an extra count while we start the requests, so that a request
+     * which fails straight away can't free the fetch under our feet */
+    fetch->pending = 3;
+
+    request = matrix_api_get_room_state(conn, room_id, _state_complete,
+            _state_error, _state_bad_response, fetch);
+    if(request != NULL)
+        fetch->state_request = request;
+
+    request = matrix_api_get_room_messages(conn, room_id, NULL, NULL,
+            JOIN_MESSAGES_LIMIT, _messages_complete, _messages_error,
+            _messages_bad_response, fetch);
+    if(request != NULL)
+        fetch->messages_request = request;
+
+    _request_done(fetch);
+}
+
+
+void matrix_join_cancel_all(MatrixConnectionData *conn)
+{
+    GList *fetches, *elem;
+
+    if(conn->join_fetches == NULL)
+        return;
+
+    fetches = g_hash_table_get_values(conn->join_fetches);
+    for(elem = fetches; elem != NULL; elem = elem->next) {
+        MatrixJoinFetch *fetch = elem->data;
+        MatrixApiRequestData *state_request = fetch->state_request;
+        MatrixApiRequestData *messages_request = fetch->messages_request;
+
+        /* cancelling the last request frees the fetch */
+        fetch->failed = TRUE;
+        if(state_request != NULL)
+            matrix_api_cancel(state_request);
+        if(messages_request != NULL)
+            matrix_api_cancel(messages_request);
+    }
+    g_list_free(fetches);
+
+    g_hash_table_destroy(conn->join_fetches);
+    conn->join_fetches = NULL;
+}
@@ -0,0 +1,46 @@
+/**
+ * matrix-join.h: populating rooms we have just joined
+ *
+ * When we join a room, the server doesn't tell us anything about it until
+ * it turns up in a later /sync, which may not be until the current long-poll
+ * returns. Rather than waiting for that, once the join completes we fetch the
+ * room's state and latest messages directly (in parallel), and build the
+ * conversation from those. When the room does turn up in /sync, it is merged
+ * in as for any other room we already know about.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_JOIN_H_
+#define MATRIX_JOIN_H_
+
+#include <glib.h>
+
+#include "matrix-connection.h"
+
+/**
+ * Start fetching the state and latest messages for a room we have just
+ * joined. If the room turns up in a /sync before we are done, the results
+ * are discarded.
+ */
+void matrix_join_populate(MatrixConnectionData *conn, const gchar *room_id);
+
+/**
+ * Cancel all of the fetches in progress on a connection
+ */
+void matrix_join_cancel_all(MatrixConnectionData *conn);
+
+#endif /* MATRIX_JOIN_H_ */
@@ -40,6 +40,15 @@ gint64 matrix_json_node_get_int(JsonNode *node)
 	return json_node_get_int(node);
 }
 
+gboolean matrix_json_node_get_boolean(JsonNode *node)
+{
+	if(node == NULL)
+		return FALSE;
+	if(JSON_NODE_TYPE(node) != JSON_NODE_VALUE)
+		return FALSE;
+	return json_node_get_boolean(node);
+}
+
 
 JsonObject *matrix_json_node_get_object (JsonNode *node)
 {
@@ -90,6 +99,14 @@ gint64 matrix_json_object_get_int_member(JsonObject  *object,
     return matrix_json_node_get_int(member);
 }
 
+gboolean matrix_json_object_get_boolean_member(JsonObject  *object,
+		const gchar *member_name)
+{
+	JsonNode *member;
+	member = matrix_json_object_get_member(object, member_name);
+    return matrix_json_node_get_boolean(member);
+}
+
 
 JsonObject *matrix_json_object_get_object_member(JsonObject  *object,
 		const gchar *member_name)
@@ -27,14 +27,21 @@
 
 #include "libmatrix.h"
 #include "matrix-api.h"
+#include "matrix-backfill.h"
+#include "matrix-ephemeral.h"
 #include "matrix-event.h"
 #include "matrix-json.h"
 #include "matrix-roommembers.h"
+#include "matrix-roomregistry.h"
+#include "matrix-roomsummary.h"
+#include "matrix-seenevents.h"
+#include "matrix-slidingsync.h"
 #include "matrix-statetable.h"
 
 
 static gchar *_get_room_name(MatrixConnectionData *conn,
         PurpleConversation *conv);
+static void _cancel_members_fetch(PurpleConversation *conv);
 
 static MatrixConnectionData *_get_connection_data_from_conversation(
         PurpleConversation *conv)
@@ -63,9 +70,25 @@ static MatrixConnectionData *_get_connection_data_from_conversation(
 /* MatrixRoomMemberTable * - see below */
 #define PURPLE_CONV_MEMBER_TABLE "member_table"
 
+/* MatrixApiRequestData * for an in-progress /members request */
+#define PURPLE_CONV_DATA_MEMBERS_FETCH "members_fetch"
+
+/* if the last /members request failed, the time (in seconds, on the
+ * g_get_monotonic_time clock) before which we won't try again, as a
+ * GUINT_TO_POINTER; otherwise NULL */
+#define PURPLE_CONV_DATA_MEMBERS_RETRY "members_retry"
+
+/* MatrixRoomSummary *, or NULL if the server hasn't sent one */
+#define PURPLE_CONV_DATA_SUMMARY "summary"
+
+/* MatrixRoomEphemeral *: the latest typing notifications and room account
+ * data; NULL if we haven't had any */
+#define PURPLE_CONV_DATA_EPHEMERAL "ephemeral"
+
 /* PURPLE_CONV_FLAG_* */
 #define PURPLE_CONV_FLAGS "flags"
 #define PURPLE_CONV_FLAG_NEEDS_NAME_UPDATE 0x1
+#define PURPLE_CONV_FLAG_MEMBERS_LOADED 0x2
 
 
 /**
@@ -81,7 +104,7 @@ static MatrixRoomMemberTable *matrix_room_get_member_table(
 /**
  * Get the state table for a room
  */
-static MatrixRoomStateEventTable *matrix_room_get_state_table(
+MatrixRoomStateEventTable *matrix_room_get_state_table(
         PurpleConversation *conv)
 {
     return purple_conversation_get_data(conv, PURPLE_CONV_DATA_STATE);
@@ -123,7 +146,7 @@ static void _update_room_alias(PurpleConversation *conv)
     room_name = _get_room_name(conn, conv);
 
     /* update the buddy list entry */
-    chat = purple_blist_find_chat(conv->account, conv->name);
+    chat = matrix_roomregistry_get_chat(conn, conv->name);
     /* we know there should be a buddy list entry for this room */
     g_assert(chat != NULL);
     purple_blist_alias_chat(chat, room_name);
@@ -194,6 +217,14 @@ static void _on_state_update(const gchar *event_type,
     }
 }
 
+gboolean matrix_room_member_change_pending(PurpleConversation *conv,
+        const gchar *user_id)
+{
+    return matrix_roommembers_has_pending_change(
+            matrix_room_get_member_table(conv), user_id);
+}
+
+
 void matrix_room_handle_state_event(struct _PurpleConversation *conv,
         JsonObject *json_event_obj)
 {
@@ -203,12 +234,134 @@ void matrix_room_handle_state_event(struct _PurpleConversation *conv,
 }
 
 
-static gint _compare_member_user_id(const MatrixRoomMember *m,
+void matrix_room_handle_state_table(struct _PurpleConversation *conv,
+        MatrixRoomStateEventTable *state_events)
+{
+    MatrixRoomStateEventTable *state_table = matrix_room_get_state_table(conv);
+    matrix_statetable_merge(state_table, state_events,
+            _on_state_update, conv);
+}
+
+
+MatrixRoomSummary *matrix_room_get_summary(PurpleConversation *conv)
+{
+    return purple_conversation_get_data(conv, PURPLE_CONV_DATA_SUMMARY);
+}
+
+
+void matrix_room_handle_summary(PurpleConversation *conv,
+        JsonObject *summary_obj)
+{
+    MatrixRoomSummary *summary;
+
+    if(summary_obj == NULL)
+        return;
+
+    summary = matrix_room_get_summary(conv);
+    if(summary == NULL) {
+        summary = matrix_roomsummary_new();
+        purple_conversation_set_data(conv, PURPLE_CONV_DATA_SUMMARY, summary);
+    }
+
+    if(matrix_roomsummary_update(summary, summary_obj))
+        _schedule_name_update(conv);
+}
+
+
+void matrix_room_set_summary(PurpleConversation *conv,
+        MatrixRoomSummary *summary)
+{
+    MatrixRoomSummary *old_summary;
+
+    old_summary = matrix_room_get_summary(conv);
+    if(old_summary != NULL)
+        matrix_roomsummary_free(old_summary);
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_SUMMARY, summary);
+    if(summary != NULL)
+        _schedule_name_update(conv);
+}
+
+
+MatrixRoomEphemeral *matrix_room_get_ephemeral(PurpleConversation *conv)
+{
+    return purple_conversation_get_data(conv, PURPLE_CONV_DATA_EPHEMERAL);
+}
+
+
+/**
+ * Set or clear the typing flag on a member of the room, if we have told
+ * purple about them.
+ */
+static void _update_typing_flag(PurpleConversation *conv,
+        MatrixRoomMemberTable *member_table, GHashTable *typing,
         const gchar *user_id)
 {
-    return g_strcmp0(matrix_roommember_get_user_id(m), user_id);
+    MatrixRoomMember *member;
+    const gchar *displayname;
+    PurpleConvChat *chat = PURPLE_CONV_CHAT(conv);
+    PurpleConvChatBuddyFlags flags;
+
+    member = matrix_roommembers_lookup_member(member_table, user_id);
+    if(member == NULL)
+        return;
+    displayname = matrix_roommember_get_opaque_data(member);
+    if(displayname == NULL)
+        return;
+
+    flags = purple_conv_chat_user_get_flags(chat, displayname);
+    if(typing != NULL && g_hash_table_lookup(typing, user_id) != NULL)
+        flags |= PURPLE_CBFLAGS_TYPING;
+    else
+        flags &= ~PURPLE_CBFLAGS_TYPING;
+    purple_conv_chat_user_set_flags(chat, displayname, flags);
+}
+
+
+void matrix_room_handle_ephemeral(PurpleConversation *conv,
+        MatrixRoomEphemeral *ephemeral)
+{
+    MatrixRoomEphemeral *current = matrix_room_get_ephemeral(conv);
+    MatrixRoomMemberTable *member_table;
+    GHashTable *changed;
+    GHashTableIter iter;
+    gpointer key;
+
+    if(current == NULL) {
+        current = g_new0(MatrixRoomEphemeral, 1);
+        purple_conversation_set_data(conv, PURPLE_CONV_DATA_EPHEMERAL,
+                current);
+    }
+
+    changed = matrix_ephemeral_merge_room(current, ephemeral);
+    matrix_ephemeral_free_room(ephemeral);
+    if(changed == NULL)
+        return;
+
+    /* only touch the members whose typing state has actually changed: each
+     * update means a redraw of the member list */
+    member_table = matrix_room_get_member_table(conv);
+    g_hash_table_iter_init(&iter, changed);
+    while(g_hash_table_iter_next(&iter, &key, NULL))
+        _update_typing_flag(conv, member_table, current->typing, key);
+    g_hash_table_destroy(changed);
 }
 
+
+/**
+ * Look up the displayname of a member (as a MatrixRoomSummaryDisplaynameFunc)
+ */
+static const gchar *_get_member_displayname(const gchar *user_id,
+        gpointer user_data)
+{
+    PurpleConversation *conv = user_data;
+    MatrixRoomMember *member;
+
+    member = matrix_roommembers_lookup_member(
+            matrix_room_get_member_table(conv), user_id);
+    return member == NULL ? NULL : matrix_roommember_get_displayname(member);
+}
+
+
 /**
  * figure out the best name for a room based on its members list
  *
@@ -217,42 +370,21 @@ static gint _compare_member_user_id(const MatrixRoomMember *m,
 static gchar *_get_room_name_from_members(MatrixConnectionData *conn,
         PurpleConversation *conv)
 {
-    GList *tmp, *members;
-    const gchar *member1;
+    GList *members, *elem, *user_ids = NULL;
     gchar *res;
-    MatrixRoomMemberTable *member_table;
-
-    member_table = matrix_room_get_member_table(conv);
-    members = matrix_roommembers_get_active_members(member_table, TRUE);
 
-    /* remove ourselves from the list */
-    tmp = g_list_find_custom(members, conn->user_id,
-            (GCompareFunc)_compare_member_user_id);
-    if(tmp != NULL) {
-        members = g_list_delete_link(members, tmp);
+    members = matrix_roommembers_get_active_members(
+            matrix_room_get_member_table(conv), TRUE);
+    for(elem = members; elem != NULL; elem = elem->next) {
+        const gchar *user_id = matrix_roommember_get_user_id(elem->data);
+        if(g_strcmp0(user_id, conn->user_id) != 0)
+            user_ids = g_list_prepend(user_ids, (gpointer) user_id);
     }
-
-    if(members == NULL) {
-        /* nobody else here! */
-        return NULL;
-    }
-
-    member1 = matrix_roommember_get_displayname(members->data);
-
-    if(members->next == NULL) {
-        /* one other person */
-        res = g_strdup(member1);
-    } else if(members->next->next == NULL) {
-        /* two other people */
-        const gchar *member2 = matrix_roommember_get_displayname(
-                members->next->data);
-        res = g_strdup_printf(_("%s and %s"), member1, member2);
-    } else {
-        int nmembers = g_list_length(members);
-        res = g_strdup_printf(_("%s and %i others"), member1, nmembers);
-    }
-
     g_list_free(members);
+
+    res = matrix_roomsummary_get_name_from_members(user_ids,
+            _get_member_displayname, conv);
+    g_list_free(user_ids);
     return res;
 }
 
@@ -266,6 +398,7 @@ static gchar *_get_room_name(MatrixConnectionData *conn,
         PurpleConversation *conv)
 {
     MatrixRoomStateEventTable *state_table = matrix_room_get_state_table(conv);
+    MatrixRoomSummary *summary;
     gchar *res;
 
     /* first try to pick a name based on the official name / alias */
@@ -273,6 +406,16 @@ static gchar *_get_room_name(MatrixConnectionData *conn,
     if (res)
         return res;
 
+    /* if the server has picked out some members to name the room after, use
+     * them; that saves us going through the whole member list */
+    summary = matrix_room_get_summary(conv);
+    if (summary) {
+        res = matrix_roomsummary_get_name(summary, _get_member_displayname,
+                conv);
+        if (res)
+            return res;
+    }
+
     /* look for room members, and pick a name based on that */
     res = _get_room_name_from_members(conn, conv);
     if (res)
@@ -572,10 +715,15 @@ static void _cancel_event_send(PurpleConversation *conv)
 
 /*****************************************************************************/
 
-void matrix_room_handle_timeline_event(PurpleConversation *conv,
-       JsonObject *json_event_obj)
+/**
+ * Show a timeline event
+ *
+ * @param record_seen  TRUE to add the event to the ids in matrix-seenevents.c
+ */
+static void _handle_timeline_event(PurpleConversation *conv,
+       JsonObject *json_event_obj, gboolean record_seen)
 {
-    const gchar *event_type, *sender_id, *transaction_id;
+    const gchar *event_type, *sender_id, *transaction_id, *event_id;
     gint64 timestamp;
     JsonObject *json_content_obj;
     JsonObject *json_unsigned_obj;
@@ -585,9 +733,19 @@ void matrix_room_handle_timeline_event(PurpleConversation *conv,
 
     const gchar *sender_display_name;
     MatrixRoomMember *sender = NULL;
+    MatrixConnectionData *conn = _get_connection_data_from_conversation(conv);
 
     room_id = conv->name;
 
+    /* if we have shown this one already, there's nothing more to do */
+    event_id = matrix_json_object_get_string_member(json_event_obj,
+            "event_id");
+    if(matrix_seenevents_contains(conn, room_id, event_id)) {
+        purple_debug_info("matrixprpl", "ignoring repeated event %s\n",
+                event_id);
+        return;
+    }
+
     event_type = matrix_json_object_get_string_member(
             json_event_obj, "type");
     sender_id = matrix_json_object_get_string_member(json_event_obj, "sender");
@@ -655,6 +813,23 @@ void matrix_room_handle_timeline_event(PurpleConversation *conv,
             sender_display_name, flags, tmp_body ? tmp_body : msg_body,
             timestamp / 1000);
     g_free(tmp_body);
+
+    if(record_seen)
+        matrix_seenevents_add(conn, room_id, event_id);
+}
+
+
+void matrix_room_handle_timeline_event(PurpleConversation *conv,
+       JsonObject *json_event_obj)
+{
+    _handle_timeline_event(conv, json_event_obj, TRUE);
+}
+
+
+void matrix_room_handle_backfilled_event(PurpleConversation *conv,
+       JsonObject *json_event_obj)
+{
+    _handle_timeline_event(conv, json_event_obj, FALSE);
 }
 
 
@@ -675,19 +850,27 @@ PurpleConversation *matrix_room_create_conversation(
     member_table = matrix_roommembers_new_table();
     purple_conversation_set_data(conv, PURPLE_CONV_DATA_EVENT_QUEUE, NULL);
     purple_conversation_set_data(conv, PURPLE_CONV_DATA_ACTIVE_SEND, NULL);
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_MEMBERS_FETCH, NULL);
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_MEMBERS_RETRY, NULL);
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_SUMMARY, NULL);
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_EPHEMERAL, NULL);
     purple_conversation_set_data(conv, PURPLE_CONV_DATA_STATE, state_table);
     purple_conversation_set_data(conv, PURPLE_CONV_MEMBER_TABLE,
             member_table);
 
+    /* if we are rejoining a room we left, purple reuses the old
+     * conversation without telling the registry about it */
+    matrix_roomregistry_add_conversation(
+            purple_connection_get_protocol_data(pc), conv);
+
     return conv;
 }
 
 
 /**
- * Leave a chat: notify the server that we are leaving, and (ultimately)
- * free the memory structures
+ * Cancel anything in progress for a room, and free the memory structures
  */
-void matrix_room_leave_chat(PurpleConversation *conv)
+static void _release_room(PurpleConversation *conv)
 {
     MatrixConnectionData *conn;
     MatrixRoomStateEventTable *state_table;
@@ -697,6 +880,41 @@ void matrix_room_leave_chat(PurpleConversation *conv)
     conn = _get_connection_data_from_conversation(conv);
 
     _cancel_event_send(conv);
+    _cancel_members_fetch(conv);
+    matrix_backfill_cancel(conv, FALSE);
+    matrix_slidingsync_unsubscribe(conn, conv->name);
+
+    state_table = matrix_room_get_state_table(conv);
+    matrix_statetable_destroy(state_table);
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_STATE, NULL);
+
+    member_table = matrix_room_get_member_table(conv);
+    matrix_roommembers_free_table(member_table);
+    purple_conversation_set_data(conv, PURPLE_CONV_MEMBER_TABLE, NULL);
+
+    matrix_room_set_summary(conv, NULL);
+
+    if(matrix_room_get_ephemeral(conv) != NULL) {
+        matrix_ephemeral_free_room(matrix_room_get_ephemeral(conv));
+        purple_conversation_set_data(conv, PURPLE_CONV_DATA_EPHEMERAL, NULL);
+    }
+
+    event_queue = _get_event_queue(conv);
+    if(event_queue != NULL) {
+        g_list_free_full(event_queue, (GDestroyNotify)matrix_event_free);
+        purple_conversation_set_data(conv, PURPLE_CONV_DATA_EVENT_QUEUE, NULL);
+    }
+}
+
+
+/**
+ * Leave a chat: notify the server that we are leaving, and (ultimately)
+ * free the memory structures
+ */
+void matrix_room_leave_chat(PurpleConversation *conv)
+{
+    MatrixConnectionData *conn = _get_connection_data_from_conversation(conv);
+
     matrix_api_leave_room(conn, conv->name, NULL, NULL, NULL, NULL);
 
     /* At this point, we have no confirmation that the 'leave' request will
@@ -709,20 +927,22 @@ void matrix_room_leave_chat(PurpleConversation *conv)
      * result in pidgin flagging the connection as failed; things will
      * hopefully then get resynced when the user reconnects.
      */
+    _release_room(conv);
+}
 
-    state_table = matrix_room_get_state_table(conv);
-    matrix_statetable_destroy(state_table);
-    purple_conversation_set_data(conv, PURPLE_CONV_DATA_STATE, NULL);
 
-    member_table = matrix_room_get_member_table(conv);
-    matrix_roommembers_free_table(member_table);
-    purple_conversation_set_data(conv, PURPLE_CONV_MEMBER_TABLE, NULL);
+void matrix_room_handle_leave(PurpleConversation *conv)
+{
+    MatrixConnectionData *conn = _get_connection_data_from_conversation(conv);
 
-    event_queue = _get_event_queue(conv);
-    if(event_queue != NULL) {
-        g_list_free_full(event_queue, (GDestroyNotify)matrix_event_free);
-        purple_conversation_set_data(conv, PURPLE_CONV_DATA_EVENT_QUEUE, NULL);
-    }
+    _release_room(conv);
+
+    /* the conversation stays open, so that the user can see what happened,
+     * but it is no longer one of our rooms; if we rejoin, we will start
+     * again from scratch. */
+    matrix_roomregistry_forget_conversation(conn, conv);
+    serv_got_chat_left(conn->pc,
+            purple_conv_chat_get_id(PURPLE_CONV_CHAT(conv)));
 }
 
 
@@ -891,9 +1111,182 @@ gchar *matrix_room_displayname_to_userid(struct _PurpleConversation *conv,
     }
 
     g_list_free(members);
+
+    if(result == NULL) {
+        /* perhaps we just haven't heard about them yet */
+        matrix_room_ensure_members_loaded(conv);
+    }
     return result;
 }
 
+/* *****************************************************************************
+ *
+ * Lazy-loading of members.
+ *
+ * When lazy-loading is enabled, /sync only gives us the m.room.member events
+ * for the senders of the events in the timeline. The rest of the member list
+ * is fetched via /members the first time we actually need it.
+ */
+
+/* after a /members request fails, we wait this long (in seconds) before
+ * trying again, rather than making a new request for every name we fail to
+ * look up */
+#define MEMBERS_FETCH_RETRY_DELAY 60
+
+
+static guint _get_monotonic_secs(void)
+{
+    return g_get_monotonic_time() / G_USEC_PER_SEC;
+}
+
+
+/**
+ * Record that a /members request failed, so that we don't retry it straight
+ * away
+ */
+static void _members_fetch_failed(PurpleConversation *conv)
+{
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_MEMBERS_FETCH, NULL);
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_MEMBERS_RETRY,
+            GUINT_TO_POINTER(_get_monotonic_secs() +
+                    MEMBERS_FETCH_RETRY_DELAY));
+}
+
+
+static void _members_fetch_complete(MatrixConnectionData *conn,
+        gpointer user_data, JsonNode *json_root)
+{
+    PurpleConversation *conv = user_data;
+    MatrixRoomStateEventTable *state_table;
+    JsonObject *root_obj;
+    JsonArray *chunk;
+    guint i, len;
+
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_MEMBERS_FETCH, NULL);
+
+    root_obj = matrix_json_node_get_object(json_root);
+    chunk = matrix_json_object_get_array_member(root_obj, "chunk");
+    if(chunk == NULL) {
+        purple_debug_warning("matrixprpl", "no chunk in /members response\n");
+        _members_fetch_failed(conv);
+        return;
+    }
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_MEMBERS_RETRY, NULL);
+
+    state_table = matrix_room_get_state_table(conv);
+    len = json_array_get_length(chunk);
+    purple_debug_info("matrixprpl", "got %u members for %s\n", len,
+            conv->name);
+
+    for(i = 0; i < len; i++) {
+        JsonObject *event_obj = matrix_json_node_get_object(
+                json_array_get_element(chunk, i));
+        const gchar *state_key = matrix_json_object_get_string_member(
+                event_obj, "state_key");
+
+        if(state_key == NULL)
+            continue;
+
+        /* anything we already know about has come from /sync, which is at
+         * least as up-to-date as this.
+         */
+        if(matrix_statetable_get_event(state_table, "m.room.member",
+                state_key) != NULL)
+            continue;
+
+        matrix_room_handle_state_event(conv, event_obj);
+    }
+
+    _set_flags(conv, _get_flags(conv) | PURPLE_CONV_FLAG_MEMBERS_LOADED);
+
+    /* these aren't new arrivals, so don't announce them */
+    matrix_room_complete_state_update(conv, FALSE);
+}
+
+
+static void _members_fetch_error(MatrixConnectionData *conn,
+        gpointer user_data, const gchar *error_message)
+{
+    PurpleConversation *conv = user_data;
+
+    /* if we were cancelled, the room is going away */
+    if(strcmp(error_message, "cancelled") == 0) {
+        purple_conversation_set_data(conv, PURPLE_CONV_DATA_MEMBERS_FETCH,
+                NULL);
+        return;
+    }
+
+    purple_debug_info("matrixprpl", "unable to fetch members for %s: %s\n",
+            conv->name, error_message);
+    _members_fetch_failed(conv);
+}
+
+
+static void _members_fetch_bad_response(MatrixConnectionData *conn,
+        gpointer user_data, int http_response_code, JsonNode *json_root)
+{
+    PurpleConversation *conv = user_data;
+
+    purple_debug_info("matrixprpl", "unable to fetch members for %s: %i\n",
+            conv->name, http_response_code);
+    _members_fetch_failed(conv);
+}
+
+
+/**
+ * Make sure we have the full member list for a room, starting a /members
+ * request if necessary.
+ */
+void matrix_room_ensure_members_loaded(PurpleConversation *conv)
+{
+    MatrixConnectionData *conn = _get_connection_data_from_conversation(conv);
+    MatrixApiRequestData *fetch;
+    guint retry;
+
+    if(_get_flags(conv) & PURPLE_CONV_FLAG_MEMBERS_LOADED)
+        return;
+
+    if(!purple_account_get_bool(conv->account,
+            PRPL_ACCOUNT_OPT_LAZY_LOAD_MEMBERS, TRUE)) {
+        /* we get all the members via /sync */
+        return;
+    }
+
+    if(purple_conversation_get_data(conv, PURPLE_CONV_DATA_MEMBERS_FETCH)
+            != NULL) {
+        /* already in progress */
+        return;
+    }
+
+    retry = GPOINTER_TO_UINT(purple_conversation_get_data(conv,
+            PURPLE_CONV_DATA_MEMBERS_RETRY));
+    if(retry != 0 && _get_monotonic_secs() < retry) {
+        /* the last attempt failed not long ago */
+        return;
+    }
+
+    fetch = matrix_api_get_room_members(conn, conv->name,
+            _members_fetch_complete, _members_fetch_error,
+            _members_fetch_bad_response, conv);
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_MEMBERS_FETCH, fetch);
+}
+
+
+/**
+ * If there is a /members request in progress, cancel it
+ */
+static void _cancel_members_fetch(PurpleConversation *conv)
+{
+    MatrixApiRequestData *fetch = purple_conversation_get_data(conv,
+            PURPLE_CONV_DATA_MEMBERS_FETCH);
+
+    if(fetch == NULL)
+        return;
+
+    purple_debug_info("matrixprpl", "Cancelling members fetch\n");
+    matrix_api_cancel(fetch);
+}
+
 /* ************************************************************************** */
 
 void matrix_room_complete_state_update(PurpleConversation *conv,
@@ -31,10 +31,19 @@
 #include <json-glib/json-glib.h>
 
 #include "libmatrix.h"
+#include "matrix-ephemeral.h"
+#include "matrix-roomsummary.h"
+#include "matrix-statetable.h"
 
 struct _PurpleConversation;
 struct _PurpleConnection;
 
+/**
+ * Get the state table for a room
+ */
+MatrixRoomStateEventTable *matrix_room_get_state_table(
+        struct _PurpleConversation *conv);
+
 /**
  * @param conv   conversation info
  */
@@ -54,6 +63,21 @@ struct _PurpleConversation *matrix_room_create_conversation(
  */
 void matrix_room_leave_chat(struct _PurpleConversation *conv);
 
+/**
+ * Handle the server telling us that we are no longer in a room (because we
+ * left it from another client, or were kicked or banned): free the memory
+ * structures, and tell purple we have left.
+ */
+void matrix_room_handle_leave(struct _PurpleConversation *conv);
+
+
+/**
+ * Check if a member of a room has a membership or displayname change which
+ * hasn't yet been applied by matrix_room_complete_state_update. Only one such
+ * change can be outstanding for each member.
+ */
+gboolean matrix_room_member_change_pending(struct _PurpleConversation *conv,
+        const gchar *user_id);
 
 /**
  * Update the state table on a room, based on a received state event
@@ -65,6 +89,51 @@ void matrix_room_leave_chat(struct _PurpleConversation *conv);
 void matrix_room_handle_state_event(struct _PurpleConversation *conv,
         JsonObject *json_event_obj);
 
+/**
+ * Update the state table on a room, based on a batch of received state
+ * events (as built by matrix_statetable_add).
+ *
+ * @param conv          info on the room
+ * @param state_events  the new state. The events are moved into the room's
+ *                      state table, leaving state_events empty.
+ */
+void matrix_room_handle_state_table(struct _PurpleConversation *conv,
+        MatrixRoomStateEventTable *state_events);
+
+/**
+ * Get the summary for a room, or NULL if the server hasn't sent one
+ */
+MatrixRoomSummary *matrix_room_get_summary(struct _PurpleConversation *conv);
+
+/**
+ * handle the 'summary' section for a room from a /sync response (which may be
+ * NULL)
+ */
+void matrix_room_handle_summary(struct _PurpleConversation *conv,
+        JsonObject *summary_obj);
+
+/**
+ * replace the summary for a room. Takes ownership of the summary, which may
+ * be NULL.
+ */
+void matrix_room_set_summary(struct _PurpleConversation *conv,
+        MatrixRoomSummary *summary);
+
+/**
+ * Get the latest typing notifications and account data for a room, or NULL
+ * if we haven't had any
+ */
+MatrixRoomEphemeral *matrix_room_get_ephemeral(
+        struct _PurpleConversation *conv);
+
+/**
+ * handle the ephemeral events and account data for a room from a /sync
+ * response, as collapsed by matrix_ephemeral_parse_room. Takes ownership of
+ * the MatrixRoomEphemeral.
+ */
+void matrix_room_handle_ephemeral(struct _PurpleConversation *conv,
+        MatrixRoomEphemeral *ephemeral);
+
 /**
  * handle a single received timeline event for a room (such as a message)
  *
@@ -74,6 +143,15 @@ void matrix_room_handle_state_event(struct _PurpleConversation *conv,
 void matrix_room_handle_timeline_event(struct _PurpleConversation *conv,
         JsonObject *json_event_obj);
 
+/**
+ * handle an event which was missed from the timeline and has been fetched
+ * since. As for matrix_room_handle_timeline_event, except that the event is
+ * not recorded as seen: it is older than anything a later sync will repeat,
+ * and would only push more recent events out of the record.
+ */
+void matrix_room_handle_backfilled_event(struct _PurpleConversation *conv,
+        JsonObject *json_event_obj);
+
 /**
  * Send a message in a room
  */
@@ -90,4 +168,13 @@ gchar *matrix_room_displayname_to_userid(struct _PurpleConversation *conv,
         const gchar *who);
 
 
+/**
+ * Make sure we have the full member list for a room. If members are being
+ * lazy-loaded and we haven't yet fetched the complete list, this starts a
+ * request for it; the user list is updated when it completes. If a request
+ * has recently failed, this does nothing for a while.
+ */
+void matrix_room_ensure_members_loaded(struct _PurpleConversation *conv);
+
+
 #endif
@@ -44,6 +44,10 @@ typedef struct _MatrixRoomMember {
      * string in the state table, so should not be freed here) */
     const gchar *state_displayname;
 
+    /* TRUE if the member is on one of the new/renamed/left lists in the
+     * table, waiting to be collected */
+    gboolean pending;
+
     /* data attached to this member (matrix-room.c uses it to track the
      * name we told libpurple this member had)
      */
@@ -214,11 +218,13 @@ void matrix_roommembers_update_member(MatrixRoomMemberTable *table,
                     member_user_id, new_displayname);
             table->new_members = g_slist_append(
                     table->new_members, member);
+            member->pending = TRUE;
         } else if(g_strcmp0(old_displayname, new_displayname) != 0) {
             purple_debug_info("matrixprpl", "%s (%s) changed name (was %s)\n",
                     member_user_id, new_displayname, old_displayname);
             table->renamed_members = g_slist_append(
                     table->renamed_members, member);
+            member->pending = TRUE;
         }
     } else {
         if(old_membership_val == MATRIX_ROOM_MEMBERSHIP_JOIN) {
@@ -226,11 +232,25 @@ void matrix_roommembers_update_member(MatrixRoomMemberTable *table,
                     member_user_id, old_displayname);
             table->left_members = g_slist_append(
                     table->left_members, member);
+            member->pending = TRUE;
         }
     }
 }
 
 
+gboolean matrix_roommembers_has_pending_change(MatrixRoomMemberTable *table,
+        const gchar *member_user_id)
+{
+    MatrixRoomMember *member;
+
+    if(member_user_id == NULL)
+        return FALSE;
+
+    member = matrix_roommembers_lookup_member(table, member_user_id);
+    return member != NULL && member->pending;
+}
+
+
 /**
  * Returns a list of MatrixRoomMember *s. Free the list, but not the pointers.
  */
@@ -255,28 +275,36 @@ GList *matrix_roommembers_get_active_members(
 }
 
 
-GSList *matrix_roommembers_get_new_members(MatrixRoomMemberTable *table)
+/**
+ * Take the members from one of the lists of pending changes
+ */
+static GSList *_collect_pending(GSList **list)
 {
-    GSList *members = table->new_members;
-    table->new_members = NULL;
+    GSList *members = *list, *elem;
+
+    for(elem = members; elem != NULL; elem = elem->next) {
+        MatrixRoomMember *member = elem->data;
+        member->pending = FALSE;
+    }
+    *list = NULL;
     return members;
 }
 
 
-GSList *matrix_roommembers_get_renamed_members(MatrixRoomMemberTable *table)
+GSList *matrix_roommembers_get_new_members(MatrixRoomMemberTable *table)
 {
-    GSList *members = table->renamed_members;
-    table->renamed_members = NULL;
-    return members;
+    return _collect_pending(&table->new_members);
+}
+
 
+GSList *matrix_roommembers_get_renamed_members(MatrixRoomMemberTable *table)
+{
+    return _collect_pending(&table->renamed_members);
 }
 
 
 GSList *matrix_roommembers_get_left_members(MatrixRoomMemberTable *table)
 {
-    GSList *members = table->left_members;
-    table->left_members = NULL;
-    return members;
-
+    return _collect_pending(&table->left_members);
 }
 
@@ -103,6 +103,18 @@ void matrix_roommembers_update_member(MatrixRoomMemberTable *table,
         const gchar *member_user_id, struct _JsonObject *new_state);
 
 
+/**
+ * Check if a member has a change of membership or displayname which hasn't
+ * yet been collected by matrix_roommembers_get_(new,renamed,left)_members.
+ *
+ * Each member can only have one such change outstanding: a second update
+ * (eg, a leave followed by a rejoin) should not be made until the first has
+ * been collected.
+ */
+gboolean matrix_roommembers_has_pending_change(MatrixRoomMemberTable *table,
+        const gchar *member_user_id);
+
+
 /**
  * Look up a room member given the userid
  *
@@ -0,0 +1,283 @@
+/**
+ * matrix-roomregistry.c: index of the rooms on a connection
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-roomregistry.h"
+
+/* libpurple */
+#include "blist.h"
+#include "connection.h"
+#include "conversation.h"
+#include "debug.h"
+#include "signals.h"
+
+/* libmatrix */
+#include "libmatrix.h"
+#include "matrix-room.h"
+
+
+typedef struct _MatrixRoomRegistryEntry {
+    PurpleChat *chat;
+    PurpleConversation *conv;
+} MatrixRoomRegistryEntry;
+
+
+static MatrixRoomRegistryEntry *_get_entry(MatrixConnectionData *conn,
+        const gchar *room_id, gboolean create)
+{
+    MatrixRoomRegistryEntry *entry;
+
+    entry = g_hash_table_lookup(conn->rooms, room_id);
+    if(entry == NULL && create) {
+        entry = g_new0(MatrixRoomRegistryEntry, 1);
+        g_hash_table_insert(conn->rooms, g_strdup(room_id), entry);
+    }
+    return entry;
+}
+
+
+/**
+ * Drop the entry for a room if there is nothing left in it
+ */
+static void _check_entry(MatrixConnectionData *conn, const gchar *room_id,
+        MatrixRoomRegistryEntry *entry)
+{
+    if(entry->chat == NULL && entry->conv == NULL)
+        g_hash_table_remove(conn->rooms, room_id);
+}
+
+
+/**
+ * Get the room id for a buddy list node, if it is one of our chats
+ */
+static const gchar *_get_chat_room_id(MatrixConnectionData *conn,
+        PurpleBlistNode *node)
+{
+    PurpleChat *chat;
+
+    if(!PURPLE_BLIST_NODE_IS_CHAT(node))
+        return NULL;
+
+    chat = PURPLE_CHAT(node);
+    if(purple_chat_get_account(chat) != conn->pc->account)
+        return NULL;
+
+    return g_hash_table_lookup(purple_chat_get_components(chat),
+            PRPL_CHAT_INFO_ROOM_ID);
+}
+
+
+/**
+ * Check if a conversation is one of our chats
+ */
+static gboolean _is_our_conversation(MatrixConnectionData *conn,
+        PurpleConversation *conv)
+{
+    return conv->account == conn->pc->account &&
+            purple_conversation_get_type(conv) == PURPLE_CONV_TYPE_CHAT;
+}
+
+
+static void _add_chat(MatrixConnectionData *conn, PurpleBlistNode *node)
+{
+    const gchar *room_id = _get_chat_room_id(conn, node);
+
+    if(room_id != NULL)
+        _get_entry(conn, room_id, TRUE)->chat = PURPLE_CHAT(node);
+}
+
+
+static void _add_conversation(MatrixConnectionData *conn,
+        PurpleConversation *conv)
+{
+    MatrixRoomRegistryEntry *entry;
+
+    if(!_is_our_conversation(conn, conv))
+        return;
+
+    entry = _get_entry(conn, conv->name, TRUE);
+    if(entry->conv == NULL)
+        conn->nconversations++;
+    entry->conv = conv;
+}
+
+
+static void _remove_conversation(MatrixConnectionData *conn,
+        PurpleConversation *conv)
+{
+    MatrixRoomRegistryEntry *entry;
+
+    if(!_is_our_conversation(conn, conv))
+        return;
+
+    entry = _get_entry(conn, conv->name, FALSE);
+    if(entry == NULL || entry->conv != conv)
+        return;
+
+    entry->conv = NULL;
+    conn->nconversations--;
+    _check_entry(conn, conv->name, entry);
+}
+
+
+/******************************************************************************
+ *
+ * signal handlers
+ */
+
+static void _on_blist_node_added(PurpleBlistNode *node, gpointer user_data)
+{
+    _add_chat(user_data, node);
+}
+
+
+static void _on_blist_node_removed(PurpleBlistNode *node, gpointer user_data)
+{
+    MatrixConnectionData *conn = user_data;
+    const gchar *room_id = _get_chat_room_id(conn, node);
+    MatrixRoomRegistryEntry *entry;
+
+    if(room_id == NULL)
+        return;
+
+    entry = _get_entry(conn, room_id, FALSE);
+    if(entry == NULL || entry->chat != PURPLE_CHAT(node))
+        return;
+
+    entry->chat = NULL;
+    _check_entry(conn, room_id, entry);
+}
+
+
+static void _on_conversation_created(PurpleConversation *conv,
+        gpointer user_data)
+{
+    _add_conversation(user_data, conv);
+}
+
+
+static void _on_deleting_conversation(PurpleConversation *conv,
+        gpointer user_data)
+{
+    _remove_conversation(user_data, conv);
+}
+
+
+/******************************************************************************
+ *
+ * public api
+ */
+
+void matrix_roomregistry_init(MatrixConnectionData *conn)
+{
+    PurpleBlistNode *node;
+    GList *ptr;
+
+    conn->rooms = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+            g_free);
+    conn->nconversations = 0;
+
+    /* this is the last time we should need to walk these lists */
+    for(node = purple_blist_get_root(); node != NULL;
+            node = purple_blist_node_next(node, TRUE)) {
+        _add_chat(conn, node);
+    }
+
+    for(ptr = purple_get_conversations(); ptr != NULL; ptr = ptr->next) {
+        /* skip conversations for rooms we found we had left; we have already
+         * thrown away their state */
+        if(matrix_room_get_state_table(ptr->data) != NULL)
+            _add_conversation(conn, ptr->data);
+    }
+
+    purple_debug_info("matrixprpl", "%u rooms known for %s\n",
+            g_hash_table_size(conn->rooms), conn->pc->account->username);
+
+    purple_signal_connect(purple_blist_get_handle(), "blist-node-added",
+            conn, PURPLE_CALLBACK(_on_blist_node_added), conn);
+    purple_signal_connect(purple_blist_get_handle(), "blist-node-removed",
+            conn, PURPLE_CALLBACK(_on_blist_node_removed), conn);
+    purple_signal_connect(purple_conversations_get_handle(),
+            "conversation-created", conn,
+            PURPLE_CALLBACK(_on_conversation_created), conn);
+    purple_signal_connect(purple_conversations_get_handle(),
+            "deleting-conversation", conn,
+            PURPLE_CALLBACK(_on_deleting_conversation), conn);
+}
+
+
+void matrix_roomregistry_free(MatrixConnectionData *conn)
+{
+    purple_signals_disconnect_by_handle(conn);
+
+    if(conn->rooms != NULL)
+        g_hash_table_destroy(conn->rooms);
+    conn->rooms = NULL;
+    conn->nconversations = 0;
+}
+
+
+PurpleChat *matrix_roomregistry_get_chat(MatrixConnectionData *conn,
+        const gchar *room_id)
+{
+    MatrixRoomRegistryEntry *entry = _get_entry(conn, room_id, FALSE);
+    return entry == NULL ? NULL : entry->chat;
+}
+
+
+PurpleConversation *matrix_roomregistry_get_conversation(
+        MatrixConnectionData *conn, const gchar *room_id)
+{
+    MatrixRoomRegistryEntry *entry = _get_entry(conn, room_id, FALSE);
+    return entry == NULL ? NULL : entry->conv;
+}
+
+
+void matrix_roomregistry_add_conversation(MatrixConnectionData *conn,
+        PurpleConversation *conv)
+{
+    _add_conversation(conn, conv);
+}
+
+
+void matrix_roomregistry_forget_conversation(MatrixConnectionData *conn,
+        PurpleConversation *conv)
+{
+    _remove_conversation(conn, conv);
+}
+
+
+GList *matrix_roomregistry_get_conversations(MatrixConnectionData *conn)
+{
+    GHashTableIter iter;
+    gpointer value;
+    GList *result = NULL;
+
+    g_hash_table_iter_init(&iter, conn->rooms);
+    while(g_hash_table_iter_next(&iter, NULL, &value)) {
+        MatrixRoomRegistryEntry *entry = value;
+        if(entry->conv != NULL)
+            result = g_list_prepend(result, entry->conv);
+    }
+    return result;
+}
+
+
+gboolean matrix_roomregistry_has_conversations(MatrixConnectionData *conn)
+{
+    return conn->nconversations > 0;
+}
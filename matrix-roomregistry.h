@@ -0,0 +1,91 @@
+/**
+ * matrix-roomregistry.h: index of the rooms on a connection
+ *
+ * libpurple's own lookups (purple_blist_find_chat,
+ * purple_find_conversation_with_account) walk the whole buddy list or
+ * conversation list, which gets expensive for accounts in a lot of rooms. The
+ * registry maps each room id to its buddy list entry and conversation, and is
+ * kept up to date by listening for libpurple's signals.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_ROOMREGISTRY_H_
+#define MATRIX_ROOMREGISTRY_H_
+
+#include <glib.h>
+
+#include "matrix-connection.h"
+
+struct _PurpleChat;
+struct _PurpleConversation;
+
+/**
+ * Build the registry for a new connection, from the existing buddy list and
+ * conversations, and start listening for changes.
+ */
+void matrix_roomregistry_init(MatrixConnectionData *conn);
+
+/**
+ * Stop listening for changes, and free the registry
+ */
+void matrix_roomregistry_free(MatrixConnectionData *conn);
+
+/**
+ * Find the buddy list entry for a room
+ *
+ * @returns NULL if there is no buddy list entry for this room
+ */
+struct _PurpleChat *matrix_roomregistry_get_chat(MatrixConnectionData *conn,
+        const gchar *room_id);
+
+/**
+ * Find the conversation for a room
+ *
+ * @returns NULL if there is no conversation for this room
+ */
+struct _PurpleConversation *matrix_roomregistry_get_conversation(
+        MatrixConnectionData *conn, const gchar *room_id);
+
+/**
+ * Record a conversation for a room. Conversations are normally picked up
+ * automatically when purple creates them; this is for when purple reuses an
+ * old conversation which we have forgotten.
+ */
+void matrix_roomregistry_add_conversation(MatrixConnectionData *conn,
+        struct _PurpleConversation *conv);
+
+/**
+ * Forget about the conversation for a room (because we are no longer in the
+ * room), even though the conversation itself is still open.
+ */
+void matrix_roomregistry_forget_conversation(MatrixConnectionData *conn,
+        struct _PurpleConversation *conv);
+
+/**
+ * Get a list of the conversations on this connection.
+ *
+ * @returns a list of PurpleConversation *s. The list (but not the
+ *    conversations) should be freed with g_list_free.
+ */
+GList *matrix_roomregistry_get_conversations(MatrixConnectionData *conn);
+
+/**
+ * Check if there are any conversations on this connection
+ */
+gboolean matrix_roomregistry_has_conversations(MatrixConnectionData *conn);
+
+#endif /* MATRIX_ROOMREGISTRY_H_ */
@@ -0,0 +1,245 @@
+/**
+ * matrix-roomsummary.c: the 'summary' of a room from /sync
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-roomsummary.h"
+
+#include <string.h>
+
+/* libmatrix */
+#include "libmatrix.h"
+#include "matrix-json.h"
+
+
+struct _MatrixRoomSummary {
+    /* user ids of the members to name the room after (not including
+     * ourselves); NULL-terminated */
+    gchar **heroes;
+
+    /* the number of joined and invited members (including ourselves), or -1
+     * if not known */
+    gint64 joined_member_count;
+    gint64 invited_member_count;
+};
+
+
+MatrixRoomSummary *matrix_roomsummary_new(void)
+{
+    MatrixRoomSummary *summary = g_new0(MatrixRoomSummary, 1);
+    summary->joined_member_count = -1;
+    summary->invited_member_count = -1;
+    return summary;
+}
+
+
+void matrix_roomsummary_free(MatrixRoomSummary *summary)
+{
+    g_strfreev(summary->heroes);
+    g_free(summary);
+}
+
+
+/**
+ * Update one of the member counts
+ *
+ * @returns TRUE if it changed
+ */
+static gboolean _update_count(gint64 *count, JsonObject *summary_obj,
+        const gchar *member_name)
+{
+    gint64 value;
+
+    if(!json_object_has_member(summary_obj, member_name))
+        return FALSE;
+
+    value = matrix_json_object_get_int_member(summary_obj, member_name);
+    if(value == *count)
+        return FALSE;
+    *count = value;
+    return TRUE;
+}
+
+
+static gboolean _update_heroes(MatrixRoomSummary *summary,
+        JsonObject *summary_obj)
+{
+    JsonArray *heroes;
+    gchar **new_heroes;
+    guint i, j, len;
+
+    heroes = matrix_json_object_get_array_member(summary_obj, "m.heroes");
+    if(heroes == NULL)
+        return FALSE;
+
+    len = json_array_get_length(heroes);
+    new_heroes = g_new0(gchar *, len + 1);
+    for(i = 0, j = 0; i < len; i++) {
+        const gchar *user_id = matrix_json_array_get_string_element(heroes,
+                i);
+        if(user_id != NULL)
+            new_heroes[j++] = g_strdup(user_id);
+    }
+
+    if(summary->heroes != NULL &&
+            g_strv_length(summary->heroes) == g_strv_length(new_heroes)) {
+        for(i = 0; new_heroes[i] != NULL; i++) {
+            if(g_strcmp0(summary->heroes[i], new_heroes[i]) != 0)
+                break;
+        }
+        if(new_heroes[i] == NULL) {
+            g_strfreev(new_heroes);
+            return FALSE;
+        }
+    }
+
+    g_strfreev(summary->heroes);
+    summary->heroes = new_heroes;
+    return TRUE;
+}
+
+
+gboolean matrix_roomsummary_update(MatrixRoomSummary *summary,
+        JsonObject *summary_obj)
+{
+    gboolean changed = FALSE;
+
+    if(summary_obj == NULL)
+        return FALSE;
+
+    changed |= _update_heroes(summary, summary_obj);
+    changed |= _update_count(&summary->joined_member_count, summary_obj,
+            "m.joined_member_count");
+    changed |= _update_count(&summary->invited_member_count, summary_obj,
+            "m.invited_member_count");
+    return changed;
+}
+
+
+JsonObject *matrix_roomsummary_to_json(MatrixRoomSummary *summary)
+{
+    JsonObject *summary_obj = json_object_new();
+
+    if(summary->heroes != NULL) {
+        JsonArray *heroes = json_array_new();
+        gchar **hero;
+
+        for(hero = summary->heroes; *hero != NULL; hero++)
+            json_array_add_string_element(heroes, *hero);
+        json_object_set_array_member(summary_obj, "m.heroes", heroes);
+    }
+
+    if(summary->joined_member_count >= 0)
+        json_object_set_int_member(summary_obj, "m.joined_member_count",
+                summary->joined_member_count);
+    if(summary->invited_member_count >= 0)
+        json_object_set_int_member(summary_obj, "m.invited_member_count",
+                summary->invited_member_count);
+
+    return summary_obj;
+}
+
+
+gboolean matrix_roomsummary_is_hero(MatrixRoomSummary *summary,
+        const gchar *user_id)
+{
+    gchar **hero;
+
+    if(summary->heroes == NULL || user_id == NULL)
+        return FALSE;
+
+    for(hero = summary->heroes; *hero != NULL; hero++) {
+        if(strcmp(*hero, user_id) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+static const gchar *_get_member_name(const gchar *user_id,
+        MatrixRoomSummaryDisplaynameFunc get_displayname, gpointer user_data)
+{
+    const gchar *displayname = get_displayname(user_id, user_data);
+    return displayname != NULL ? displayname : user_id;
+}
+
+
+/**
+ * Build a room name from the first one or two members to name it after, and
+ * the number of members other than ourselves
+ */
+static gchar *_format_name(const gchar *member1, const gchar *member2,
+        gint64 others)
+{
+    if(others == 1)
+        return g_strdup(member1);
+
+    if(others == 2 && member2 != NULL)
+        return g_strdup_printf(_("%s and %s"), member1, member2);
+
+    return g_strdup_printf(_("%s and %i others"), member1, (int) others);
+}
+
+
+gchar *matrix_roomsummary_get_name(MatrixRoomSummary *summary,
+        MatrixRoomSummaryDisplaynameFunc get_displayname, gpointer user_data)
+{
+    guint nheroes;
+    gint64 others;
+    const gchar *member2 = NULL;
+
+    nheroes = summary->heroes == NULL ? 0 : g_strv_length(summary->heroes);
+    if(nheroes == 0)
+        return NULL;
+
+    /* the number of members other than ourselves */
+    if(summary->joined_member_count >= 0 && summary->invited_member_count >= 0)
+        others = summary->joined_member_count +
+                summary->invited_member_count - 1;
+    else
+        others = nheroes;
+    if(others < nheroes)
+        others = nheroes;
+
+    if(nheroes >= 2)
+        member2 = _get_member_name(summary->heroes[1], get_displayname,
+                user_data);
+    return _format_name(_get_member_name(summary->heroes[0], get_displayname,
+            user_data), member2, others);
+}
+
+
+gchar *matrix_roomsummary_get_name_from_members(GList *user_ids,
+        MatrixRoomSummaryDisplaynameFunc get_displayname, gpointer user_data)
+{
+    GList *sorted;
+    const gchar *member2 = NULL;
+    gchar *res;
+
+    if(user_ids == NULL)
+        return NULL;
+
+    /* name the room after the first members by user id, so that the name
+     * doesn't depend on the order we found them in */
+    sorted = g_list_sort(g_list_copy(user_ids), (GCompareFunc) strcmp);
+    if(sorted->next != NULL)
+        member2 = _get_member_name(sorted->next->data, get_displayname,
+                user_data);
+    res = _format_name(_get_member_name(sorted->data, get_displayname,
+            user_data), member2, g_list_length(sorted));
+    g_list_free(sorted);
+    return res;
+}
@@ -0,0 +1,87 @@
+/**
+ * matrix-roomsummary.h: the 'summary' of a room from /sync
+ *
+ * For rooms without a name, the server picks out a few 'heroes' (members to
+ * name the room after) and tells us how many members the room has, so that
+ * we can name the room without needing the full member list.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_ROOMSUMMARY_H_
+#define MATRIX_ROOMSUMMARY_H_
+
+#include <glib.h>
+
+#include <json-glib/json-glib.h>
+
+typedef struct _MatrixRoomSummary MatrixRoomSummary;
+
+/**
+ * The type of a function which can be passed into
+ * matrix_roomsummary_get_name to look up the displayname of a member.
+ *
+ * @returns the displayname, or NULL if it is not known
+ */
+typedef const gchar *(*MatrixRoomSummaryDisplaynameFunc)(
+        const gchar *user_id, gpointer user_data);
+
+MatrixRoomSummary *matrix_roomsummary_new(void);
+
+void matrix_roomsummary_free(MatrixRoomSummary *summary);
+
+/**
+ * Update the summary from the 'summary' section of a room in a /sync
+ * response. Fields which are missing are left unchanged.
+ *
+ * @returns TRUE if anything changed
+ */
+gboolean matrix_roomsummary_update(MatrixRoomSummary *summary,
+        JsonObject *summary_obj);
+
+/**
+ * Build the 'summary' section of a /sync response for this summary
+ *
+ * @returns a new JsonObject, which should be unreffed by the caller
+ */
+JsonObject *matrix_roomsummary_to_json(MatrixRoomSummary *summary);
+
+/**
+ * Check whether a member is one of the heroes the room is named after
+ */
+gboolean matrix_roomsummary_is_hero(MatrixRoomSummary *summary,
+        const gchar *user_id);
+
+/**
+ * Pick a name for a room based on its heroes and member counts.
+ *
+ * @returns a string which should be freed, or NULL if we have no heroes
+ */
+gchar *matrix_roomsummary_get_name(MatrixRoomSummary *summary,
+        MatrixRoomSummaryDisplaynameFunc get_displayname, gpointer user_data);
+
+/**
+ * Pick a name for a room from its members, for when the server hasn't given
+ * us any heroes. The name is the same whatever order the members are in.
+ *
+ * @param user_ids  the joined and invited members, other than ourselves
+ *
+ * @returns a string which should be freed, or NULL if the list is empty
+ */
+gchar *matrix_roomsummary_get_name_from_members(GList *user_ids,
+        MatrixRoomSummaryDisplaynameFunc get_displayname, gpointer user_data);
+
+#endif /* MATRIX_ROOMSUMMARY_H_ */
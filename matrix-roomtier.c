@@ -0,0 +1,251 @@
+/**
+ * matrix-roomtier.c: how much attention we pay to each room
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-roomtier.h"
+
+#include <string.h>
+
+/* libpurple */
+#include "blist.h"
+#include "debug.h"
+#include "util.h"
+
+/* libmatrix */
+#include "libmatrix.h"
+#include "matrix-ephemeral.h"
+#include "matrix-json.h"
+#include "matrix-roomregistry.h"
+
+/* the buddy list setting which holds the user's choice of tier for a chat,
+ * if any */
+#define ROOMTIER_SETTING "matrix_room_tier"
+
+/* the values of ROOMTIER_SETTING, indexed by MATRIX_ROOM_TIER_* */
+static const gchar *_tier_names[] = {"muted", "notifications", "full"};
+
+/* the menu entries, indexed by MATRIX_ROOM_TIER_* */
+static const gchar *_tier_labels[] = {
+    N_("Muted"),
+    N_("Show when notified"),
+    N_("Show all activity"),
+};
+
+
+/**
+ * Check if a push rule's actions include a notification
+ */
+static gboolean _actions_notify(JsonArray *actions)
+{
+    guint i, len;
+
+    len = actions == NULL ? 0 : json_array_get_length(actions);
+    for(i = 0; i < len; i++) {
+        /* some actions are objects (set_tweak), which we don't care about */
+        if(g_strcmp0(matrix_json_array_get_string_element(actions, i),
+                "notify") == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+/**
+ * Call a function for each enabled push rule of a kind whose id is a room id
+ */
+static void _foreach_room_rule(JsonObject *global, const gchar *kind,
+        void (*func)(GHashTable *tiers, const gchar *room_id,
+                JsonArray *actions), GHashTable *tiers)
+{
+    JsonArray *rules;
+    guint i, len;
+
+    rules = matrix_json_object_get_array_member(global, kind);
+    len = rules == NULL ? 0 : json_array_get_length(rules);
+    for(i = 0; i < len; i++) {
+        JsonObject *rule = matrix_json_node_get_object(
+                json_array_get_element(rules, i));
+        const gchar *rule_id;
+
+        rule_id = matrix_json_object_get_string_member(rule, "rule_id");
+        if(rule_id == NULL || rule_id[0] != '!')
+            continue;
+        if(json_object_has_member(rule, "enabled") &&
+                !matrix_json_object_get_boolean_member(rule, "enabled"))
+            continue;
+
+        func(tiers, rule_id, matrix_json_object_get_array_member(rule,
+                "actions"));
+    }
+}
+
+
+/**
+ * An override rule for a room which doesn't notify is how clients mute it
+ */
+static void _check_override_rule(GHashTable *tiers, const gchar *room_id,
+        JsonArray *actions)
+{
+    if(!_actions_notify(actions))
+        g_hash_table_replace(tiers, g_strdup(room_id),
+                GINT_TO_POINTER(MATRIX_ROOM_TIER_MUTED));
+}
+
+
+/**
+ * A room rule which notifies is how clients ask for all messages in it
+ */
+static void _check_room_rule(GHashTable *tiers, const gchar *room_id,
+        JsonArray *actions)
+{
+    /* an override rule takes precedence */
+    if(g_hash_table_lookup_extended(tiers, room_id, NULL, NULL))
+        return;
+
+    if(_actions_notify(actions))
+        g_hash_table_replace(tiers, g_strdup(room_id),
+                GINT_TO_POINTER(MATRIX_ROOM_TIER_FULL));
+}
+
+
+/**
+ * Get the table of tiers from the push rules, building it if the push rules
+ * have changed since we last looked.
+ *
+ * @returns a map from room id to tier (for rooms which aren't at the default
+ *    tier), or NULL if we don't have any push rules.
+ */
+static GHashTable *_get_push_rule_tiers(MatrixConnectionData *conn)
+{
+    JsonObject *rules;
+
+    rules = matrix_ephemeral_get_account_data(conn, "m.push_rules");
+    if(rules == conn->room_tiers_rules)
+        return conn->room_tiers;
+
+    matrix_roomtier_free(conn);
+    if(rules == NULL)
+        return NULL;
+
+    /* we keep a reference on the rules, so that we can tell when they are
+     * replaced */
+    conn->room_tiers_rules = json_object_ref(rules);
+    conn->room_tiers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+            NULL);
+    _foreach_room_rule(matrix_json_object_get_object_member(rules, "global"),
+            "override", _check_override_rule, conn->room_tiers);
+    _foreach_room_rule(matrix_json_object_get_object_member(rules, "global"),
+            "room", _check_room_rule, conn->room_tiers);
+
+    purple_debug_info("matrixprpl", "%u rooms with push rules\n",
+            g_hash_table_size(conn->room_tiers));
+    return conn->room_tiers;
+}
+
+
+/**
+ * Get the tier the user has chosen for a chat
+ *
+ * @returns a MATRIX_ROOM_TIER_* value, or -1 if the user hasn't chosen one
+ */
+static int _get_chosen_tier(PurpleBlistNode *node)
+{
+    const gchar *setting;
+    int tier;
+
+    setting = purple_blist_node_get_string(node, ROOMTIER_SETTING);
+    if(setting == NULL)
+        return -1;
+
+    for(tier = MATRIX_ROOM_TIER_MUTED; tier <= MATRIX_ROOM_TIER_FULL; tier++) {
+        if(strcmp(setting, _tier_names[tier]) == 0)
+            return tier;
+    }
+    return -1;
+}
+
+
+static void _choose_tier_cb(PurpleBlistNode *node, gpointer data)
+{
+    int tier = GPOINTER_TO_INT(data);
+
+    if(tier < 0)
+        purple_blist_node_remove_setting(node, ROOMTIER_SETTING);
+    else
+        purple_blist_node_set_string(node, ROOMTIER_SETTING,
+                _tier_names[tier]);
+}
+
+
+/******************************************************************************
+ *
+ * public api
+ */
+
+int matrix_roomtier_get(MatrixConnectionData *conn, const gchar *room_id)
+{
+    PurpleChat *chat;
+    GHashTable *tiers;
+    gpointer tier;
+
+    chat = matrix_roomregistry_get_chat(conn, room_id);
+    if(chat != NULL) {
+        int chosen = _get_chosen_tier((PurpleBlistNode *)chat);
+        if(chosen >= 0)
+            return chosen;
+    }
+
+    tiers = _get_push_rule_tiers(conn);
+    if(tiers != NULL && g_hash_table_lookup_extended(tiers, room_id, NULL,
+            &tier))
+        return GPOINTER_TO_INT(tier);
+
+    return MATRIX_ROOM_TIER_NOTIFICATIONS;
+}
+
+
+GList *matrix_roomtier_get_menu(PurpleBlistNode *node)
+{
+    GList *children = NULL;
+    int tier;
+
+    if(!PURPLE_BLIST_NODE_IS_CHAT(node))
+        return NULL;
+
+    children = g_list_append(children, purple_menu_action_new(
+            _("Follow homeserver settings"), PURPLE_CALLBACK(_choose_tier_cb),
+            GINT_TO_POINTER(-1), NULL));
+    for(tier = MATRIX_ROOM_TIER_FULL; tier >= MATRIX_ROOM_TIER_MUTED; tier--) {
+        children = g_list_append(children, purple_menu_action_new(
+                _(_tier_labels[tier]), PURPLE_CALLBACK(_choose_tier_cb),
+                GINT_TO_POINTER(tier), NULL));
+    }
+
+    return g_list_append(NULL, purple_menu_action_new(_("Room activity"),
+            NULL, NULL, children));
+}
+
+
+void matrix_roomtier_free(MatrixConnectionData *conn)
+{
+    if(conn->room_tiers != NULL)
+        g_hash_table_destroy(conn->room_tiers);
+    conn->room_tiers = NULL;
+    if(conn->room_tiers_rules != NULL)
+        json_object_unref(conn->room_tiers_rules);
+    conn->room_tiers_rules = NULL;
+}
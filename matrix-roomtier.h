@@ -0,0 +1,70 @@
+/**
+ * matrix-roomtier.h: how much attention we pay to each room
+ *
+ * Rooms we haven't shown to the user yet are kept dormant (see
+ * matrix-dormantroom.h). How readily a dormant room is promoted to a
+ * conversation - and how much we keep for it in the meantime - depends on
+ * its tier:
+ *
+ *  - full: the room is shown as soon as someone else sends a message in it.
+ *  - notifications: the room is shown when the homeserver's count of unread
+ *    notifications for it goes up. This is the default.
+ *  - muted: we only keep the room's state and unread counters, and it is only
+ *    shown if the user is highlighted (which the homeserver won't count for a
+ *    room muted there), or opens it.
+ *
+ * The tier comes from a per-chat setting on the buddy list entry, if the user
+ * has chosen one; otherwise from the user's push rules (so rooms muted in
+ * another client are muted here too).
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_ROOMTIER_H_
+#define MATRIX_ROOMTIER_H_
+
+#include <glib.h>
+
+#include "matrix-connection.h"
+
+struct _PurpleBlistNode;
+
+/* the processing tiers, lowest first */
+#define MATRIX_ROOM_TIER_MUTED 0
+#define MATRIX_ROOM_TIER_NOTIFICATIONS 1
+#define MATRIX_ROOM_TIER_FULL 2
+
+/**
+ * Get the tier for a room
+ *
+ * @returns one of the MATRIX_ROOM_TIER_* values
+ */
+int matrix_roomtier_get(MatrixConnectionData *conn, const gchar *room_id);
+
+/**
+ * Build the entries for the buddy list menu of one of our chats, which let
+ * the user pick its tier.
+ *
+ * @returns a list of PurpleMenuAction *s
+ */
+GList *matrix_roomtier_get_menu(struct _PurpleBlistNode *node);
+
+/**
+ * Free the cached tiers on a connection
+ */
+void matrix_roomtier_free(MatrixConnectionData *conn);
+
+#endif /* MATRIX_ROOMTIER_H_ */
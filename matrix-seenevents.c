@@ -0,0 +1,191 @@
+/**
+ * matrix-seenevents.c: remembering which events we have already shown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-seenevents.h"
+
+/* libmatrix */
+#include "matrix-json.h"
+
+/* the number of event ids we keep for each room. This only needs to cover
+ * the overlap between one batch of events and the next. */
+#define SEENEVENTS_PER_ROOM 64
+
+
+/* the event ids for one room: a ring buffer, with a hash table to find ids
+ * in it quickly */
+typedef struct _MatrixRoomSeenEvents {
+    gchar *ids[SEENEVENTS_PER_ROOM];
+
+    /* the slot to fill next, which holds the oldest id (if any) */
+    guint next;
+
+    /* the set of ids in the buffer; the keys point into 'ids' */
+    GHashTable *index;
+} MatrixRoomSeenEvents;
+
+
+static void _free_room(MatrixRoomSeenEvents *room)
+{
+    guint i;
+
+    g_hash_table_destroy(room->index);
+    for(i = 0; i < SEENEVENTS_PER_ROOM; i++)
+        g_free(room->ids[i]);
+    g_free(room);
+}
+
+
+static MatrixRoomSeenEvents *_get_room(MatrixConnectionData *conn,
+        const gchar *room_id, gboolean create)
+{
+    MatrixRoomSeenEvents *room = NULL;
+
+    if(conn->seen_events != NULL)
+        room = g_hash_table_lookup(conn->seen_events, room_id);
+    if(room != NULL || !create)
+        return room;
+
+    if(conn->seen_events == NULL)
+        conn->seen_events = g_hash_table_new_full(g_str_hash, g_str_equal,
+                g_free, (GDestroyNotify) _free_room);
+
+    room = g_new0(MatrixRoomSeenEvents, 1);
+    room->index = g_hash_table_new(g_str_hash, g_str_equal);
+    g_hash_table_insert(conn->seen_events, g_strdup(room_id), room);
+    return room;
+}
+
+
+static void _add(MatrixRoomSeenEvents *room, const gchar *event_id)
+{
+    gchar *oldest = room->ids[room->next];
+
+    if(g_hash_table_lookup(room->index, event_id) != NULL)
+        return;
+
+    if(oldest != NULL) {
+        g_hash_table_remove(room->index, oldest);
+        g_free(oldest);
+    }
+
+    room->ids[room->next] = g_strdup(event_id);
+    g_hash_table_insert(room->index, room->ids[room->next],
+            room->ids[room->next]);
+    room->next = (room->next + 1) % SEENEVENTS_PER_ROOM;
+}
+
+
+/******************************************************************************
+ *
+ * public api
+ */
+
+gboolean matrix_seenevents_contains(MatrixConnectionData *conn,
+        const gchar *room_id, const gchar *event_id)
+{
+    MatrixRoomSeenEvents *room;
+
+    if(event_id == NULL)
+        return FALSE;
+
+    room = _get_room(conn, room_id, FALSE);
+    return room != NULL && g_hash_table_lookup(room->index, event_id) != NULL;
+}
+
+
+void matrix_seenevents_add(MatrixConnectionData *conn, const gchar *room_id,
+        const gchar *event_id)
+{
+    if(event_id == NULL)
+        return;
+
+    _add(_get_room(conn, room_id, TRUE), event_id);
+    conn->seen_events_dirty = TRUE;
+}
+
+
+void matrix_seenevents_forget_room(MatrixConnectionData *conn,
+        const gchar *room_id)
+{
+    if(conn->seen_events != NULL &&
+            g_hash_table_remove(conn->seen_events, room_id))
+        conn->seen_events_dirty = TRUE;
+}
+
+
+JsonObject *matrix_seenevents_to_json(MatrixConnectionData *conn)
+{
+    JsonObject *rooms = json_object_new();
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if(conn->seen_events == NULL)
+        return rooms;
+
+    g_hash_table_iter_init(&iter, conn->seen_events);
+    while(g_hash_table_iter_next(&iter, &key, &value)) {
+        MatrixRoomSeenEvents *room = value;
+        JsonArray *ids = json_array_new();
+        guint i;
+
+        for(i = 0; i < SEENEVENTS_PER_ROOM; i++) {
+            const gchar *event_id =
+                    room->ids[(room->next + i) % SEENEVENTS_PER_ROOM];
+            if(event_id != NULL)
+                json_array_add_string_element(ids, event_id);
+        }
+        json_object_set_array_member(rooms, key, ids);
+    }
+    return rooms;
+}
+
+
+void matrix_seenevents_load(MatrixConnectionData *conn, JsonObject *rooms)
+{
+    GList *room_ids, *elem;
+
+    room_ids = json_object_get_members(rooms);
+    for(elem = room_ids; elem != NULL; elem = elem->next) {
+        JsonArray *ids = matrix_json_object_get_array_member(rooms,
+                elem->data);
+        MatrixRoomSeenEvents *room;
+        guint i, len;
+
+        len = ids == NULL ? 0 : json_array_get_length(ids);
+        if(len == 0)
+            continue;
+
+        room = _get_room(conn, elem->data, TRUE);
+        for(i = 0; i < len; i++) {
+            const gchar *event_id = matrix_json_array_get_string_element(ids,
+                    i);
+            if(event_id != NULL)
+                _add(room, event_id);
+        }
+    }
+    g_list_free(room_ids);
+}
+
+
+void matrix_seenevents_free_all(MatrixConnectionData *conn)
+{
+    if(conn->seen_events != NULL)
+        g_hash_table_destroy(conn->seen_events);
+    conn->seen_events = NULL;
+    conn->seen_events_dirty = FALSE;
+}
@@ -0,0 +1,74 @@
+/**
+ * matrix-seenevents.h: remembering which events we have already shown
+ *
+ * The same event can reach us more than once: a retried or overlapping
+ * /sync, a backfill which overlaps the timeline, or (most often) a restart
+ * which picks up from a slightly older sync token than the one we had got
+ * to. To avoid showing the user the same message twice, we keep the ids of
+ * the last few events we showed in each room, and drop any event we have
+ * seen before. The ids are saved alongside the sync token, so that they
+ * survive a restart.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_SEENEVENTS_H_
+#define MATRIX_SEENEVENTS_H_
+
+#include <glib.h>
+
+#include <json-glib/json-glib.h>
+
+#include "matrix-connection.h"
+
+/**
+ * Check if we have already shown an event in a room
+ */
+gboolean matrix_seenevents_contains(MatrixConnectionData *conn,
+        const gchar *room_id, const gchar *event_id);
+
+/**
+ * Record that we have shown an event in a room. If we already have as many
+ * ids as we keep for the room, the oldest is forgotten.
+ */
+void matrix_seenevents_add(MatrixConnectionData *conn, const gchar *room_id,
+        const gchar *event_id);
+
+/**
+ * Forget about the events in a room
+ */
+void matrix_seenevents_forget_room(MatrixConnectionData *conn,
+        const gchar *room_id);
+
+/**
+ * Build a JSON object mapping each room id to a list of the event ids we have
+ * seen in it (oldest first).
+ *
+ * @returns a new JsonObject, which should be unreffed by the caller
+ */
+JsonObject *matrix_seenevents_to_json(MatrixConnectionData *conn);
+
+/**
+ * Load the event ids from an object built by matrix_seenevents_to_json
+ */
+void matrix_seenevents_load(MatrixConnectionData *conn, JsonObject *rooms);
+
+/**
+ * Free all of the event ids on a connection
+ */
+void matrix_seenevents_free_all(MatrixConnectionData *conn);
+
+#endif /* MATRIX_SEENEVENTS_H_ */
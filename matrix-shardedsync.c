@@ -0,0 +1,577 @@
+/**
+ * matrix-shardedsync.c: initial sync in parallel pieces
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-shardedsync.h"
+
+/* json-glib */
+#include <json-glib/json-glib.h>
+
+/* libpurple */
+#include "connection.h"
+#include "debug.h"
+
+/* libmatrix */
+#include "libmatrix.h"
+#include "matrix-api.h"
+#include "matrix-json.h"
+#include "matrix-sync.h"
+
+/* we only bother splitting up the initial sync if there are at least this
+ * many rooms */
+#define SHARDED_SYNC_MIN_ROOMS 100
+
+/* the number of shards we split the joined rooms into. (There is one more
+ * shard for everything else.) */
+#define SHARDED_SYNC_SHARDS 4
+
+/* if the sharded sync hasn't finished after this long (in seconds), we give
+ * up and fall back to a normal initial sync */
+#define SHARDED_SYNC_TIMEOUT 600
+
+/* the filter for the /sync which gets us the anchor token: no rooms, and
+ * nothing else we can avoid either */
+#define SHARDED_SYNC_ANCHOR_FILTER \
+    "{\"room\":{\"rooms\":[]}," \
+    "\"presence\":{\"not_types\":[\"*\"]}," \
+    "\"account_data\":{\"not_types\":[\"*\"]}}"
+
+
+typedef struct _MatrixShardedSyncShard {
+    struct _MatrixShardedSync *sync;
+
+    /* the filter for this shard, until it has been uploaded */
+    JsonObject *filter;
+
+    /* the request in progress for this shard: uploading the filter, then the
+     * /sync itself */
+    MatrixApiRequestData *request;
+} MatrixShardedSyncShard;
+
+
+typedef struct _MatrixShardedSync {
+    MatrixConnectionData *conn;
+    MatrixShardedSyncCallback callback;
+    gboolean lazy_load_members;
+
+    /* the request for the anchor token, and the token once we have it */
+    MatrixApiRequestData *anchor_request;
+    gchar *anchor;
+
+    /* the request for the list of joined rooms, and the room ids once we
+     * have them (NULL-terminated) */
+    MatrixApiRequestData *rooms_request;
+    gchar **room_ids;
+
+    MatrixShardedSyncShard shards[SHARDED_SYNC_SHARDS + 1];
+    guint shards_pending;
+    gboolean connected;
+
+    /* the ids of the timeline events we have had from the shards */
+    GHashTable *seen_events;
+
+    guint timeout_timer;
+} MatrixShardedSync;
+
+
+/* the result of _shard_preprocess */
+typedef struct {
+    MatrixSyncJob *job;
+    GPtrArray *event_ids;
+} MatrixShardedSyncResult;
+
+
+/**
+ * Cancel a request, if there is one. The pointer is cleared first, so that
+ * the error callback knows to ignore it.
+ */
+static void _cancel_request(MatrixApiRequestData **request)
+{
+    MatrixApiRequestData *r = *request;
+
+    if(r == NULL)
+        return;
+    *request = NULL;
+    matrix_api_cancel(r);
+}
+
+
+static void _free_sync(MatrixShardedSync *sync)
+{
+    guint i;
+
+    _cancel_request(&sync->anchor_request);
+    _cancel_request(&sync->rooms_request);
+    for(i = 0; i <= SHARDED_SYNC_SHARDS; i++) {
+        _cancel_request(&sync->shards[i].request);
+        if(sync->shards[i].filter != NULL)
+            json_object_unref(sync->shards[i].filter);
+    }
+
+    if(sync->timeout_timer != 0)
+        purple_timeout_remove(sync->timeout_timer);
+
+    if(sync->seen_events != NULL)
+        g_hash_table_destroy(sync->seen_events);
+    g_strfreev(sync->room_ids);
+    g_free(sync->anchor);
+    g_free(sync);
+}
+
+
+/**
+ * We're done, one way or another: tidy up and tell the connection
+ *
+ * @param since   the token to carry on from, or NULL to fall back to a
+ *                   normal initial sync
+ */
+static void _finish(MatrixShardedSync *sync, const gchar *since)
+{
+    MatrixConnectionData *conn = sync->conn;
+    MatrixShardedSyncCallback callback = sync->callback;
+    GHashTable *seen_events = sync->seen_events;
+    gchar *since_copy = g_strdup(since);
+
+    sync->seen_events = NULL;
+    conn->sharded_sync = NULL;
+    _free_sync(sync);
+
+    callback(conn, since_copy, seen_events);
+    g_free(since_copy);
+}
+
+
+static void _fail(MatrixShardedSync *sync, const gchar *reason)
+{
+    purple_debug_warning("matrixprpl", "sharded sync failed (%s): falling "
+            "back to a normal initial sync\n", reason);
+    _finish(sync, NULL);
+}
+
+
+static gboolean _timeout_cb(gpointer user_data)
+{
+    MatrixShardedSync *sync = user_data;
+
+    sync->timeout_timer = 0;
+    _fail(sync, "timed out");
+    return FALSE;
+}
+
+
+/******************************************************************************
+ *
+ * The shards
+ */
+
+/**
+ * Build the filter for a shard
+ *
+ * @param rooms    the room ids for the shard (we take ownership)
+ * @param exclude  TRUE if this is the final shard, which is for everything
+ *                     except the given rooms
+ */
+static JsonObject *_build_filter(MatrixShardedSync *sync, JsonArray *rooms,
+        gboolean exclude)
+{
+    JsonObject *filter = json_object_new();
+    JsonObject *room_filter = json_object_new();
+
+    json_object_set_array_member(room_filter, exclude ? "not_rooms" : "rooms",
+            rooms);
+
+    if(sync->lazy_load_members) {
+        JsonObject *state_filter = json_object_new();
+        json_object_set_boolean_member(state_filter, "lazy_load_members",
+                TRUE);
+        json_object_set_object_member(room_filter, "state", state_filter);
+    }
+    json_object_set_object_member(filter, "room", room_filter);
+
+    /* only the final shard needs the things which aren't to do with rooms */
+    if(!exclude) {
+        JsonObject *presence = json_object_new();
+        JsonObject *account_data = json_object_new();
+        JsonArray *not_types;
+
+        not_types = json_array_new();
+        json_array_add_string_element(not_types, "*");
+        json_object_set_array_member(presence, "not_types", not_types);
+        json_object_set_object_member(filter, "presence", presence);
+
+        not_types = json_array_new();
+        json_array_add_string_element(not_types, "*");
+        json_object_set_array_member(account_data, "not_types", not_types);
+        json_object_set_object_member(filter, "account_data", account_data);
+    }
+
+    return filter;
+}
+
+
+/**
+ * Get the ids of the events in the timelines of the joined rooms in a /sync
+ * response. Called on the worker thread.
+ */
+static GPtrArray *_get_timeline_event_ids(JsonNode *json_root)
+{
+    GPtrArray *event_ids = g_ptr_array_new();
+    JsonObject *joined_rooms;
+    GList *room_ids, *elem;
+
+    joined_rooms = matrix_json_object_get_object_member(
+            matrix_json_object_get_object_member(
+                    matrix_json_node_get_object(json_root), "rooms"),
+            "join");
+    if(joined_rooms == NULL)
+        return event_ids;
+
+    room_ids = json_object_get_members(joined_rooms);
+    for(elem = room_ids; elem != NULL; elem = elem->next) {
+        JsonArray *events;
+        guint i, len;
+
+        events = matrix_json_object_get_array_member(
+                matrix_json_object_get_object_member(
+                        matrix_json_object_get_object_member(joined_rooms,
+                                elem->data),
+                        "timeline"),
+                "events");
+        len = events == NULL ? 0 : json_array_get_length(events);
+        for(i = 0; i < len; i++) {
+            const gchar *event_id = matrix_json_object_get_string_member(
+                    matrix_json_node_get_object(
+                            json_array_get_element(events, i)),
+                    "event_id");
+            if(event_id != NULL)
+                g_ptr_array_add(event_ids, g_strdup(event_id));
+        }
+    }
+    g_list_free(room_ids);
+    return event_ids;
+}
+
+
+static gpointer _shard_preprocess(JsonNode *json_root)
+{
+    MatrixShardedSyncResult *result = g_new0(MatrixShardedSyncResult, 1);
+
+    result->event_ids = _get_timeline_event_ids(json_root);
+    result->job = matrix_sync_preprocess(json_root);
+
+    /* the token from a shard is no good for carrying on from */
+    matrix_sync_job_set_store_next_batch(result->job, FALSE);
+    return result;
+}
+
+
+static void _free_result(gpointer data)
+{
+    MatrixShardedSyncResult *result = data;
+    guint i;
+
+    for(i = 0; i < result->event_ids->len; i++)
+        g_free(g_ptr_array_index(result->event_ids, i));
+    g_ptr_array_free(result->event_ids, TRUE);
+    matrix_sync_job_free(result->job);
+    g_free(result);
+}
+
+
+static void _shard_error(MatrixConnectionData *conn, gpointer user_data,
+        const gchar *error_message)
+{
+    MatrixShardedSyncShard *shard = user_data;
+
+    /* if we have already forgotten about the request, we cancelled it */
+    if(shard->request == NULL)
+        return;
+    shard->request = NULL;
+    _fail(shard->sync, error_message);
+}
+
+
+static void _shard_bad_response(MatrixConnectionData *conn,
+        gpointer user_data, int http_response_code, JsonNode *json_root)
+{
+    MatrixShardedSyncShard *shard = user_data;
+    gchar *reason;
+
+    if(shard->request == NULL)
+        return;
+    shard->request = NULL;
+
+    reason = g_strdup_printf("%i", http_response_code);
+    _fail(shard->sync, reason);
+    g_free(reason);
+}
+
+
+static void _shard_complete(MatrixConnectionData *conn, gpointer user_data,
+        JsonNode *json_root, gpointer preprocessed)
+{
+    MatrixShardedSyncShard *shard = user_data;
+    MatrixShardedSync *sync = shard->sync;
+    MatrixShardedSyncResult *result = preprocessed;
+    PurpleConnection *pc = conn->pc;
+    guint i;
+
+    shard->request = NULL;
+
+    if(result == NULL) {
+        _fail(sync, "couldn't parse sync response");
+        return;
+    }
+
+    /* the hash table takes ownership of the ids */
+    for(i = 0; i < result->event_ids->len; i++) {
+        gchar *event_id = g_ptr_array_index(result->event_ids, i);
+        g_hash_table_replace(sync->seen_events, event_id, event_id);
+    }
+    g_ptr_array_free(result->event_ids, TRUE);
+
+    if(!sync->connected) {
+        sync->connected = TRUE;
+        purple_connection_update_progress(pc, _("Connected"), 2, 3);
+        purple_connection_set_state(pc, PURPLE_CONNECTED);
+    }
+
+    matrix_sync_apply(pc, result->job);
+    g_free(result);
+
+    if(--sync->shards_pending > 0)
+        return;
+
+    purple_debug_info("matrixprpl", "sharded sync complete\n");
+    _finish(sync, sync->anchor);
+}
+
+
+static void _filter_complete(MatrixConnectionData *conn, gpointer user_data,
+        JsonNode *json_root)
+{
+    MatrixShardedSyncShard *shard = user_data;
+    const gchar *filter_id;
+
+    shard->request = NULL;
+
+    filter_id = matrix_json_object_get_string_member(
+            matrix_json_node_get_object(json_root), "filter_id");
+    if(filter_id == NULL) {
+        _fail(shard->sync, "no filter_id");
+        return;
+    }
+
+    shard->request = matrix_api_sync(conn, NULL, 0, FALSE, filter_id,
+            _shard_preprocess, _free_result, _shard_complete, _shard_error,
+            _shard_bad_response, shard);
+}
+
+
+/**
+ * Now that we know the rooms and have the anchor token, set off the shards
+ */
+static void _start_shards(MatrixShardedSync *sync)
+{
+    guint nrooms = g_strv_length(sync->room_ids);
+    JsonArray *all_rooms = json_array_new();
+    guint i, j;
+
+    purple_debug_info("matrixprpl", "splitting initial sync of %u rooms into "
+            "%u shards\n", nrooms, SHARDED_SYNC_SHARDS);
+
+    for(i = 0; i < SHARDED_SYNC_SHARDS; i++) {
+        JsonArray *rooms = json_array_new();
+
+        for(j = nrooms * i / SHARDED_SYNC_SHARDS;
+                j < nrooms * (i + 1) / SHARDED_SYNC_SHARDS; j++) {
+            json_array_add_string_element(rooms, sync->room_ids[j]);
+            json_array_add_string_element(all_rooms, sync->room_ids[j]);
+        }
+        sync->shards[i].filter = _build_filter(sync, rooms, FALSE);
+    }
+    sync->shards[SHARDED_SYNC_SHARDS].filter = _build_filter(sync, all_rooms,
+            TRUE);
+
+    sync->shards_pending = SHARDED_SYNC_SHARDS + 1;
+    for(i = 0; i <= SHARDED_SYNC_SHARDS; i++) {
+        MatrixShardedSyncShard *shard = &sync->shards[i];
+        JsonObject *filter = shard->filter;
+
+        shard->filter = NULL;
+        shard->request = matrix_api_create_filter(sync->conn, filter,
+                _filter_complete, _shard_error, _shard_bad_response, shard);
+        json_object_unref(filter);
+    }
+}
+
+
+/******************************************************************************
+ *
+ * The anchor token and room list
+ */
+
+static void _anchor_error(MatrixConnectionData *conn, gpointer user_data,
+        const gchar *error_message)
+{
+    MatrixShardedSync *sync = user_data;
+
+    if(sync->anchor_request == NULL)
+        return;
+    sync->anchor_request = NULL;
+    _fail(sync, error_message);
+}
+
+
+static void _anchor_bad_response(MatrixConnectionData *conn,
+        gpointer user_data, int http_response_code, JsonNode *json_root)
+{
+    MatrixShardedSync *sync = user_data;
+
+    if(sync->anchor_request == NULL)
+        return;
+    sync->anchor_request = NULL;
+    _fail(sync, "bad response to anchor sync");
+}
+
+
+static void _anchor_complete(MatrixConnectionData *conn, gpointer user_data,
+        JsonNode *json_root, gpointer preprocessed)
+{
+    MatrixShardedSync *sync = user_data;
+    MatrixSyncJob *job = preprocessed;
+
+    sync->anchor_request = NULL;
+
+    if(job != NULL) {
+        sync->anchor = g_strdup(matrix_sync_job_get_next_batch(job));
+        matrix_sync_job_free(job);
+    }
+
+    if(sync->anchor == NULL) {
+        _fail(sync, "no next_batch in anchor sync");
+        return;
+    }
+
+    if(sync->room_ids != NULL)
+        _start_shards(sync);
+}
+
+
+static void _rooms_error(MatrixConnectionData *conn, gpointer user_data,
+        const gchar *error_message)
+{
+    MatrixShardedSync *sync = user_data;
+
+    if(sync->rooms_request == NULL)
+        return;
+    sync->rooms_request = NULL;
+    _fail(sync, error_message);
+}
+
+
+static void _rooms_bad_response(MatrixConnectionData *conn,
+        gpointer user_data, int http_response_code, JsonNode *json_root)
+{
+    MatrixShardedSync *sync = user_data;
+
+    if(sync->rooms_request == NULL)
+        return;
+    sync->rooms_request = NULL;
+    _fail(sync, "bad response to joined_rooms");
+}
+
+
+static void _rooms_complete(MatrixConnectionData *conn, gpointer user_data,
+        JsonNode *json_root)
+{
+    MatrixShardedSync *sync = user_data;
+    JsonArray *joined_rooms;
+    guint i, j, len;
+
+    sync->rooms_request = NULL;
+
+    joined_rooms = matrix_json_object_get_array_member(
+            matrix_json_node_get_object(json_root), "joined_rooms");
+    len = joined_rooms == NULL ? 0 : json_array_get_length(joined_rooms);
+
+    if(len < SHARDED_SYNC_MIN_ROOMS) {
+        purple_debug_info("matrixprpl", "only %u rooms: not sharding the "
+                "initial sync\n", len);
+        _finish(sync, NULL);
+        return;
+    }
+
+    sync->room_ids = g_new0(gchar *, len + 1);
+    for(i = 0, j = 0; i < len; i++) {
+        const gchar *room_id = matrix_json_array_get_string_element(
+                joined_rooms, i);
+        if(room_id != NULL)
+            sync->room_ids[j++] = g_strdup(room_id);
+    }
+
+    if(sync->anchor != NULL)
+        _start_shards(sync);
+}
+
+
+/******************************************************************************
+ *
+ * public api
+ */
+
+void matrix_shardedsync_start(MatrixConnectionData *conn,
+        gboolean lazy_load_members, MatrixShardedSyncCallback callback)
+{
+    MatrixShardedSync *sync;
+    guint i;
+
+    g_assert(conn->sharded_sync == NULL);
+
+    sync = g_new0(MatrixShardedSync, 1);
+    sync->conn = conn;
+    sync->callback = callback;
+    sync->lazy_load_members = lazy_load_members;
+    sync->seen_events = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, NULL);
+    for(i = 0; i <= SHARDED_SYNC_SHARDS; i++)
+        sync->shards[i].sync = sync;
+    conn->sharded_sync = sync;
+
+    sync->timeout_timer = purple_timeout_add_seconds(SHARDED_SYNC_TIMEOUT,
+            _timeout_cb, sync);
+
+    /* these two go in parallel: we need both before we can start the
+     * shards */
+    sync->anchor_request = matrix_api_sync(conn, NULL, 0, FALSE,
+            SHARDED_SYNC_ANCHOR_FILTER, matrix_sync_preprocess,
+            (GDestroyNotify) matrix_sync_job_free, _anchor_complete,
+            _anchor_error, _anchor_bad_response, sync);
+    sync->rooms_request = matrix_api_get_joined_rooms(conn, _rooms_complete,
+            _rooms_error, _rooms_bad_response, sync);
+}
+
+
+void matrix_shardedsync_cancel(MatrixConnectionData *conn)
+{
+    MatrixShardedSync *sync = conn->sharded_sync;
+
+    if(sync == NULL)
+        return;
+    conn->sharded_sync = NULL;
+    _free_sync(sync);
+}
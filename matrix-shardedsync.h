@@ -0,0 +1,75 @@
+/**
+ * matrix-shardedsync.h: initial sync in parallel pieces
+ *
+ * For an account in a lot of rooms, the initial /sync is one enormous
+ * request, which the server has to put together one room at a time. Instead,
+ * we can split the rooms into a few groups ('shards'), and do an initial sync
+ * of each shard at the same time, using a filter which only includes the
+ * rooms in that shard. A final shard picks up everything else (invites, and
+ * any rooms we joined in the meantime).
+ *
+ * Each shard ends up with its own next_batch token, but we need a single
+ * token to carry on from. So before we start the shards, we do a /sync which
+ * includes no rooms at all, just to get a token (the 'anchor'); once the
+ * shards are done, the normal sync loop carries on from there. That means
+ * the first incremental sync will repeat some of the events from the shards,
+ * and include older ones from before each shard's window. We remember the ids
+ * of the events from the shards, so that the repeats and anything older can
+ * be dropped rather than shown out of order (see
+ * matrix_sync_drop_seen_events).
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_SHARDEDSYNC_H_
+#define MATRIX_SHARDEDSYNC_H_
+
+#include <glib.h>
+
+#include "matrix-connection.h"
+
+/**
+ * The type of the function which is called when a sharded sync is finished.
+ *
+ * @param since        the token to start the sync loop from, or NULL if the
+ *                         sharded sync failed (or wasn't worth doing), and
+ *                         we need a normal initial sync instead
+ * @param seen_events  the set of event ids from the timelines we have
+ *                         already handled (which should be passed to
+ *                         matrix_sync_job_drop_events for the next sync); or
+ *                         NULL. The callback takes ownership.
+ */
+typedef void (*MatrixShardedSyncCallback)(MatrixConnectionData *conn,
+        const gchar *since, GHashTable *seen_events);
+
+/**
+ * Start a sharded initial sync. The results are applied with
+ * matrix_sync_apply as they arrive, and the callback is called once they
+ * have all arrived.
+ *
+ * @param lazy_load_members  TRUE to ask the server to lazy-load the members
+ *                              of each room, as for a normal /sync
+ */
+void matrix_shardedsync_start(MatrixConnectionData *conn,
+        gboolean lazy_load_members, MatrixShardedSyncCallback callback);
+
+/**
+ * Abandon a sharded sync, if one is in progress, without calling the
+ * callback.
+ */
+void matrix_shardedsync_cancel(MatrixConnectionData *conn);
+
+#endif /* MATRIX_SHARDEDSYNC_H_ */
@@ -0,0 +1,482 @@
+/**
+ * matrix-slidingsync.c: sync via the sliding sync API
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-slidingsync.h"
+
+/* json-glib */
+#include <json-glib/json-glib.h>
+
+/* libpurple */
+#include "connection.h"
+#include "conversation.h"
+#include "debug.h"
+
+/* libmatrix */
+#include "libmatrix.h"
+#include "matrix-json.h"
+#include "matrix-roomregistry.h"
+#include "matrix-sync.h"
+
+/* the name of our (only) room list */
+#define SLIDINGSYNC_LIST "rooms"
+
+/* how many rooms we add to the window at a time */
+#define SLIDINGSYNC_WINDOW_STEP 50
+
+/* the number of timeline events we ask for, for rooms in the list and for
+ * rooms the user has open */
+#define SLIDINGSYNC_LIST_TIMELINE_LIMIT 1
+#define SLIDINGSYNC_SUBSCRIPTION_TIMELINE_LIMIT 20
+
+
+/* the result of _preprocess */
+typedef struct {
+    MatrixSyncJob *job;
+
+    /* the number of rooms in the list, or -1 if not known */
+    gint64 count;
+} MatrixSlidingSyncResult;
+
+
+/* the callbacks the caller gave us */
+typedef struct {
+    MatrixApiPreprocessedCallback callback;
+    MatrixApiErrorCallback error_callback;
+    MatrixApiBadResponseCallback bad_response_callback;
+    gpointer user_data;
+} MatrixSlidingSyncRequest;
+
+
+/******************************************************************************
+ *
+ * Building the request
+ */
+
+/**
+ * Add a [event_type, state_key] pair to a required_state list
+ */
+static void _add_required_state(JsonArray *required_state,
+        const gchar *event_type, const gchar *state_key)
+{
+    JsonArray *pair = json_array_new();
+    json_array_add_string_element(pair, event_type);
+    json_array_add_string_element(pair, state_key);
+    json_array_add_array_element(required_state, pair);
+}
+
+
+static JsonObject *_build_list(MatrixConnectionData *conn)
+{
+    JsonObject *list = json_object_new();
+    JsonArray *ranges, *range, *sort, *required_state;
+
+    range = json_array_new();
+    json_array_add_int_element(range, 0);
+    json_array_add_int_element(range, conn->slidingsync_window - 1);
+    ranges = json_array_new();
+    json_array_add_array_element(ranges, range);
+    json_object_set_array_member(list, "ranges", ranges);
+
+    sort = json_array_new();
+    json_array_add_string_element(sort, "by_notification_level");
+    json_array_add_string_element(sort, "by_recency");
+    json_object_set_array_member(list, "sort", sort);
+
+    /* just enough to name the room and show who sent the last message */
+    required_state = json_array_new();
+    _add_required_state(required_state, "m.room.name", "");
+    _add_required_state(required_state, "m.room.canonical_alias", "");
+    _add_required_state(required_state, "m.room.member", "$LAZY");
+    _add_required_state(required_state, "m.room.member", "$ME");
+    json_object_set_array_member(list, "required_state", required_state);
+
+    json_object_set_int_member(list, "timeline_limit",
+            SLIDINGSYNC_LIST_TIMELINE_LIMIT);
+    return list;
+}
+
+
+static JsonObject *_build_subscription()
+{
+    JsonObject *subscription = json_object_new();
+    JsonArray *required_state = json_array_new();
+
+    _add_required_state(required_state, "*", "*");
+    json_object_set_array_member(subscription, "required_state",
+            required_state);
+    json_object_set_int_member(subscription, "timeline_limit",
+            SLIDINGSYNC_SUBSCRIPTION_TIMELINE_LIMIT);
+    return subscription;
+}
+
+
+static JsonObject *_build_request(MatrixConnectionData *conn)
+{
+    JsonObject *request, *lists, *subscriptions;
+    GList *conversations, *ptr;
+
+    if(conn->slidingsync_window == 0)
+        conn->slidingsync_window = SLIDINGSYNC_WINDOW_STEP;
+
+    lists = json_object_new();
+    json_object_set_object_member(lists, SLIDINGSYNC_LIST, _build_list(conn));
+
+    subscriptions = json_object_new();
+    if(conn->slidingsync_subscriptions != NULL) {
+        GHashTableIter iter;
+        gpointer key;
+
+        g_hash_table_iter_init(&iter, conn->slidingsync_subscriptions);
+        while(g_hash_table_iter_next(&iter, &key, NULL)) {
+            json_object_set_object_member(subscriptions, key,
+                    _build_subscription());
+        }
+    }
+
+    /* the room the user is looking at counts as open, too */
+    conversations = matrix_roomregistry_get_conversations(conn);
+    for(ptr = conversations; ptr != NULL; ptr = ptr->next) {
+        PurpleConversation *conv = ptr->data;
+        if(purple_conversation_has_focus(conv) &&
+                !json_object_has_member(subscriptions, conv->name)) {
+            json_object_set_object_member(subscriptions, conv->name,
+                    _build_subscription());
+        }
+    }
+    g_list_free(conversations);
+
+    request = json_object_new();
+    json_object_set_object_member(request, "lists", lists);
+    json_object_set_object_member(request, "room_subscriptions",
+            subscriptions);
+    return request;
+}
+
+
+/******************************************************************************
+ *
+ * Translating the response
+ *
+ * This happens on the API worker thread, so must not call into libpurple.
+ */
+
+/**
+ * Build an object of the form {"events": [...]}, sharing the given array
+ */
+static JsonObject *_events_object(JsonArray *events)
+{
+    JsonObject *obj = json_object_new();
+
+    json_object_set_array_member(obj, "events",
+            events == NULL ? json_array_new() : json_array_ref(events));
+    return obj;
+}
+
+
+/**
+ * Build a /sync-style room summary from the heroes and member counts in a
+ * sliding sync room
+ */
+static JsonObject *_translate_summary(JsonObject *ss_room)
+{
+    JsonObject *summary = json_object_new();
+    JsonArray *ss_heroes;
+
+    ss_heroes = matrix_json_object_get_array_member(ss_room, "heroes");
+    if(ss_heroes != NULL) {
+        JsonArray *heroes = json_array_new();
+        guint i, len = json_array_get_length(ss_heroes);
+
+        for(i = 0; i < len; i++) {
+            const gchar *user_id = matrix_json_object_get_string_member(
+                    matrix_json_node_get_object(
+                            json_array_get_element(ss_heroes, i)),
+                    "user_id");
+            if(user_id != NULL)
+                json_array_add_string_element(heroes, user_id);
+        }
+        json_object_set_array_member(summary, "m.heroes", heroes);
+    }
+
+    if(json_object_has_member(ss_room, "joined_count"))
+        json_object_set_int_member(summary, "m.joined_member_count",
+                matrix_json_object_get_int_member(ss_room, "joined_count"));
+    if(json_object_has_member(ss_room, "invited_count"))
+        json_object_set_int_member(summary, "m.invited_member_count",
+                matrix_json_object_get_int_member(ss_room, "invited_count"));
+
+    return summary;
+}
+
+
+/**
+ * Translate a room from the sliding sync response into the format of a room
+ * in rooms.join in a /sync response.
+ *
+ * We don't pass on the 'limited' flag: the position tokens from sliding sync
+ * can't be used for backfilling, and rooms which have just come into the
+ * window are always limited.
+ */
+static JsonObject *_translate_joined_room(JsonObject *ss_room)
+{
+    JsonObject *room = json_object_new();
+    JsonObject *unread = json_object_new();
+
+    json_object_set_object_member(room, "state", _events_object(
+            matrix_json_object_get_array_member(ss_room, "required_state")));
+    json_object_set_object_member(room, "timeline", _events_object(
+            matrix_json_object_get_array_member(ss_room, "timeline")));
+
+    json_object_set_int_member(unread, "highlight_count",
+            matrix_json_object_get_int_member(ss_room, "highlight_count"));
+    json_object_set_int_member(unread, "notification_count",
+            matrix_json_object_get_int_member(ss_room, "notification_count"));
+    json_object_set_object_member(room, "unread_notifications", unread);
+
+    json_object_set_object_member(room, "summary", _translate_summary(ss_room));
+
+    return room;
+}
+
+
+JsonNode *matrix_slidingsync_translate_response(JsonObject *ss_root)
+{
+    JsonObject *root, *rooms, *join, *invite, *ss_rooms;
+    JsonNode *result;
+    GList *room_ids, *elem;
+
+    join = json_object_new();
+    invite = json_object_new();
+
+    ss_rooms = matrix_json_object_get_object_member(ss_root, "rooms");
+    room_ids = ss_rooms == NULL ? NULL : json_object_get_members(ss_rooms);
+    for(elem = room_ids; elem != NULL; elem = elem->next) {
+        const gchar *room_id = elem->data;
+        JsonObject *ss_room = matrix_json_object_get_object_member(ss_rooms,
+                room_id);
+        JsonArray *invite_state;
+
+        if(ss_room == NULL)
+            continue;
+
+        invite_state = matrix_json_object_get_array_member(ss_room,
+                "invite_state");
+        if(invite_state != NULL) {
+            JsonObject *invite_room = json_object_new();
+            json_object_set_object_member(invite_room, "invite_state",
+                    _events_object(invite_state));
+            if(json_object_has_member(ss_room, "joined_count"))
+                json_object_set_object_member(invite_room, "summary",
+                        _translate_summary(ss_room));
+            json_object_set_object_member(invite, room_id, invite_room);
+        } else {
+            json_object_set_object_member(join, room_id,
+                    _translate_joined_room(ss_room));
+        }
+    }
+    g_list_free(room_ids);
+
+    rooms = json_object_new();
+    json_object_set_object_member(rooms, "join", join);
+    json_object_set_object_member(rooms, "invite", invite);
+
+    root = json_object_new();
+    json_object_set_string_member(root, "next_batch",
+            matrix_json_object_get_string_member(ss_root, "pos"));
+    json_object_set_object_member(root, "rooms", rooms);
+
+    result = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(result, root);
+    return result;
+}
+
+
+static gpointer _preprocess(JsonNode *json_root)
+{
+    MatrixSlidingSyncResult *result = g_new0(MatrixSlidingSyncResult, 1);
+    JsonObject *ss_root, *list;
+    JsonNode *translated;
+
+    ss_root = matrix_json_node_get_object(json_root);
+
+    list = matrix_json_object_get_object_member(
+            matrix_json_object_get_object_member(ss_root, "lists"),
+            SLIDINGSYNC_LIST);
+    result->count = list == NULL ? -1 :
+            matrix_json_object_get_int_member(list, "count");
+
+    translated = matrix_slidingsync_translate_response(ss_root);
+    result->job = matrix_sync_preprocess(translated);
+    json_node_free(translated);
+
+    /* the position token is no good to a classic /sync on a later
+     * connection */
+    matrix_sync_job_set_store_next_batch(result->job, FALSE);
+
+    return result;
+}
+
+
+static void _free_result(gpointer data)
+{
+    MatrixSlidingSyncResult *result = data;
+
+    if(result->job != NULL)
+        matrix_sync_job_free(result->job);
+    g_free(result);
+}
+
+
+/******************************************************************************
+ *
+ * Callbacks
+ */
+
+static void _complete(MatrixConnectionData *conn, gpointer user_data,
+        JsonNode *json_root, gpointer preprocessed)
+{
+    MatrixSlidingSyncRequest *request = user_data;
+    MatrixSlidingSyncResult *result = preprocessed;
+    MatrixSyncJob *job = NULL;
+
+    if(result != NULL) {
+        /* widen the window if there are more rooms to come */
+        if(result->count > conn->slidingsync_window) {
+            conn->slidingsync_window += SLIDINGSYNC_WINDOW_STEP;
+            purple_debug_info("matrixprpl", "sliding sync: %u of %"
+                    G_GINT64_FORMAT " rooms\n", conn->slidingsync_window,
+                    result->count);
+        }
+        conn->slidingsync_count = result->count;
+        job = result->job;
+        g_free(result);
+    }
+
+    request->callback(conn, request->user_data, json_root, job);
+    g_free(request);
+}
+
+
+static void _error(MatrixConnectionData *conn, gpointer user_data,
+        const gchar *error_message)
+{
+    MatrixSlidingSyncRequest *request = user_data;
+
+    if(request->error_callback != NULL)
+        request->error_callback(conn, request->user_data, error_message);
+    else
+        matrix_api_error(conn, request->user_data, error_message);
+    g_free(request);
+}
+
+
+static void _bad_response(MatrixConnectionData *conn, gpointer user_data,
+        int http_response_code, JsonNode *json_root)
+{
+    MatrixSlidingSyncRequest *request = user_data;
+
+    if(request->bad_response_callback != NULL)
+        request->bad_response_callback(conn, request->user_data,
+                http_response_code, json_root);
+    else
+        matrix_api_bad_response(conn, request->user_data, http_response_code,
+                json_root);
+    g_free(request);
+}
+
+
+/******************************************************************************
+ *
+ * public api
+ */
+
+MatrixApiRequestData *matrix_slidingsync_request(MatrixConnectionData *conn,
+        const gchar *pos, int timeout,
+        MatrixApiPreprocessedCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data)
+{
+    MatrixSlidingSyncRequest *request;
+    MatrixApiRequestData *fetch_data;
+    JsonObject *body;
+
+    request = g_new0(MatrixSlidingSyncRequest, 1);
+    request->callback = callback;
+    request->error_callback = error_callback;
+    request->bad_response_callback = bad_response_callback;
+    request->user_data = user_data;
+
+    /* if we haven't yet got the whole room list, don't wait around for new
+     * events */
+    if(pos == NULL || conn->slidingsync_count < 0 ||
+            conn->slidingsync_count > conn->slidingsync_window)
+        timeout = 0;
+
+    body = _build_request(conn);
+    fetch_data = matrix_api_sliding_sync(conn, pos, timeout, body,
+            _preprocess, _free_result, _complete, _error, _bad_response,
+            request);
+    json_object_unref(body);
+
+    return fetch_data;
+}
+
+
+gboolean matrix_slidingsync_position_expired(MatrixConnectionData *conn,
+        int http_response_code, JsonNode *json_root)
+{
+    if(http_response_code != 400 || g_strcmp0(
+            matrix_json_object_get_string_member(
+                    matrix_json_node_get_object(json_root), "errcode"),
+            "M_UNKNOWN_POS") != 0)
+        return FALSE;
+
+    purple_debug_info("matrixprpl", "sliding sync position expired\n");
+    conn->slidingsync_window = 0;
+    conn->slidingsync_count = -1;
+    return TRUE;
+}
+
+
+void matrix_slidingsync_subscribe(MatrixConnectionData *conn,
+        const gchar *room_id)
+{
+    if(conn->slidingsync_subscriptions == NULL)
+        conn->slidingsync_subscriptions = g_hash_table_new_full(g_str_hash,
+                g_str_equal, g_free, NULL);
+
+    g_hash_table_replace(conn->slidingsync_subscriptions, g_strdup(room_id),
+            NULL);
+}
+
+
+void matrix_slidingsync_unsubscribe(MatrixConnectionData *conn,
+        const gchar *room_id)
+{
+    if(conn->slidingsync_subscriptions != NULL)
+        g_hash_table_remove(conn->slidingsync_subscriptions, room_id);
+}
+
+
+void matrix_slidingsync_free(MatrixConnectionData *conn)
+{
+    if(conn->slidingsync_subscriptions != NULL)
+        g_hash_table_destroy(conn->slidingsync_subscriptions);
+    conn->slidingsync_subscriptions = NULL;
+}
@@ -0,0 +1,100 @@
+/**
+ * matrix-slidingsync.h: sync via the sliding sync API
+ *
+ * For accounts in a very large number of rooms, the classic /sync API is slow
+ * to start up, since the initial sync has to include every room. Sliding sync
+ * (MSC3575) instead gives us a window onto the list of rooms, ordered by
+ * recency, which we widen a bit at a time; and full details of the rooms
+ * which the user actually has open.
+ *
+ * The responses are translated into the shape of a classic /sync response, so
+ * that they can be applied by matrix-sync.c in the same way.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_SLIDINGSYNC_H_
+#define MATRIX_SLIDINGSYNC_H_
+
+#include <glib.h>
+
+#include "matrix-api.h"
+#include "matrix-connection.h"
+
+/**
+ * Make a sliding sync request.
+ *
+ * The callback is given a MatrixSyncJob * as its 'preprocessed' argument,
+ * exactly as for a classic /sync with matrix_sync_preprocess; the next_batch
+ * of the job is the position token to pass in to the next request.
+ *
+ * @param conn       The connection with which to make the request
+ * @param pos        If non-null, the position token from the previous response
+ * @param timeout    Number of milliseconds after which the request will time
+ *                      out if no events. (This is ignored while we are still
+ *                      widening the window onto the room list.)
+ *
+ * The other parameters are as for matrix_api_sync.
+ */
+MatrixApiRequestData *matrix_slidingsync_request(MatrixConnectionData *conn,
+        const gchar *pos, int timeout,
+        MatrixApiPreprocessedCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data);
+
+/**
+ * Translate a sliding sync response into the shape of a /sync response. This
+ * is thread-safe.
+ *
+ * @returns a new JsonNode, to be freed with json_node_free
+ */
+struct _JsonNode *matrix_slidingsync_translate_response(
+        struct _JsonObject *ss_root);
+
+/**
+ * Check whether a request was rejected because our position token has
+ * expired (which the server may do after a while). If so, the window onto the
+ * room list is reset, and the caller should start again with no position.
+ *
+ * @param conn                The connection the request was made on
+ * @param http_response_code  The HTTP status of the response
+ * @param json_root           The body of the response
+ *
+ * @returns TRUE if the position has expired
+ */
+gboolean matrix_slidingsync_position_expired(MatrixConnectionData *conn,
+        int http_response_code, struct _JsonNode *json_root);
+
+/**
+ * Ask for full details of a room (because the user has opened it), from the
+ * next request onwards.
+ */
+void matrix_slidingsync_subscribe(MatrixConnectionData *conn,
+        const gchar *room_id);
+
+/**
+ * Stop asking for full details of a room
+ */
+void matrix_slidingsync_unsubscribe(MatrixConnectionData *conn,
+        const gchar *room_id);
+
+/**
+ * Free the sliding sync state on a connection
+ */
+void matrix_slidingsync_free(MatrixConnectionData *conn);
+
+#endif /* MATRIX_SLIDINGSYNC_H_ */
@@ -0,0 +1,548 @@
+/**
+ * matrix-statecache.c: on-disk cache of room state
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-statecache.h"
+
+/* stdlib */
+#include <string.h>
+#include <sys/stat.h>
+
+/* glib */
+#include <glib/gstdio.h>
+
+/* json-glib */
+#include <json-glib/json-glib.h>
+
+/* libpurple */
+#include "account.h"
+#include "connection.h"
+#include "conversation.h"
+#include "debug.h"
+#include "util.h"
+
+/* libmatrix */
+#include "libmatrix.h"
+#include "matrix-connection.h"
+#include "matrix-dormantroom.h"
+#include "matrix-ephemeral.h"
+#include "matrix-json.h"
+#include "matrix-room.h"
+#include "matrix-roomregistry.h"
+#include "matrix-seenevents.h"
+#include "matrix-statetable.h"
+#include "matrix-sync.h"
+
+/* bump this if the format of the cache changes, to make us ignore old
+ * caches */
+#define STATECACHE_VERSION 1
+
+/* how long we wait before writing a new sync token, in seconds */
+#define NEXT_BATCH_SAVE_INTERVAL 30
+
+/* the files we keep for each account, named after the account */
+#define STATE_FILE_SUFFIX ".state.json"
+#define NEXT_BATCH_FILE_SUFFIX ".next_batch"
+#define SEEN_EVENTS_FILE_SUFFIX ".seen_events.json"
+#define SESSION_FILE_SUFFIX ".session.json"
+
+
+/**
+ * Get the name of the directory where we keep our caches
+ *
+ * @returns a string which should be freed
+ */
+static gchar *_get_cache_dir()
+{
+    return g_build_filename(purple_user_dir(), "matrix", NULL);
+}
+
+
+/**
+ * Get the name of one of the files we keep in the cache directory for an
+ * account
+ *
+ * @param suffix   which file: one of the *_FILE_SUFFIX values
+ *
+ * @returns a string which should be freed
+ */
+static gchar *_get_account_filename(PurpleAccount *account,
+        const gchar *suffix)
+{
+    gchar *dir, *basename, *filename;
+
+    dir = _get_cache_dir();
+    basename = g_strconcat(purple_escape_filename(account->username), suffix,
+            NULL);
+    filename = g_build_filename(dir, basename, NULL);
+    g_free(basename);
+    g_free(dir);
+    return filename;
+}
+
+
+/**
+ * Write a file into the cache directory, atomically
+ *
+ * @returns TRUE on success
+ */
+static gboolean _write_cache_file(const gchar *filename, const gchar *data,
+        gsize data_len)
+{
+    gchar *dir = _get_cache_dir();
+    gboolean result;
+
+    /* purple_util_write_data_to_file_absolute writes to a temporary file and
+     * renames it into place, so we never leave a half-written file. It also
+     * makes the file readable only by the user.
+     */
+    result = purple_build_dir(dir, S_IRUSR | S_IWUSR | S_IXUSR) == 0 &&
+            purple_util_write_data_to_file_absolute(filename, data, data_len);
+    g_free(dir);
+    return result;
+}
+
+
+/**
+ * Build the cached form of a room's state
+ */
+static JsonObject *_build_room_object(MatrixRoomStateEventTable *state_table,
+        MatrixRoomSummary *summary)
+{
+    JsonObject *room_obj, *state_obj;
+
+    state_obj = json_object_new();
+    json_object_set_array_member(state_obj, "events",
+            matrix_statetable_to_json(state_table));
+
+    room_obj = json_object_new();
+    json_object_set_object_member(room_obj, "state", state_obj);
+    if(summary != NULL)
+        json_object_set_object_member(room_obj, "summary",
+                matrix_roomsummary_to_json(summary));
+    return room_obj;
+}
+
+
+/**
+ * Build the cached form of the account data. We only keep the push rules,
+ * which we need to decide how to handle each room before the next /sync
+ * (which only includes account data which has changed).
+ */
+static JsonObject *_build_account_data_object(MatrixConnectionData *conn)
+{
+    JsonObject *account_data_obj, *rules, *event_obj;
+    JsonArray *events;
+
+    events = json_array_new();
+    rules = matrix_ephemeral_get_account_data(conn, "m.push_rules");
+    if(rules != NULL) {
+        event_obj = json_object_new();
+        json_object_set_string_member(event_obj, "type", "m.push_rules");
+        json_object_set_object_member(event_obj, "content",
+                json_object_ref(rules));
+        json_array_add_object_element(events, event_obj);
+    }
+
+    account_data_obj = json_object_new();
+    json_object_set_array_member(account_data_obj, "events", events);
+    return account_data_obj;
+}
+
+
+/* state for _save_room */
+typedef struct {
+    JsonObject *join_obj;
+    guint nrooms;
+} MatrixStateCacheSaveData;
+
+
+/**
+ * Add the state of a room to the cache (as a MatrixDormantRoomFunc)
+ */
+static void _save_room(const gchar *room_id,
+        MatrixRoomStateEventTable *state_table, MatrixRoomSummary *summary,
+        gpointer user_data)
+{
+    MatrixStateCacheSaveData *data = user_data;
+
+    json_object_set_object_member(data->join_obj, room_id,
+            _build_room_object(state_table, summary));
+    data->nrooms++;
+}
+
+
+void matrix_statecache_save(PurpleConnection *pc, const gchar *next_batch)
+{
+    JsonObject *root_obj, *rooms_obj;
+    JsonNode *root;
+    JsonGenerator *generator;
+    GList *conversations, *ptr;
+    MatrixStateCacheSaveData save_data;
+    gchar *filename, *data;
+    gsize data_len;
+
+    g_assert(next_batch != NULL);
+
+    /* make sure that the token on disk is at least as recent as the cache */
+    matrix_statecache_flush_next_batch(pc);
+
+    save_data.join_obj = json_object_new();
+    save_data.nrooms = 0;
+    conversations = matrix_roomregistry_get_conversations(
+            purple_connection_get_protocol_data(pc));
+    for(ptr = conversations; ptr != NULL; ptr = ptr->next) {
+        PurpleConversation *conv = ptr->data;
+        MatrixRoomStateEventTable *state_table;
+
+        /* rooms we have left no longer have a state table */
+        state_table = matrix_room_get_state_table(conv);
+        if(state_table == NULL)
+            continue;
+
+        _save_room(conv->name, state_table, matrix_room_get_summary(conv),
+                &save_data);
+    }
+    g_list_free(conversations);
+
+    matrix_dormantroom_foreach(purple_connection_get_protocol_data(pc),
+            _save_room, &save_data);
+
+    rooms_obj = json_object_new();
+    json_object_set_object_member(rooms_obj, "join", save_data.join_obj);
+
+    root_obj = json_object_new();
+    json_object_set_int_member(root_obj, "version", STATECACHE_VERSION);
+    json_object_set_string_member(root_obj, "next_batch", next_batch);
+    json_object_set_object_member(root_obj, "rooms", rooms_obj);
+    json_object_set_object_member(root_obj, "account_data",
+            _build_account_data_object(purple_connection_get_protocol_data(
+                    pc)));
+
+    root = json_node_new(JSON_NODE_OBJECT);
+    json_node_set_object(root, root_obj);
+    json_object_unref(root_obj);
+
+    generator = json_generator_new();
+    json_generator_set_root(generator, root);
+    data = json_generator_to_data(generator, &data_len);
+    g_object_unref(G_OBJECT(generator));
+    json_node_free(root);
+
+    filename = _get_account_filename(pc->account, STATE_FILE_SUFFIX);
+    if(!_write_cache_file(filename, data, data_len)) {
+        purple_debug_warning("matrixprpl", "unable to write state cache %s\n",
+                filename);
+    } else {
+        purple_debug_info("matrixprpl", "saved state of %u rooms to %s\n",
+                save_data.nrooms, filename);
+    }
+
+    g_free(data);
+    g_free(filename);
+}
+
+
+gchar *matrix_statecache_restore(PurpleConnection *pc)
+{
+    JsonParser *parser;
+    JsonObject *root_obj;
+    GError *err = NULL;
+    gchar *filename, *result = NULL;
+    const gchar *next_batch;
+
+    filename = _get_account_filename(pc->account, STATE_FILE_SUFFIX);
+    if(!g_file_test(filename, G_FILE_TEST_EXISTS)) {
+        g_free(filename);
+        return NULL;
+    }
+
+    parser = json_parser_new();
+    if(!json_parser_load_from_file(parser, filename, &err)) {
+        purple_debug_warning("matrixprpl", "unable to parse state cache %s: "
+                "%s\n", filename, err->message);
+        g_error_free(err);
+        goto out;
+    }
+
+    root_obj = matrix_json_node_get_object(json_parser_get_root(parser));
+    if(matrix_json_object_get_int_member(root_obj, "version") !=
+            STATECACHE_VERSION) {
+        purple_debug_info("matrixprpl", "ignoring old state cache %s\n",
+                filename);
+        goto out;
+    }
+
+    purple_debug_info("matrixprpl", "restoring room state from %s\n",
+            filename);
+    matrix_sync_parse(pc, json_parser_get_root(parser), &next_batch);
+    result = g_strdup(next_batch);
+
+out:
+    g_object_unref(parser);
+    g_free(filename);
+    return result;
+}
+
+
+void matrix_statecache_clear(PurpleAccount *account)
+{
+    gchar *filename = _get_account_filename(account, STATE_FILE_SUFFIX);
+    g_unlink(filename);
+    g_free(filename);
+}
+
+
+/******************************************************************************
+ *
+ * The sync token
+ */
+
+static void _write_next_batch(PurpleAccount *account,
+        const gchar *next_batch)
+{
+    gchar *filename = _get_account_filename(account, NEXT_BATCH_FILE_SUFFIX);
+
+    if(!_write_cache_file(filename, next_batch, strlen(next_batch))) {
+        purple_debug_warning("matrixprpl", "unable to write sync token %s\n",
+                filename);
+    } else if(purple_account_get_string(account, PRPL_ACCOUNT_OPT_NEXT_BATCH,
+            NULL) != NULL) {
+        /* older versions kept the token in the account settings; now that
+         * we have our own copy, get rid of that one */
+        purple_account_remove_setting(account, PRPL_ACCOUNT_OPT_NEXT_BATCH);
+    }
+    g_free(filename);
+}
+
+
+static void _write_seen_events(PurpleConnection *pc)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    JsonNode *root_node;
+    JsonGenerator *generator;
+    gchar *filename, *data;
+    gsize data_len;
+
+    root_node = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(root_node, matrix_seenevents_to_json(conn));
+
+    generator = json_generator_new();
+    json_generator_set_root(generator, root_node);
+    data = json_generator_to_data(generator, &data_len);
+    g_object_unref(G_OBJECT(generator));
+    json_node_free(root_node);
+
+    filename = _get_account_filename(pc->account, SEEN_EVENTS_FILE_SUFFIX);
+    if(_write_cache_file(filename, data, data_len))
+        conn->seen_events_dirty = FALSE;
+    else
+        purple_debug_warning("matrixprpl", "unable to write seen events %s\n",
+                filename);
+    g_free(data);
+    g_free(filename);
+}
+
+
+static gboolean _next_batch_timer_cb(gpointer user_data)
+{
+    PurpleConnection *pc = user_data;
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+
+    conn->next_batch_timer = 0;
+    matrix_statecache_flush_next_batch(pc);
+    return FALSE;
+}
+
+
+void matrix_statecache_set_next_batch(PurpleConnection *pc,
+        const gchar *next_batch)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+
+    g_free(conn->next_batch_pending);
+    conn->next_batch_pending = g_strdup(next_batch);
+
+    if(conn->next_batch_timer == 0)
+        conn->next_batch_timer = purple_timeout_add_seconds(
+                NEXT_BATCH_SAVE_INTERVAL, _next_batch_timer_cb, pc);
+}
+
+
+void matrix_statecache_flush_next_batch(PurpleConnection *pc)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+
+    if(conn->next_batch_timer != 0) {
+        purple_timeout_remove(conn->next_batch_timer);
+        conn->next_batch_timer = 0;
+    }
+
+    if(conn->next_batch_pending == NULL)
+        return;
+
+    _write_next_batch(pc->account, conn->next_batch_pending);
+    g_free(conn->next_batch_pending);
+    conn->next_batch_pending = NULL;
+
+    if(conn->seen_events_dirty)
+        _write_seen_events(pc);
+}
+
+
+gchar *matrix_statecache_get_next_batch(PurpleAccount *account)
+{
+    gchar *filename, *contents = NULL;
+
+    filename = _get_account_filename(account, NEXT_BATCH_FILE_SUFFIX);
+    if(!g_file_get_contents(filename, &contents, NULL, NULL))
+        contents = NULL;
+    g_free(filename);
+
+    if(contents != NULL && contents[0] == '\0') {
+        g_free(contents);
+        contents = NULL;
+    }
+
+    /* fall back to where older versions kept it */
+    if(contents == NULL)
+        contents = g_strdup(purple_account_get_string(account,
+                PRPL_ACCOUNT_OPT_NEXT_BATCH, NULL));
+
+    return contents;
+}
+
+
+void matrix_statecache_load_seen_events(PurpleConnection *pc)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    JsonParser *parser;
+    gchar *filename;
+
+    filename = _get_account_filename(pc->account, SEEN_EVENTS_FILE_SUFFIX);
+    if(!g_file_test(filename, G_FILE_TEST_EXISTS)) {
+        g_free(filename);
+        return;
+    }
+
+    parser = json_parser_new();
+    if(json_parser_load_from_file(parser, filename, NULL)) {
+        JsonObject *rooms = matrix_json_node_get_object(
+                json_parser_get_root(parser));
+        if(rooms != NULL)
+            matrix_seenevents_load(conn, rooms);
+    } else {
+        purple_debug_warning("matrixprpl", "unable to parse seen events %s\n",
+                filename);
+    }
+
+    g_object_unref(parser);
+    g_free(filename);
+}
+
+
+/******************************************************************************
+ *
+ * The login session
+ */
+
+void matrix_statecache_save_session(MatrixConnectionData *conn)
+{
+    PurpleAccount *account = conn->pc->account;
+    JsonObject *root_obj;
+    JsonNode *root_node;
+    JsonGenerator *generator;
+    gchar *filename, *data;
+    gsize data_len;
+
+    root_obj = json_object_new();
+    json_object_set_string_member(root_obj, "homeserver", conn->homeserver);
+    if(conn->user_id != NULL)
+        json_object_set_string_member(root_obj, "user_id", conn->user_id);
+    if(conn->access_token != NULL)
+        json_object_set_string_member(root_obj, "access_token",
+                conn->access_token);
+    if(conn->device_id != NULL)
+        json_object_set_string_member(root_obj, "device_id",
+                conn->device_id);
+
+    root_node = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(root_node, root_obj);
+
+    generator = json_generator_new();
+    json_generator_set_root(generator, root_node);
+    data = json_generator_to_data(generator, &data_len);
+    g_object_unref(G_OBJECT(generator));
+    json_node_free(root_node);
+
+    filename = _get_account_filename(account, SESSION_FILE_SUFFIX);
+    if(!_write_cache_file(filename, data, data_len))
+        purple_debug_warning("matrixprpl", "unable to write session %s\n",
+                filename);
+    g_free(data);
+    g_free(filename);
+}
+
+
+gboolean matrix_statecache_load_session(MatrixConnectionData *conn)
+{
+    JsonParser *parser;
+    JsonObject *root_obj;
+    gchar *filename;
+    const gchar *user_id, *access_token;
+    gboolean result = FALSE;
+
+    filename = _get_account_filename(conn->pc->account, SESSION_FILE_SUFFIX);
+    if(!g_file_test(filename, G_FILE_TEST_EXISTS)) {
+        g_free(filename);
+        return FALSE;
+    }
+
+    parser = json_parser_new();
+    if(!json_parser_load_from_file(parser, filename, NULL)) {
+        purple_debug_warning("matrixprpl", "unable to parse session %s\n",
+                filename);
+        goto out;
+    }
+
+    /* if the homeserver has been changed, the session is no good */
+    root_obj = matrix_json_node_get_object(json_parser_get_root(parser));
+    if(g_strcmp0(matrix_json_object_get_string_member(root_obj,
+            "homeserver"), conn->homeserver) != 0)
+        goto out;
+
+    g_free(conn->device_id);
+    conn->device_id = g_strdup(matrix_json_object_get_string_member(root_obj,
+            "device_id"));
+
+    user_id = matrix_json_object_get_string_member(root_obj, "user_id");
+    access_token = matrix_json_object_get_string_member(root_obj,
+            "access_token");
+    if(user_id == NULL || access_token == NULL)
+        goto out;
+
+    g_free(conn->user_id);
+    conn->user_id = g_strdup(user_id);
+    g_free(conn->access_token);
+    conn->access_token = g_strdup(access_token);
+    result = TRUE;
+
+out:
+    g_object_unref(parser);
+    g_free(filename);
+    return result;
+}
@@ -0,0 +1,112 @@
+/**
+ * matrix-statecache.h: on-disk cache of room state
+ *
+ * Doing a full_state /sync is expensive for accounts which are in a lot of
+ * rooms. To avoid doing one every time pidgin starts, we periodically write
+ * the state of each room, along with the sync token it corresponds to, to a
+ * file in the purple user directory. At login, we rebuild the rooms from that
+ * file and continue with an incremental sync.
+ *
+ * The cache file looks just like a /sync response (with only 'state'
+ * sections), so that it can be fed straight back through matrix_sync_parse.
+ *
+ * We also keep the latest sync token in a small file of its own, rather than
+ * in the account settings, since changing those rewrites the whole of
+ * accounts.xml. Writes of the token are batched up on a timer. The ids of the
+ * events we have shown up to that point are written along with it.
+ *
+ * Finally, we keep the access token and device id from the last login, so
+ * that we don't need to log in (and create a new device) every time we
+ * connect. That file is only readable by the user, like the rest.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_STATECACHE_H_
+#define MATRIX_STATECACHE_H_
+
+#include <glib.h>
+
+struct _PurpleConnection;
+struct _PurpleAccount;
+struct _MatrixConnectionData;
+
+/**
+ * Write the state of all of the rooms on this connection to the cache.
+ *
+ * @param pc          connection whose rooms should be saved
+ * @param next_batch  the sync token which the room state corresponds to
+ */
+void matrix_statecache_save(struct _PurpleConnection *pc,
+        const gchar *next_batch);
+
+/**
+ * Rebuild the rooms on this connection from the cache.
+ *
+ * @returns the sync token which the restored state corresponds to (which
+ *     should be freed by the caller), or NULL if there was no usable cache.
+ */
+gchar *matrix_statecache_restore(struct _PurpleConnection *pc);
+
+/**
+ * Remove the cache for an account, if there is one.
+ */
+void matrix_statecache_clear(struct _PurpleAccount *account);
+
+/**
+ * Record the sync token which we have applied all the results up to. It is
+ * written to disk a little later (or when the state cache is saved, or
+ * matrix_statecache_flush_next_batch is called).
+ */
+void matrix_statecache_set_next_batch(struct _PurpleConnection *pc,
+        const gchar *next_batch);
+
+/**
+ * Write out any sync token which is waiting to be saved, in preparation for
+ * disconnecting.
+ */
+void matrix_statecache_flush_next_batch(struct _PurpleConnection *pc);
+
+/**
+ * Get the last sync token saved for an account.
+ *
+ * @returns a string which should be freed, or NULL if there is none
+ */
+gchar *matrix_statecache_get_next_batch(struct _PurpleAccount *account);
+
+/**
+ * Load the ids of the events we had shown as of the last saved sync token
+ * (see matrix-seenevents.h).
+ */
+void matrix_statecache_load_seen_events(struct _PurpleConnection *pc);
+
+/**
+ * Save the homeserver, user id, access token and device id of a connection,
+ * for use by later connections. If the access token is NULL, we just
+ * remember the device.
+ */
+void matrix_statecache_save_session(struct _MatrixConnectionData *conn);
+
+/**
+ * Load the session saved by matrix_statecache_save_session into a new
+ * connection, if it was for the same homeserver.
+ *
+ * @returns TRUE if we loaded an access token (the device id may be loaded
+ *     either way)
+ */
+gboolean matrix_statecache_load_session(struct _MatrixConnectionData *conn);
+
+#endif /* MATRIX_STATECACHE_H_ */
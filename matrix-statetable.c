@@ -64,34 +64,47 @@ MatrixRoomEvent *matrix_statetable_get_event(
 
 
 /**
- * Update the state table on a room
+ * Build a MatrixRoomEvent from a state event received from the server
+ *
+ * @returns NULL if the event is missing any required fields
  */
-void matrix_statetable_update(MatrixRoomStateEventTable *state_table,
-        JsonObject *json_event_obj,
-        MatrixStateUpdateCallback callback, gpointer user_data)
+static MatrixRoomEvent *_event_from_json(JsonObject *json_event_obj,
+        const gchar **state_key)
 {
-    const gchar *event_type, *state_key, *sender;
+    const gchar *event_type, *sender;
     JsonObject *json_content_obj;
-    MatrixRoomEvent *event, *old_event;
-    GHashTable *state_table_entry;
+    MatrixRoomEvent *event;
 
     event_type = matrix_json_object_get_string_member(
             json_event_obj, "type");
-    state_key = matrix_json_object_get_string_member(
+    *state_key = matrix_json_object_get_string_member(
             json_event_obj, "state_key");
     sender = matrix_json_object_get_string_member(
             json_event_obj, "sender");
     json_content_obj = matrix_json_object_get_object_member(
             json_event_obj, "content");
 
-    if(event_type == NULL || state_key == NULL || sender == NULL ||
+    if(event_type == NULL || *state_key == NULL || sender == NULL ||
             json_content_obj == NULL) {
-        purple_debug_warning("matrixprpl", "event missing fields\n");
-        return;
+        return NULL;
     }
 
     event = matrix_event_new(event_type, json_content_obj);
     event -> sender = g_strdup(sender);
+    return event;
+}
+
+
+/**
+ * Add an event to the state table, replacing any existing one
+ */
+static void _insert_event(MatrixRoomStateEventTable *state_table,
+        const gchar *state_key, MatrixRoomEvent *event,
+        MatrixStateUpdateCallback callback, gpointer user_data)
+{
+    const gchar *event_type = event -> event_type;
+    MatrixRoomEvent *old_event;
+    GHashTable *state_table_entry;
 
     state_table_entry = g_hash_table_lookup(state_table, event_type);
     if(state_table_entry == NULL) {
@@ -113,6 +126,72 @@ void matrix_statetable_update(MatrixRoomStateEventTable *state_table,
 }
 
 
+/**
+ * Update the state table on a room
+ */
+void matrix_statetable_update(MatrixRoomStateEventTable *state_table,
+        JsonObject *json_event_obj,
+        MatrixStateUpdateCallback callback, gpointer user_data)
+{
+    const gchar *state_key;
+    MatrixRoomEvent *event;
+
+    event = _event_from_json(json_event_obj, &state_key);
+    if(event == NULL) {
+        purple_debug_warning("matrixprpl", "event missing fields\n");
+        return;
+    }
+
+    _insert_event(state_table, state_key, event, callback, user_data);
+}
+
+
+/**
+ * Add a state event to a table without logging anything
+ */
+gboolean matrix_statetable_add(MatrixRoomStateEventTable *state_table,
+        JsonObject *json_event_obj)
+{
+    const gchar *state_key;
+    MatrixRoomEvent *event;
+
+    event = _event_from_json(json_event_obj, &state_key);
+    if(event == NULL)
+        return FALSE;
+
+    _insert_event(state_table, state_key, event, NULL, NULL);
+    return TRUE;
+}
+
+
+/**
+ * Move the events from one state table into another
+ */
+void matrix_statetable_merge(MatrixRoomStateEventTable *state_table,
+        MatrixRoomStateEventTable *src,
+        MatrixStateUpdateCallback callback, gpointer user_data)
+{
+    GHashTableIter type_iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&type_iter, src);
+    while(g_hash_table_iter_next(&type_iter, NULL, &value)) {
+        GHashTable *src_entry = value;
+        GHashTableIter key_iter;
+        gpointer key;
+
+        g_hash_table_iter_init(&key_iter, src_entry);
+        while(g_hash_table_iter_next(&key_iter, &key, &value)) {
+            /* take ownership of the event, so that src doesn't free it */
+            g_hash_table_iter_steal(&key_iter);
+            _insert_event(state_table, key, value, callback, user_data);
+            g_free(key);
+        }
+    }
+    g_hash_table_remove_all(src);
+}
+
+
 /**
  * If the room has an official name, or an alias, return it
  *
@@ -167,3 +246,38 @@ gchar *matrix_statetable_get_room_alias(MatrixRoomStateEventTable *state_table)
 
     return NULL;
 }
+
+
+/**
+ * Turn a state table back into a list of state events
+ *
+ * @returns a new JsonArray, which should be unreffed by the caller
+ */
+JsonArray *matrix_statetable_to_json(MatrixRoomStateEventTable *state_table)
+{
+    JsonArray *events = json_array_new();
+    GHashTableIter type_iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&type_iter, state_table);
+    while(g_hash_table_iter_next(&type_iter, &key, &value)) {
+        const gchar *event_type = key;
+        GHashTable *state_table_entry = value;
+        GHashTableIter key_iter;
+
+        g_hash_table_iter_init(&key_iter, state_table_entry);
+        while(g_hash_table_iter_next(&key_iter, &key, &value)) {
+            MatrixRoomEvent *event = value;
+            JsonObject *event_obj = json_object_new();
+
+            json_object_set_string_member(event_obj, "type", event_type);
+            json_object_set_string_member(event_obj, "state_key", key);
+            json_object_set_string_member(event_obj, "sender", event->sender);
+            json_object_set_object_member(event_obj, "content",
+                    json_object_ref(event->content));
+            json_array_add_object_element(events, event_obj);
+        }
+    }
+
+    return events;
+}
@@ -75,6 +75,27 @@ void matrix_statetable_update(MatrixRoomStateEventTable *state_table,
         MatrixStateUpdateCallback callback, gpointer user_data);
 
 
+/**
+ * Add a state event to a table, without reporting on the change.
+ *
+ * Unlike matrix_statetable_update, this does not log anything, so it can be
+ * used from a worker thread on a table which nothing else is using.
+ *
+ * @returns FALSE if the event was missing required fields
+ */
+gboolean matrix_statetable_add(MatrixRoomStateEventTable *state_table,
+        struct _JsonObject *json_event_obj);
+
+
+/**
+ * Move all of the events from 'src' into 'state_table', calling 'callback'
+ * for each one as matrix_statetable_update would. 'src' is left empty.
+ */
+void matrix_statetable_merge(MatrixRoomStateEventTable *state_table,
+        MatrixRoomStateEventTable *src,
+        MatrixStateUpdateCallback callback, gpointer user_data);
+
+
 /**
  * If the room has an official name, or an alias, return it
  *
@@ -82,4 +103,15 @@ void matrix_statetable_update(MatrixRoomStateEventTable *state_table,
  */
 gchar *matrix_statetable_get_room_alias(MatrixRoomStateEventTable *state_table);
 
+
+/**
+ * Turn a state table back into a list of state events, in the same format as
+ * they are received from the server (so that they can be passed back into
+ * matrix_statetable_update).
+ *
+ * @returns a new JsonArray, which should be unreffed by the caller
+ */
+struct _JsonArray *matrix_statetable_to_json(
+        MatrixRoomStateEventTable *state_table);
+
 #endif /* MATRIX_STATETABLE_H_ */
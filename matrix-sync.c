@@ -27,32 +27,160 @@
 #include "debug.h"
 
 /* libmatrix */
+#include "matrix-backfill.h"
+#include "matrix-dormantroom.h"
 #include "matrix-connection.h"
+#include "matrix-ephemeral.h"
 #include "matrix-event.h"
+#include "matrix-invite.h"
 #include "matrix-json.h"
 #include "matrix-room.h"
+#include "matrix-roomregistry.h"
+#include "matrix-seenevents.h"
+#include "matrix-statecache.h"
 #include "matrix-statetable.h"
 
 
-typedef struct _RoomEventParserData {
-    PurpleConversation *conv;
-    gboolean state_events;
-} RoomEventParserData;
+static PurpleChat *_ensure_blist_entry(PurpleConnection *pc,
+        const gchar *room_id)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    PurpleAccount *acct = pc->account;
+    GHashTable *comp;
+    PurpleGroup *group;
+    PurpleChat *chat = matrix_roomregistry_get_chat(conn, room_id);
+
+    if (chat)
+        return chat;
+
+    group = purple_find_group("Matrix");
+    if (!group) {
+        group = purple_group_new("Matrix");
+        purple_blist_add_group(group, NULL);
+    }
+
+    comp = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+    g_hash_table_insert(comp, PRPL_CHAT_INFO_ROOM_ID, g_strdup(room_id));
+
+    /* we set the alias to the room id initially, then change it to
+     * something more user-friendly later.
+     */
+    chat = purple_chat_new(acct, room_id, comp);
+
+    /* encourage matrix chats to be persistent by default. This is clearly a
+     * hack :/ */
+    purple_blist_node_set_bool(&chat->node, "gtk-persistent", TRUE);
+
+    purple_blist_add_chat(chat, group, NULL);
+    purple_debug_info("matrixprpl", "added buddy list entry for room %s\n",
+            room_id);
+
+    return chat;
+}
+
+
+/******************************************************************************
+ *
+ * Processing of individual rooms.
+ *
+ * The state of each room is decoded into a state table before we get here
+ * (see _preprocess_room), and is then applied in one go. Timeline events are
+ * processed one at a time, so that we can stop part-way through a room when we
+ * run out of time (see below) and pick up where we left off later.
+ */
+
+/* the stages in the processing of a joined room */
+#define MATRIX_SYNC_ROOM_START 0
+#define MATRIX_SYNC_ROOM_STATE 1
+#define MATRIX_SYNC_ROOM_TIMELINE 2
+
+/* the section of the sync response a room came from */
+#define MATRIX_SYNC_SECTION_JOIN 0
+#define MATRIX_SYNC_SECTION_INVITE 1
+#define MATRIX_SYNC_SECTION_LEAVE 2
+
+typedef struct _MatrixSyncRoom {
+    const gchar *room_id;   /* points into the sync response */
+    JsonObject *room_data;  /* points into the sync response */
+    int section;            /* MATRIX_SYNC_SECTION_* */
+
+    /* priority of this room; see _compute_room_priority */
+    int tier;
+    gint64 last_ts;         /* timestamp of the last event in the timeline */
+
+    /* the events from the 'state' section, collapsed into a state table by
+     * _preprocess_room; NULL for invites. */
+    MatrixRoomStateEventTable *state_events;
+    guint invalid_state_events;
+
+    /* typing notifications and account data, collapsed by
+     * _preprocess_room; NULL if there were none. */
+    MatrixRoomEphemeral *ephemeral;
+
+    /* how far we have got with this room */
+    int stage;
+    guint event_idx;
+    gboolean initial_sync;
+
+    /* TRUE if we have handled state events from the timeline without yet
+     * calling matrix_room_complete_state_update */
+    gboolean state_update_pending;
+} MatrixSyncRoom;
+
+
+static void _free_sync_room(MatrixSyncRoom *room)
+{
+    if(room->state_events != NULL)
+        matrix_statetable_destroy(room->state_events);
+    if(room->ephemeral != NULL)
+        matrix_ephemeral_free_room(room->ephemeral);
+    g_free(room);
+}
+
+
+/**
+ * Get the list of events from the 'state' or 'timeline' section of a room
+ */
+static JsonArray *_get_room_events(JsonObject *room_data, const gchar *section)
+{
+    JsonObject *section_object;
+
+    section_object = matrix_json_object_get_object_member(room_data, section);
+    return matrix_json_object_get_array_member(section_object, "events");
+}
+
+
+/**
+ * Tell the room about any state changes we have made since the last call.
+ *
+ * matrix_room_complete_state_update has to look at all of the changed members,
+ * so rather than calling it after each state event in the timeline, we call
+ * it once for each run of state events: that is, before the next message, or
+ * before we stop work on the room. We also have to call it if a member
+ * changes twice in one run (eg, leaves and rejoins), since the member table
+ * can only track one change for each member.
+ */
+static void _flush_state_update(PurpleConversation *conv,
+        MatrixSyncRoom *room)
+{
+    if(!room->state_update_pending)
+        return;
+
+    room->state_update_pending = FALSE;
+    matrix_room_complete_state_update(conv, TRUE);
+}
 
 
 /**
- * handle an event for a room
+ * handle an event from the 'timeline' section of the sync for a room
  *
- * @param state        the complete state array (unused)
- * @param state_id     position within the array (unused)
- * @param state_entry  the event id to be handled
- * @param user_data    a RoomEventParserData
+ * @param conv          the room
+ * @param room          our progress through the room
+ * @param event         the event to be handled
  */
-static void _parse_room_event(JsonArray *event_array, guint event_idx,
-        JsonNode *event, gpointer user_data)
+static void _parse_room_event(PurpleConversation *conv, MatrixSyncRoom *room,
+        JsonNode *event)
 {
-    RoomEventParserData *data = user_data;
-    PurpleConversation *conv = data->conv;
     JsonObject *json_event_obj;
 
     json_event_obj = matrix_json_node_get_object(event);
@@ -61,235 +189,809 @@ static void _parse_room_event(JsonArray *event_array, guint event_idx,
         return;
     }
 
-    if(data->state_events) {
+    if(json_object_has_member(json_event_obj, "state_key")) {
+        if(room->state_update_pending &&
+                g_strcmp0(matrix_json_object_get_string_member(
+                        json_event_obj, "type"), "m.room.member") == 0 &&
+                matrix_room_member_change_pending(conv,
+                        matrix_json_object_get_string_member(json_event_obj,
+                                "state_key")))
+            _flush_state_update(conv, room);
         matrix_room_handle_state_event(conv, json_event_obj);
+        room->state_update_pending = TRUE;
+    } else if(matrix_backfill_pending(conv)) {
+        /* we're still fetching earlier messages; this one will have to
+         * wait */
+        matrix_backfill_defer_event(conv, json_event_obj);
     } else {
-        if(json_object_has_member(json_event_obj, "state_key")) {
-            matrix_room_handle_state_event(conv, json_event_obj);
-            matrix_room_complete_state_update(conv, TRUE);
-        } else {
-            matrix_room_handle_timeline_event(conv, json_event_obj);
+        /* make sure the member list is up to date before we display the
+         * message */
+        _flush_state_update(conv, room);
+        matrix_room_handle_timeline_event(conv, json_event_obj);
+    }
+}
+
+
+/**
+ * Handle timeline events from a list, starting at room->event_idx, until we
+ * get to the end of the list or the deadline passes.
+ *
+ * @returns TRUE if we got to the end of the list
+ */
+static gboolean _parse_room_events_until(PurpleConversation *conv,
+        MatrixSyncRoom *room, JsonArray *events, gint64 deadline)
+{
+    guint len;
+    gboolean done = TRUE;
+
+    len = events == NULL ? 0 : json_array_get_length(events);
+    while(room->event_idx < len) {
+        if(g_get_monotonic_time() >= deadline) {
+            done = FALSE;
+            break;
         }
+        _parse_room_event(conv, room, json_array_get_element(events,
+                room->event_idx++));
     }
+
+    /* don't leave the room in an inconsistent state while we go off and do
+     * something else */
+    _flush_state_update(conv, room);
+    return done;
 }
 
+
 /**
- * parse the list of events in a sync response
+ * If the timeline for a room was cut short, start filling in the gap
+ *
+ * @param since   the token the sync started from
  */
-static void _parse_room_event_array(PurpleConversation *conv, JsonArray *events,
-        gboolean state_events)
+static void _check_for_gap(PurpleConversation *conv, MatrixSyncRoom *room,
+        const gchar *since)
 {
-    RoomEventParserData data = {conv, state_events};
-    json_array_foreach_element(events, _parse_room_event, &data);
+    JsonObject *timeline;
+    const gchar *prev_batch;
+
+    /* if this is the first we have heard of the room, there's no gap to
+     * fill, just history. */
+    if(since == NULL || room->initial_sync)
+        return;
+
+    timeline = matrix_json_object_get_object_member(room->room_data,
+            "timeline");
+    if(!matrix_json_object_get_boolean_member(timeline, "limited"))
+        return;
+
+    prev_batch = matrix_json_object_get_string_member(timeline,
+            "prev_batch");
+    if(prev_batch == NULL)
+        return;
+
+    matrix_backfill_start(conv, prev_batch, since);
 }
 
 
-static PurpleChat *_ensure_blist_entry(PurpleAccount *acct,
-        const gchar *room_id)
+/**
+ * Process as much as we can of a joined room before the deadline passes.
+ *
+ * @param since   the token the sync started from
+ *
+ * @returns TRUE if we have finished with this room
+ */
+static gboolean _sync_room_until(PurpleConnection *pc, MatrixSyncRoom *room,
+        const gchar *since, gint64 deadline)
 {
-    GHashTable *comp;
-    PurpleGroup *group;
-    PurpleChat *chat = purple_blist_find_chat(acct, room_id);
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    PurpleConversation *conv;
+    gboolean announce_arrivals;
 
-    if (chat)
-        return chat;
+    if(room->stage == MATRIX_SYNC_ROOM_START) {
+        purple_debug_info("matrixprpl", "Syncing room %s\n", room->room_id);
 
-    group = purple_find_group("Matrix");
-    if (!group) {
-        group = purple_group_new("Matrix");
-        purple_blist_add_group(group, NULL);
+        /* if we were invited to the room, we've now joined it */
+        matrix_invite_forget(conn, room->room_id);
+
+        /* ensure we have an entry in the buddy list for this room. */
+        _ensure_blist_entry(pc, room->room_id);
+
+        conv = matrix_roomregistry_get_conversation(conn, room->room_id);
+
+        if(conv == NULL) {
+            /* unless there is something here for the user to see, we don't
+             * bother creating a conversation yet */
+            if(!matrix_dormantroom_should_promote(conn, room->room_id,
+                    room->room_data)) {
+                matrix_dormantroom_update(pc, room->room_id,
+                        room->state_events, room->room_data);
+                return TRUE;
+            }
+
+            conv = matrix_dormantroom_promote(pc, room->room_id);
+            room->initial_sync = TRUE;
+        }
+
+        room->stage = MATRIX_SYNC_ROOM_STATE;
+        room->event_idx = 0;
+    } else {
+        conv = matrix_roomregistry_get_conversation(conn, room->room_id);
+
+        if(conv == NULL) {
+            /* the conversation was closed while we were part-way through */
+            purple_debug_info("matrixprpl", "room %s went away during sync\n",
+                    room->room_id);
+            return TRUE;
+        }
     }
 
-    comp = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
-    g_hash_table_insert(comp, PRPL_CHAT_INFO_ROOM_ID, g_strdup(room_id));
+    if(room->stage == MATRIX_SYNC_ROOM_STATE) {
+        /* apply the room state, which was decoded by _preprocess_room */
+        if(room->invalid_state_events > 0) {
+            purple_debug_warning("matrixprpl",
+                    "%u state events in %s missing fields\n",
+                    room->invalid_state_events, room->room_id);
+        }
+        matrix_room_handle_state_table(conv, room->state_events);
+
+        /* if members are being lazy-loaded, the state section includes
+         * members we simply hadn't heard of before; real arrivals will be in
+         * the timeline.
+         */
+        announce_arrivals = !room->initial_sync && !purple_account_get_bool(
+                pc->account, PRPL_ACCOUNT_OPT_LAZY_LOAD_MEMBERS, TRUE);
+
+        matrix_room_handle_summary(conv, matrix_json_object_get_object_member(
+                room->room_data, "summary"));
+        matrix_room_complete_state_update(conv, announce_arrivals);
+
+        /* there's no point filling in the history of a room we have
+         * left */
+        if(room->section != MATRIX_SYNC_SECTION_LEAVE)
+            _check_for_gap(conv, room, since);
+
+        room->stage = MATRIX_SYNC_ROOM_TIMELINE;
+        room->event_idx = 0;
+    }
 
-    /* we set the alias to the room id initially, then change it to
-     * something more user-friendly later.
+    /* parse the timeline events */
+    if(!_parse_room_events_until(conv, room,
+            _get_room_events(room->room_data, "timeline"), deadline))
+        return FALSE;
+
+    /* the ephemeral events go last, so that the typing notifications reflect
+     * the state after the timeline */
+    if(room->ephemeral != NULL) {
+        matrix_room_handle_ephemeral(conv, room->ephemeral);
+        room->ephemeral = NULL;
+    }
+    return TRUE;
+}
+
+
+/**
+ * Process as much as we can of a room we have left (or been kicked or banned
+ * from) before the deadline passes. If we have a conversation for the room,
+ * the last of its state and timeline are applied as for a joined room; after
+ * that, we let go of everything we hold for the room.
+ *
+ * @param since   the token the sync started from
+ *
+ * @returns TRUE if we have finished with this room
+ */
+static gboolean _leave_room_until(PurpleConnection *pc, MatrixSyncRoom *room,
+        const gchar *since, gint64 deadline)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    PurpleConversation *conv;
+
+    conv = matrix_roomregistry_get_conversation(conn, room->room_id);
+    if(conv != NULL) {
+        /* we don't want to create anything for the room, so skip straight
+         * past the START stage */
+        if(room->stage == MATRIX_SYNC_ROOM_START) {
+            purple_debug_info("matrixprpl", "Left room %s\n", room->room_id);
+            room->stage = MATRIX_SYNC_ROOM_STATE;
+            room->event_idx = 0;
+        }
+        if(!_sync_room_until(pc, room, since, deadline))
+            return FALSE;
+
+        matrix_room_handle_leave(conv);
+    }
+
+    matrix_dormantroom_forget(conn, room->room_id);
+    matrix_invite_forget(conn, room->room_id);
+    matrix_seenevents_forget_room(conn, room->room_id);
+    return TRUE;
+}
+
+
+/******************************************************************************
+ *
+ * Scheduling of the work in a sync response.
+ *
+ * A sync response (particularly an initial sync) can contain a lot of rooms,
+ * and it can take a while to apply them all. We therefore sort the rooms so
+ * that the ones the user is most likely to care about come first, and then
+ * apply them in time slices from a timer callback, so that the UI stays
+ * responsive while a big sync is applied.
+ *
+ * Each sync response becomes a MatrixSyncJob, which is queued on the
+ * connection. Jobs are completed strictly in the order they were received, so
+ * the updates to a given room are never applied out of order.
+ *
+ * The MatrixSyncJob is built by matrix_sync_preprocess, which runs on the
+ * API worker thread (see matrix-api.c), so must not touch anything in
+ * libpurple. matrix_sync_apply then finishes off the job on the main thread.
+ */
+
+/* the longest we spend applying sync results before returning to the main
+ * loop, in microseconds */
+#define MATRIX_SYNC_SLICE_USECS 5000
+
+/* priority tiers for rooms in a sync response, lowest first */
+#define MATRIX_SYNC_TIER_NORMAL 0
+#define MATRIX_SYNC_TIER_NOTIFICATIONS 1
+#define MATRIX_SYNC_TIER_HIGHLIGHTS 2
+#define MATRIX_SYNC_TIER_FOCUSED 3
+
+/* if there are at least this many joined rooms in a sync response, we
+ * preprocess them in parallel, using this many threads */
+#define MATRIX_SYNC_PREPROCESS_MIN_ROOMS 8
+#define MATRIX_SYNC_PREPROCESS_THREADS 4
+
+/* the threads for preprocessing rooms. The pool belongs to the plugin: it
+ * is created by matrix_sync_init when the plugin is loaded, and freed by
+ * matrix_sync_shutdown when it is unloaded. It is used from the API worker
+ * thread (see matrix-api.c), so the pointer is protected by
+ * _preprocess_pool_lock. NULL if the threads could not be started (or have
+ * been stopped), in which case we do without. */
+G_LOCK_DEFINE_STATIC(_preprocess_pool_lock);
+static GThreadPool *_preprocess_pool = NULL;
+
+/* one room for _preprocess_pool */
+typedef struct _MatrixSyncPreprocessItem {
+    MatrixSyncRoom *room;
+
+    /* the item is pushed onto this queue once the room is done */
+    GAsyncQueue *done;
+} MatrixSyncPreprocessItem;
+
+struct _MatrixSyncJob {
+    /* the token the sync started from (NULL for an initial sync), and the
+     * next_batch token from the response */
+    gchar *since;
+    gchar *next_batch;
+
+    /* FALSE if next_batch should not be saved for later connections once the
+     * job has been applied */
+    gboolean store_next_batch;
+
+    /* the 'rooms' object from the sync response. We hold a reference on it,
+     * which keeps the room ids and data in the MatrixSyncRooms valid.
      */
-    chat = purple_chat_new(acct, room_id, comp);
+    JsonObject *rooms_obj;
 
-    /* encourage matrix chats to be persistent by default. This is clearly a
-     * hack :/ */
-    purple_blist_node_set_bool(&chat->node, "gtk-persistent", TRUE);
+    /* the MatrixSyncRooms which are still to be applied, in the order they
+     * should be applied */
+    GList *rooms;
 
-    purple_blist_add_chat(chat, group, NULL);
-    purple_debug_info("matrixprpl", "added buddy list entry for room %s\n",
-            room_id);
+    /* global account data; NULL if there was none. This is applied as soon
+     * as the job is queued, since the push rules decide how the rooms in the
+     * job are handled (see matrix-roomtier.c). */
+    MatrixGlobalEphemeral *ephemeral;
+};
 
-    return chat;
+
+/**
+ * Work out the priority of a joined room, based on the sync response alone.
+ *
+ * This is called on the worker thread; we check if the room has the focus
+ * later on, in _check_room_focus.
+ */
+static void _compute_room_priority(MatrixSyncRoom *room)
+{
+    JsonObject *unread_object;
+    JsonArray *timeline_array;
+    JsonObject *last_event;
+    guint nevents;
+
+    timeline_array = _get_room_events(room->room_data, "timeline");
+    if(timeline_array != NULL &&
+            (nevents = json_array_get_length(timeline_array)) > 0) {
+        last_event = matrix_json_node_get_object(
+                json_array_get_element(timeline_array, nevents-1));
+        room->last_ts = matrix_json_object_get_int_member(last_event,
+                "origin_server_ts");
+    }
+
+    unread_object = matrix_json_object_get_object_member(room->room_data,
+            "unread_notifications");
+    if(matrix_json_object_get_int_member(unread_object,
+            "highlight_count") > 0)
+        room->tier = MATRIX_SYNC_TIER_HIGHLIGHTS;
+    else if(matrix_json_object_get_int_member(unread_object,
+            "notification_count") > 0)
+        room->tier = MATRIX_SYNC_TIER_NOTIFICATIONS;
+    else
+        room->tier = MATRIX_SYNC_TIER_NORMAL;
 }
 
 
 /**
- * handle a joined room within the sync response
+ * Promote the room which the user is looking at to the top tier.
+ *
+ * @returns TRUE if the room was promoted
  */
-static void matrix_sync_room(const gchar *room_id,
-        JsonObject *room_data, PurpleConnection *pc)
+static gboolean _check_room_focus(PurpleConnection *pc, MatrixSyncRoom *room)
 {
-    JsonObject *state_object, *timeline_object;
-    JsonArray *state_array, *timeline_array;
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
     PurpleConversation *conv;
-    gboolean initial_sync = FALSE;
 
-    /* ensure we have an entry in the buddy list for this room. */
-    _ensure_blist_entry(pc->account, room_id);
+    conv = matrix_roomregistry_get_conversation(conn, room->room_id);
+    if(conv == NULL || !purple_conversation_has_focus(conv))
+        return FALSE;
+
+    room->tier = MATRIX_SYNC_TIER_FOCUSED;
+    return TRUE;
+}
 
-    conv = purple_find_conversation_with_account(
-            PURPLE_CONV_TYPE_CHAT, room_id, pc->account);
 
-    if(conv == NULL) {
-        conv = matrix_room_create_conversation(pc, room_id);
-        initial_sync = TRUE;
+static gint _compare_room_priority(gconstpointer a, gconstpointer b)
+{
+    const MatrixSyncRoom *room_a = a, *room_b = b;
+
+    if(room_a->tier != room_b->tier)
+        return room_b->tier - room_a->tier;
+    if(room_a->last_ts != room_b->last_ts)
+        return room_b->last_ts > room_a->last_ts ? 1 : -1;
+    return 0;
+}
+
+
+/**
+ * Do the work on a joined room which doesn't need libpurple: decode the state
+ * events into a state table (which also collapses any repeated state keys),
+ * collapse the ephemeral events, and work out the priority of the room.
+ */
+static void _preprocess_room(MatrixSyncRoom *room)
+{
+    JsonArray *events;
+    guint i, len;
+
+    room->state_events = matrix_statetable_new();
+    events = _get_room_events(room->room_data, "state");
+    len = events == NULL ? 0 : json_array_get_length(events);
+    for(i = 0; i < len; i++) {
+        JsonObject *event = matrix_json_node_get_object(
+                json_array_get_element(events, i));
+        if(event == NULL || !matrix_statetable_add(room->state_events, event))
+            room->invalid_state_events++;
     }
 
-    /* parse the room state */
-    state_object = matrix_json_object_get_object_member(room_data, "state");
-    state_array = matrix_json_object_get_array_member(state_object, "events");
-    if(state_array != NULL)
-        _parse_room_event_array(conv, state_array, TRUE);
+    room->ephemeral = matrix_ephemeral_parse_room(room->room_data);
+    _compute_room_priority(room);
+}
 
-    matrix_room_complete_state_update(conv, !initial_sync);
 
-    /* parse the timeline events */
-    timeline_object = matrix_json_object_get_object_member(
-                room_data, "timeline");
-    timeline_array = matrix_json_object_get_array_member(
-                timeline_object, "events");
-    if(timeline_array != NULL)
-        _parse_room_event_array(conv, timeline_array, FALSE);
+static void _preprocess_room_cb(gpointer item_data, gpointer user_data)
+{
+    MatrixSyncPreprocessItem *item = item_data;
+
+    _preprocess_room(item->room);
+    g_async_queue_push(item->done, item);
 }
 
 
-static void _parse_invite_state_event(JsonArray *event_array, guint event_idx,
-        JsonNode *event, gpointer user_data)
+/**
+ * Run _preprocess_room on each of a list of joined rooms. The rooms are
+ * independent of each other, so if there are enough of them we spread them
+ * over the threads in _preprocess_pool.
+ */
+static void _preprocess_rooms(GList *rooms)
 {
-    MatrixRoomStateEventTable *state_table = user_data;
-    JsonObject *event_obj;
+    MatrixSyncPreprocessItem *items;
+    GAsyncQueue *done;
+    GList *elem;
+    guint i, len;
+
+    len = g_list_length(rooms);
+    if(len < MATRIX_SYNC_PREPROCESS_MIN_ROOMS) {
+        for(elem = rooms; elem != NULL; elem = elem->next)
+            _preprocess_room(elem->data);
+        return;
+    }
 
-    event_obj = matrix_json_node_get_object(event);
-    if(event_obj == NULL) {
-        purple_debug_warning("prplmatrix", "non-object event");
+    /* the lock is held until all of the rooms are queued, so the pool can't
+     * be freed in the meantime. Once they are queued, freeing the pool waits
+     * for them to be done. */
+    G_LOCK(_preprocess_pool_lock);
+    if(_preprocess_pool == NULL) {
+        G_UNLOCK(_preprocess_pool_lock);
+        for(elem = rooms; elem != NULL; elem = elem->next)
+            _preprocess_room(elem->data);
         return;
     }
 
-    matrix_statetable_update(state_table, event_obj, NULL, NULL);
+    done = g_async_queue_new();
+    items = g_new(MatrixSyncPreprocessItem, len);
+    for(elem = rooms, i = 0; elem != NULL; elem = elem->next, i++) {
+        items[i].room = elem->data;
+        items[i].done = done;
+        g_thread_pool_push(_preprocess_pool, &items[i], NULL);
+    }
+    G_UNLOCK(_preprocess_pool_lock);
+
+    /* wait for the workers to finish */
+    for(i = 0; i < len; i++)
+        g_async_queue_pop(done);
+
+    g_free(items);
+    g_async_queue_unref(done);
 }
 
 
 /**
- * tell purple about our incoming invitation
+ * Build the list of rooms in a section of the sync response
+ *
+ * @returns a list of MatrixSyncRoom *s, in no particular order.
  */
-static void _raise_invite_request(PurpleConnection *pc,
-        const gchar *room_id, const gchar *sender, const gchar *room_name)
+static GList *_get_rooms(JsonObject *rooms_obj, int section)
 {
-    GHashTable *components;
+    GList *room_ids, *elem, *rooms = NULL;
+
+    room_ids = json_object_get_members(rooms_obj);
+    for(elem = room_ids; elem; elem = elem->next) {
+        MatrixSyncRoom *room = g_new0(MatrixSyncRoom, 1);
+        room->room_id = elem->data;
+        room->room_data = matrix_json_object_get_object_member(
+                rooms_obj, room->room_id);
+        room->section = section;
+        rooms = g_list_prepend(rooms, room);
+    }
+    g_list_free(room_ids);
+    return rooms;
+}
+
+
+/**
+ * Apply rooms from the front of the job until we run out of rooms or time
+ *
+ * @returns TRUE if the job is complete
+ */
+static gboolean _run_sync_job_until(PurpleConnection *pc, MatrixSyncJob *job,
+        gint64 deadline)
+{
+    while(job->rooms != NULL) {
+        MatrixSyncRoom *room = job->rooms->data;
+
+        if(room->room_data == NULL) {
+            /* nothing to do */
+        } else if(room->section == MATRIX_SYNC_SECTION_INVITE) {
+            purple_debug_info("matrixprpl", "Invite to room %s\n",
+                    room->room_id);
+            matrix_invite_handle(purple_connection_get_protocol_data(pc),
+                    room->room_id, room->room_data);
+        } else if(room->section == MATRIX_SYNC_SECTION_LEAVE) {
+            if(!_leave_room_until(pc, room, job->since, deadline))
+                return FALSE;
+        } else if(!_sync_room_until(pc, room, job->since, deadline)) {
+            return FALSE;
+        }
+
+        _free_sync_room(room);
+        job->rooms = g_list_delete_link(job->rooms, job->rooms);
+
+        if(g_get_monotonic_time() >= deadline)
+            break;
+    }
+    return job->rooms == NULL;
+}
+
+
+void matrix_sync_job_free(MatrixSyncJob *job)
+{
+    g_list_free_full(job->rooms, (GDestroyNotify) _free_sync_room);
+    if(job->rooms_obj != NULL)
+        json_object_unref(job->rooms_obj);
+    if(job->ephemeral != NULL)
+        matrix_ephemeral_free_global(job->ephemeral);
+    g_free(job->since);
+    g_free(job->next_batch);
+    g_free(job);
+}
+
+
+const gchar *matrix_sync_job_get_next_batch(MatrixSyncJob *job)
+{
+    return job->next_batch;
+}
+
+
+void matrix_sync_job_set_since(MatrixSyncJob *job, const gchar *since)
+{
+    g_free(job->since);
+    job->since = g_strdup(since);
+}
+
+
+void matrix_sync_job_set_store_next_batch(MatrixSyncJob *job, gboolean store)
+{
+    job->store_next_batch = store;
+}
+
+
+guint matrix_sync_drop_seen_events(JsonObject *timeline,
+        GHashTable *event_ids)
+{
+    JsonArray *events;
+    guint i, len, dropped = 0;
+    gint last_seen = -1;
+
+    events = matrix_json_object_get_array_member(timeline, "events");
+    len = events == NULL ? 0 : json_array_get_length(events);
+
+    /* find the newest event we have already shown */
+    for(i = 0; i < len; i++) {
+        const gchar *event_id = matrix_json_object_get_string_member(
+                matrix_json_node_get_object(json_array_get_element(events, i)),
+                "event_id");
+        if(event_id != NULL &&
+                g_hash_table_lookup(event_ids, event_id) != NULL)
+            last_seen = i;
+    }
+    if(last_seen < 0)
+        return 0;
+
+    /* everything up to there is either repeated, or older than what we have
+     * shown - so showing it now would put it out of order. Re-applying a state
+     * event is harmless, though, so only drop the messages. */
+    i = last_seen + 1;
+    while(i-- > 0) {
+        JsonObject *event_obj = matrix_json_node_get_object(
+                json_array_get_element(events, i));
+
+        if(event_obj != NULL && json_object_has_member(event_obj, "state_key"))
+            continue;
+        json_array_remove_element(events, i);
+        dropped++;
+    }
+
+    /* likewise, there's no point backfilling the gap before the timeline */
+    if(json_object_has_member(timeline, "limited"))
+        json_object_set_boolean_member(timeline, "limited", FALSE);
+
+    return dropped;
+}
 
-    /* we could share this code with _ensure_blist_entry
-     *
-     * libpurple destroys the hashtable when the invite is dealt with.
-     */
-    components = g_hash_table_new_full(g_str_hash, g_str_equal,
-            NULL, g_free);
-    g_hash_table_insert(components, PRPL_CHAT_INFO_ROOM_ID, g_strdup(room_id));
 
-    serv_got_chat_invite(pc, room_name, sender, NULL, components);
+void matrix_sync_job_drop_events(MatrixSyncJob *job, GHashTable *event_ids)
+{
+    GList *elem;
+    guint dropped = 0;
+
+    for(elem = job->rooms; elem != NULL; elem = elem->next) {
+        MatrixSyncRoom *room = elem->data;
+        JsonObject *timeline;
+
+        if(room->section == MATRIX_SYNC_SECTION_INVITE)
+            continue;
+
+        timeline = matrix_json_object_get_object_member(room->room_data,
+                "timeline");
+        if(timeline != NULL)
+            dropped += matrix_sync_drop_seen_events(timeline, event_ids);
+    }
+
+    if(dropped > 0)
+        purple_debug_info("matrixprpl", "dropped %u events we already had "
+                "(or which predate them)\n", dropped);
 }
 
 
 /**
- * handle an invitation within the sync response
+ * Do one time-slice's worth of work on the queued jobs
+ *
+ * @returns TRUE if there is more work to do
  */
-static void _handle_invite(const gchar *room_id,
-        JsonObject *invite_data, PurpleConnection *pc)
+static gboolean _run_sync_jobs(PurpleConnection *pc)
 {
-    JsonObject *invite_state_object;
-    JsonArray *events;
-    MatrixRoomStateEventTable *state_table;
-    MatrixConnectionData *conn;
-    MatrixRoomEvent *event;
-    const gchar *sender;
-    gchar *room_name = NULL;
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    gint64 deadline = g_get_monotonic_time() + MATRIX_SYNC_SLICE_USECS;
 
-    conn = purple_connection_get_protocol_data(pc);
+    while(!g_queue_is_empty(&conn->sync_jobs)) {
+        MatrixSyncJob *job = g_queue_peek_head(&conn->sync_jobs);
 
-    invite_state_object = matrix_json_object_get_object_member(invite_data,
-            "invite_state");
-    events = matrix_json_object_get_array_member(invite_state_object,
-            "events");
+        if(!_run_sync_job_until(pc, job, deadline))
+            return TRUE;
 
-    if(events == NULL) {
-        purple_debug_warning("prplmatrix", "no events array in invite event\n");
-        return;
+        g_queue_pop_head(&conn->sync_jobs);
+
+        /* now that the results have been applied, we can safely resume from
+         * this point on the next connection. */
+        if(job->next_batch != NULL && job->store_next_batch)
+            matrix_statecache_set_next_batch(pc, job->next_batch);
+        matrix_sync_job_free(job);
+
+        if(g_get_monotonic_time() >= deadline)
+            break;
     }
+    return !g_queue_is_empty(&conn->sync_jobs);
+}
 
-    state_table = matrix_statetable_new();
-    json_array_foreach_element(events, _parse_invite_state_event,
-                state_table);
 
-    /* look for our own m.room.member event, so we can see who invited us */
-    event = matrix_statetable_get_event(state_table, "m.room.member",
-            conn -> user_id);
-    if(event != NULL)
-        sender = event->sender;
-    else
-        sender = "?";
+static gboolean _sync_timer_cb(gpointer user_data)
+{
+    PurpleConnection *pc = user_data;
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+
+    if(_run_sync_jobs(pc))
+        return TRUE;
+
+    purple_debug_info("matrixprpl", "finished applying sync results\n");
+    conn->sync_timer = 0;
+    return FALSE;
+}
+
 
+void matrix_sync_cancel(PurpleConnection *pc)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    MatrixSyncJob *job;
 
-    /* try and figure out the room name */
-    room_name = matrix_statetable_get_room_alias(state_table);
-    if(room_name == NULL) {
-        /* just name the room after the sender of the invite, for now */
-        room_name = g_strdup(sender);
+    if(conn->sync_timer != 0) {
+        purple_timeout_remove(conn->sync_timer);
+        conn->sync_timer = 0;
     }
 
-    _raise_invite_request(pc, room_id, sender, room_name);
+    while((job = g_queue_pop_head(&conn->sync_jobs)) != NULL) {
+        purple_debug_info("matrixprpl", "discarding unapplied sync results\n");
+        matrix_sync_job_free(job);
+    }
+}
 
-    matrix_statetable_destroy(state_table);
-    g_free(room_name);
+
+gboolean matrix_sync_pending(PurpleConnection *pc)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    return !g_queue_is_empty(&conn->sync_jobs);
 }
 
 
-/**
- * handle the results of the sync request
- */
-void matrix_sync_parse(PurpleConnection *pc, JsonNode *body,
-        const gchar **next_batch)
+void matrix_sync_init(void)
+{
+    GError *err = NULL;
+
+    G_LOCK(_preprocess_pool_lock);
+    if(_preprocess_pool == NULL) {
+        _preprocess_pool = g_thread_pool_new(_preprocess_room_cb, NULL,
+                MATRIX_SYNC_PREPROCESS_THREADS, FALSE, &err);
+        if(_preprocess_pool == NULL) {
+            purple_debug_warning("matrixprpl",
+                    "unable to start preprocessing threads: %s\n",
+                    err->message);
+            g_error_free(err);
+        }
+    }
+    G_UNLOCK(_preprocess_pool_lock);
+}
+
+
+void matrix_sync_shutdown(void)
+{
+    GThreadPool *pool;
+
+    /* later syncs (if any) will do without */
+    G_LOCK(_preprocess_pool_lock);
+    pool = _preprocess_pool;
+    _preprocess_pool = NULL;
+    G_UNLOCK(_preprocess_pool_lock);
+
+    /* this waits for any rooms which were queued before we took the pool
+     * away */
+    if(pool != NULL)
+        g_thread_pool_free(pool, FALSE, TRUE);
+}
+
+
+gpointer matrix_sync_preprocess(JsonNode *body)
 {
     JsonObject *rootObj;
     JsonObject *rooms;
-    JsonObject *joined_rooms, *invited_rooms;
-    GList *room_ids, *elem;
+    JsonObject *joined_rooms, *invited_rooms, *left_rooms;
+    MatrixSyncJob *job;
+
+    job = g_new0(MatrixSyncJob, 1);
+    job->store_next_batch = TRUE;
 
     rootObj = matrix_json_node_get_object(body);
-    *next_batch = matrix_json_object_get_string_member(rootObj, "next_batch");
+    job->next_batch = g_strdup(matrix_json_object_get_string_member(rootObj,
+            "next_batch"));
+    job->ephemeral = matrix_ephemeral_parse_global(rootObj);
     rooms = matrix_json_object_get_object_member(rootObj, "rooms");
+    if(rooms == NULL)
+        return job;
 
+    /* the joined rooms are sorted here, so that the main thread only has to
+     * move the focused room (if any) to the front */
     joined_rooms = matrix_json_object_get_object_member(rooms, "join");
     if(joined_rooms != NULL) {
-        room_ids = json_object_get_members(joined_rooms);
-        for(elem = room_ids; elem; elem = elem->next) {
-            const gchar *room_id = elem->data;
-            JsonObject *room_data = matrix_json_object_get_object_member(
-                    joined_rooms, room_id);
-            purple_debug_info("matrixprpl", "Syncing room %s\n", room_id);
-            matrix_sync_room(room_id, room_data, pc);
-        }
-        g_list_free(room_ids);
+        GList *joined = _get_rooms(joined_rooms, MATRIX_SYNC_SECTION_JOIN);
+        _preprocess_rooms(joined);
+        job->rooms = g_list_sort(joined, _compare_room_priority);
     }
 
-
     invited_rooms = matrix_json_object_get_object_member(rooms, "invite");
     if(invited_rooms != NULL) {
-        room_ids = json_object_get_members(invited_rooms);
-        for(elem = room_ids; elem; elem = elem->next) {
-            const gchar *room_id = elem->data;
-            JsonObject *room_data = matrix_json_object_get_object_member(
-                    invited_rooms, room_id);
-            purple_debug_info("matrixprpl", "Invite to room %s\n", room_id);
-            _handle_invite(room_id, room_data, pc);
+        job->rooms = g_list_concat(job->rooms,
+                _get_rooms(invited_rooms, MATRIX_SYNC_SECTION_INVITE));
+    }
+
+    /* rooms we have left go last, so that any final events in them are
+     * shown before we let go of them */
+    left_rooms = matrix_json_object_get_object_member(rooms, "leave");
+    if(left_rooms != NULL) {
+        GList *left = _get_rooms(left_rooms, MATRIX_SYNC_SECTION_LEAVE);
+        _preprocess_rooms(left);
+        job->rooms = g_list_concat(job->rooms, left);
+    }
+
+    if(job->rooms != NULL)
+        job->rooms_obj = json_object_ref(rooms);
+
+    return job;
+}
+
+
+void matrix_sync_apply(PurpleConnection *pc, MatrixSyncJob *job)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    GList *elem;
+
+    if(job->ephemeral != NULL) {
+        matrix_ephemeral_apply_global(conn, job->ephemeral);
+        job->ephemeral = NULL;
+    }
+
+    /* at most one room can have the focus; move it to the front. */
+    for(elem = job->rooms; elem != NULL; elem = elem->next) {
+        MatrixSyncRoom *room = elem->data;
+        if(room->section == MATRIX_SYNC_SECTION_JOIN &&
+                _check_room_focus(pc, room)) {
+            job->rooms = g_list_remove_link(job->rooms, elem);
+            job->rooms = g_list_concat(elem, job->rooms);
+            break;
         }
-        g_list_free(room_ids);
     }
 
+    /* we queue the job even if there are no rooms in it, so that its
+     * next_batch is not recorded until the earlier jobs are done. */
+    g_queue_push_tail(&conn->sync_jobs, job);
+
+    if(conn->sync_timer != 0) {
+        /* there's already work in progress; this will be picked up when that
+         * is done */
+        return;
+    }
+
+    /* do the first slice straight away, so that the most important rooms are
+     * updated as soon as possible */
+    if(_run_sync_jobs(pc)) {
+        purple_debug_info("matrixprpl", "deferring remaining sync results\n");
+        conn->sync_timer = purple_timeout_add(0, _sync_timer_cb, pc);
+    }
 }
 
+
+/**
+ * handle the results of the sync request
+ */
+void matrix_sync_parse(PurpleConnection *pc, JsonNode *body,
+        const gchar **next_batch)
+{
+    JsonObject *rootObj;
+
+    rootObj = matrix_json_node_get_object(body);
+    *next_batch = matrix_json_object_get_string_member(rootObj, "next_batch");
+
+    matrix_sync_apply(pc, matrix_sync_preprocess(body));
+}
@@ -24,10 +24,34 @@
 
 struct _PurpleConnection;
 struct _JsonNode;
+struct _JsonObject;
+
+/* the outstanding work from a sync response */
+typedef struct _MatrixSyncJob MatrixSyncJob;
+
+/**
+ * Start the threads used to preprocess sync responses. Called when the plugin
+ * is loaded.
+ */
+void matrix_sync_init(void);
+
+/**
+ * Stop the threads started by matrix_sync_init, waiting for any work they
+ * have in hand. Called when the plugin is unloaded, after matrix_api_shutdown
+ * has stopped the thread which feeds them; any responses preprocessed after
+ * this do without the threads.
+ */
+void matrix_sync_shutdown(void);
+
 
 /**
  * Parse and dispatch the results of a /sync call.
  *
+ * The rooms are dispatched in order of priority, in slices of a few
+ * milliseconds. The first slice is dispatched before this function returns;
+ * the rest are dispatched from a timer callback, after the results of any
+ * earlier calls. The body is kept alive until that is done.
+ *
  * @param pc          Connection to which these results relate
  * @param body        Body of /sync response
  * @param next_batch  Returns a pointer to the next_batch setting, for the next
@@ -37,4 +61,96 @@ void matrix_sync_parse(struct _PurpleConnection *pc, struct _JsonNode *body,
         const gchar **next_batch);
 
 
+/**
+ * Do as much of the processing of a /sync response as can be done without
+ * reference to libpurple. This is thread-safe, and is intended to be used as
+ * the MatrixApiPreprocessFunc for matrix_api_sync.
+ *
+ * @param body   Body of /sync response
+ *
+ * @returns a MatrixSyncJob *, to be passed to matrix_sync_apply.
+ */
+gpointer matrix_sync_preprocess(struct _JsonNode *body);
+
+
+/**
+ * Get the next_batch token from a sync job (or NULL if none was found). The
+ * result is valid until the job is applied.
+ */
+const gchar *matrix_sync_job_get_next_batch(MatrixSyncJob *job);
+
+
+/**
+ * Record the token that the sync for this job started from. Rooms whose
+ * timeline has been cut short will be backfilled as far as this point.
+ */
+void matrix_sync_job_set_since(MatrixSyncJob *job, const gchar *since);
+
+
+/**
+ * Say whether the job's next_batch token should be saved once it has been
+ * applied (the default), so that a later connection resumes from there.
+ */
+void matrix_sync_job_set_store_next_batch(MatrixSyncJob *job, gboolean store);
+
+
+/**
+ * Trim the timeline of a room in the first sync after a sharded sync (see
+ * matrix-shardedsync.h): drop the events which we have already shown, along
+ * with any older ones, which we would otherwise show out of order, after
+ * newer messages. State events are kept. If anything was dropped, the
+ * timeline is no longer marked as limited, since the gap before it is older
+ * than what we have already shown.
+ *
+ * @param timeline   the room's 'timeline' object
+ * @param event_ids  set of event ids which we have shown (both keys and values
+ *                   should be the event id)
+ *
+ * @returns the number of events dropped
+ */
+guint matrix_sync_drop_seen_events(struct _JsonObject *timeline,
+        GHashTable *event_ids);
+
+
+/**
+ * Call matrix_sync_drop_seen_events on each of the rooms in a job. Must be
+ * called before the job is applied.
+ *
+ * @param event_ids  set of event ids which we have shown (both keys and values
+ *                   should be the event id)
+ */
+void matrix_sync_job_drop_events(MatrixSyncJob *job, GHashTable *event_ids);
+
+
+/**
+ * Dispatch the results from matrix_sync_preprocess, in the same way as
+ * matrix_sync_parse. Takes ownership of the job.
+ *
+ * Once the results have been applied, the job's next_batch token is saved
+ * with matrix_statecache_set_next_batch, so that a later connection resumes
+ * from there.
+ */
+void matrix_sync_apply(struct _PurpleConnection *pc, MatrixSyncJob *job);
+
+
+/**
+ * Free a sync job without applying it
+ */
+void matrix_sync_job_free(MatrixSyncJob *job);
+
+
+/**
+ * Check if there are results from earlier calls to matrix_sync_parse which are
+ * yet to be dispatched.
+ */
+gboolean matrix_sync_pending(struct _PurpleConnection *pc);
+
+
+/**
+ * Discard any results from earlier calls to matrix_sync_parse which are yet
+ * to be dispatched, in preparation for disconnecting.
+ */
+void matrix_sync_cancel(struct _PurpleConnection *pc);
+
+
 #endif /* MATRIX_SYNC_H_ */
@@ -0,0 +1,139 @@
+/**
+ * test-roommembers.c: tests for the room member table
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include <glib.h>
+
+#include <json-glib/json-glib.h>
+
+/* libmatrix */
+#include "matrix-roommembers.h"
+
+#define ALICE "@alice:example.com"
+
+
+/**
+ * Build the content of an m.room.member event
+ */
+static JsonObject *_member_content(const gchar *membership,
+        const gchar *displayname)
+{
+    JsonObject *content = json_object_new();
+
+    json_object_set_string_member(content, "membership", membership);
+    if(displayname != NULL)
+        json_object_set_string_member(content, "displayname", displayname);
+    return content;
+}
+
+
+/**
+ * Collect (and check) the pending changes, as matrix_room_complete_state_update
+ * would
+ */
+static void _collect_changes(MatrixRoomMemberTable *table, guint new_count,
+        guint renamed_count, guint left_count)
+{
+    GSList *members;
+
+    members = matrix_roommembers_get_new_members(table);
+    g_assert_cmpuint(g_slist_length(members), ==, new_count);
+    g_slist_free(members);
+
+    members = matrix_roommembers_get_renamed_members(table);
+    g_assert_cmpuint(g_slist_length(members), ==, renamed_count);
+    g_slist_free(members);
+
+    members = matrix_roommembers_get_left_members(table);
+    g_assert_cmpuint(g_slist_length(members), ==, left_count);
+    g_slist_free(members);
+}
+
+
+static void test_join(void)
+{
+    MatrixRoomMemberTable *table = matrix_roommembers_new_table();
+    JsonObject *join = _member_content("join", "Alice");
+
+    g_assert(!matrix_roommembers_has_pending_change(table, ALICE));
+    matrix_roommembers_update_member(table, ALICE, join);
+    g_assert(matrix_roommembers_has_pending_change(table, ALICE));
+    _collect_changes(table, 1, 0, 0);
+    g_assert(!matrix_roommembers_has_pending_change(table, ALICE));
+
+    matrix_roommembers_free_table(table);
+    json_object_unref(join);
+}
+
+
+/*
+ * A member who joins, leaves and rejoins in one run of state events must be
+ * seen as an arrival, a departure and another arrival - not as a member who
+ * is on the new and left lists at once, or on the new list twice.
+ */
+static void test_join_leave_join(void)
+{
+    MatrixRoomMemberTable *table = matrix_roommembers_new_table();
+    JsonObject *join = _member_content("join", "Alice");
+    JsonObject *leave = _member_content("leave", NULL);
+    JsonObject *rejoin = _member_content("join", "Alice");
+
+    matrix_roommembers_update_member(table, ALICE, join);
+    g_assert(matrix_roommembers_has_pending_change(table, ALICE));
+    _collect_changes(table, 1, 0, 0);
+
+    /* the sync loop has to collect each change before making the next */
+    matrix_roommembers_update_member(table, ALICE, leave);
+    g_assert(matrix_roommembers_has_pending_change(table, ALICE));
+    _collect_changes(table, 0, 0, 1);
+    g_assert(!matrix_roommembers_has_pending_change(table, ALICE));
+
+    matrix_roommembers_update_member(table, ALICE, rejoin);
+    g_assert(matrix_roommembers_has_pending_change(table, ALICE));
+    _collect_changes(table, 1, 0, 0);
+    g_assert(!matrix_roommembers_has_pending_change(table, ALICE));
+
+    matrix_roommembers_free_table(table);
+    json_object_unref(join);
+    json_object_unref(leave);
+    json_object_unref(rejoin);
+}
+
+
+static void test_unknown_member(void)
+{
+    MatrixRoomMemberTable *table = matrix_roommembers_new_table();
+
+    g_assert(!matrix_roommembers_has_pending_change(table, ALICE));
+    g_assert(!matrix_roommembers_has_pending_change(table, NULL));
+    matrix_roommembers_free_table(table);
+}
+
+
+int main(int argc, char **argv)
+{
+#if !GLIB_CHECK_VERSION(2, 36, 0)
+    g_type_init();
+#endif
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/roommembers/join", test_join);
+    g_test_add_func("/roommembers/join_leave_join", test_join_leave_join);
+    g_test_add_func("/roommembers/unknown_member", test_unknown_member);
+
+    return g_test_run();
+}
@@ -0,0 +1,134 @@
+/**
+ * test-roomsummary.c: tests for naming rooms after their members
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include <glib.h>
+
+#include <json-glib/json-glib.h>
+
+/* libmatrix */
+#include "matrix-roomsummary.h"
+
+
+/**
+ * Look up a displayname (as a MatrixRoomSummaryDisplaynameFunc): "@a" is
+ * known as "A", and everyone else has no displayname
+ */
+static const gchar *_get_displayname(const gchar *user_id,
+        gpointer user_data)
+{
+    return g_strcmp0(user_id, "@a") == 0 ? "A" : NULL;
+}
+
+
+/**
+ * Name a room after a list of members, given as a NULL-terminated array
+ */
+static gchar *_name_from_members(const gchar **user_ids)
+{
+    GList *list = NULL;
+    gchar *name;
+    guint i;
+
+    for(i = 0; user_ids[i] != NULL; i++)
+        list = g_list_append(list, (gpointer) user_ids[i]);
+    name = matrix_roomsummary_get_name_from_members(list, _get_displayname,
+            NULL);
+    g_list_free(list);
+    return name;
+}
+
+
+static void _check_name(const gchar **user_ids, const gchar *expected)
+{
+    gchar *name = _name_from_members(user_ids);
+    g_assert_cmpstr(name, ==, expected);
+    g_free(name);
+}
+
+
+static void test_no_members(void)
+{
+    const gchar *members[] = {NULL};
+    _check_name(members, NULL);
+}
+
+
+static void test_one_member(void)
+{
+    const gchar *with_displayname[] = {"@a", NULL};
+    const gchar *without_displayname[] = {"@b", NULL};
+
+    _check_name(with_displayname, "A");
+    _check_name(without_displayname, "@b");
+}
+
+
+/*
+ * The name is the same whatever order we find the members in
+ */
+static void test_stable_order(void)
+{
+    const gchar *two_forwards[] = {"@a", "@b", NULL};
+    const gchar *two_backwards[] = {"@b", "@a", NULL};
+    const gchar *three_acb[] = {"@a", "@c", "@b", NULL};
+    const gchar *three_cba[] = {"@c", "@b", "@a", NULL};
+
+    _check_name(two_forwards, "A and @b");
+    _check_name(two_backwards, "A and @b");
+    _check_name(three_acb, "A and 3 others");
+    _check_name(three_cba, "A and 3 others");
+}
+
+
+static void test_is_hero(void)
+{
+    MatrixRoomSummary *summary = matrix_roomsummary_new();
+    JsonObject *summary_obj = json_object_new();
+    JsonArray *heroes = json_array_new();
+
+    g_assert(!matrix_roomsummary_is_hero(summary, "@a"));
+
+    json_array_add_string_element(heroes, "@a");
+    json_array_add_string_element(heroes, "@b");
+    json_object_set_array_member(summary_obj, "m.heroes", heroes);
+    matrix_roomsummary_update(summary, summary_obj);
+
+    g_assert(matrix_roomsummary_is_hero(summary, "@a"));
+    g_assert(matrix_roomsummary_is_hero(summary, "@b"));
+    g_assert(!matrix_roomsummary_is_hero(summary, "@c"));
+    g_assert(!matrix_roomsummary_is_hero(summary, NULL));
+
+    json_object_unref(summary_obj);
+    matrix_roomsummary_free(summary);
+}
+
+
+int main(int argc, char **argv)
+{
+#if !GLIB_CHECK_VERSION(2, 36, 0)
+    g_type_init();
+#endif
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/roomsummary/no_members", test_no_members);
+    g_test_add_func("/roomsummary/one_member", test_one_member);
+    g_test_add_func("/roomsummary/stable_order", test_stable_order);
+    g_test_add_func("/roomsummary/is_hero", test_is_hero);
+
+    return g_test_run();
+}
@@ -0,0 +1,166 @@
+/**
+ * test-slidingsync.c: tests for the translation of sliding sync responses
+ *
+ * Each fixture in tests/fixtures is an object with a sliding sync 'response',
+ * and the /sync response we 'expected' to translate it into.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include <glib.h>
+
+#include <json-glib/json-glib.h>
+
+/* libmatrix */
+#include "matrix-json.h"
+#include "matrix-slidingsync.h"
+
+static const gchar *_fixtures[] = {
+    "slidingsync-joined.json",
+    "slidingsync-invite.json",
+    "slidingsync-minimal.json",
+};
+
+
+/**
+ * Compare two JSON trees, ignoring the order of object members
+ */
+static gboolean _json_equal(JsonNode *a, JsonNode *b)
+{
+    if(a == NULL || b == NULL)
+        return a == b;
+
+    if(JSON_NODE_TYPE(a) != JSON_NODE_TYPE(b))
+        return FALSE;
+
+    switch(JSON_NODE_TYPE(a)) {
+        case JSON_NODE_OBJECT: {
+            JsonObject *obj_a = json_node_get_object(a);
+            JsonObject *obj_b = json_node_get_object(b);
+            GList *members, *elem;
+            gboolean equal;
+
+            if(json_object_get_size(obj_a) != json_object_get_size(obj_b))
+                return FALSE;
+
+            members = json_object_get_members(obj_a);
+            equal = TRUE;
+            for(elem = members; elem != NULL && equal; elem = elem->next) {
+                equal = json_object_has_member(obj_b, elem->data) &&
+                        _json_equal(json_object_get_member(obj_a, elem->data),
+                                json_object_get_member(obj_b, elem->data));
+            }
+            g_list_free(members);
+            return equal;
+        }
+
+        case JSON_NODE_ARRAY: {
+            JsonArray *arr_a = json_node_get_array(a);
+            JsonArray *arr_b = json_node_get_array(b);
+            guint i, len = json_array_get_length(arr_a);
+
+            if(json_array_get_length(arr_b) != len)
+                return FALSE;
+            for(i = 0; i < len; i++) {
+                if(!_json_equal(json_array_get_element(arr_a, i),
+                        json_array_get_element(arr_b, i)))
+                    return FALSE;
+            }
+            return TRUE;
+        }
+
+        case JSON_NODE_VALUE:
+            if(json_node_get_value_type(a) != json_node_get_value_type(b))
+                return FALSE;
+            if(json_node_get_value_type(a) == G_TYPE_STRING)
+                return g_strcmp0(json_node_get_string(a),
+                        json_node_get_string(b)) == 0;
+            if(json_node_get_value_type(a) == G_TYPE_BOOLEAN)
+                return json_node_get_boolean(a) == json_node_get_boolean(b);
+            if(json_node_get_value_type(a) == G_TYPE_DOUBLE)
+                return json_node_get_double(a) == json_node_get_double(b);
+            return json_node_get_int(a) == json_node_get_int(b);
+
+        default:
+            return TRUE;
+    }
+}
+
+
+static gchar *_to_string(JsonNode *node)
+{
+    JsonGenerator *generator = json_generator_new();
+    gchar *str;
+
+    json_generator_set_root(generator, node);
+    json_generator_set_pretty(generator, TRUE);
+    str = json_generator_to_data(generator, NULL);
+    g_object_unref(generator);
+    return str;
+}
+
+
+static void test_fixture(gconstpointer data)
+{
+    const gchar *name = data;
+    JsonParser *parser = json_parser_new();
+    GError *err = NULL;
+    gchar *filename;
+    JsonObject *fixture;
+    JsonNode *expected, *translated;
+
+    /* 'make check' runs the tests from the top of the tree */
+    filename = g_build_filename("tests", "fixtures", name, NULL);
+    if(!json_parser_load_from_file(parser, filename, &err))
+        g_error("unable to load %s: %s", filename, err->message);
+
+    fixture = matrix_json_node_get_object(json_parser_get_root(parser));
+    g_assert(fixture != NULL);
+    expected = json_object_get_member(fixture, "expected");
+    g_assert(expected != NULL);
+
+    translated = matrix_slidingsync_translate_response(
+            matrix_json_object_get_object_member(fixture, "response"));
+
+    if(!_json_equal(translated, expected)) {
+        gchar *got = _to_string(translated);
+        g_error("%s: translation doesn't match; got %s", name, got);
+        g_free(got);
+    }
+
+    json_node_free(translated);
+    g_free(filename);
+    g_object_unref(parser);
+}
+
+
+int main(int argc, char **argv)
+{
+    guint i;
+
+#if !GLIB_CHECK_VERSION(2, 36, 0)
+    g_type_init();
+#endif
+    g_test_init(&argc, &argv, NULL);
+
+    for(i = 0; i < G_N_ELEMENTS(_fixtures); i++) {
+        gchar *path = g_strdup_printf("/slidingsync/%s", _fixtures[i]);
+        g_test_add_data_func(path, _fixtures[i], test_fixture);
+        g_free(path);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,498 @@
+/**
+ * test-slidingsyncloop.c: tests for the sliding sync request/response loop
+ *
+ * matrix-slidingsync.c is linked against a fake matrix_api_sliding_sync,
+ * which just holds on to the request; each test then plays the part of the
+ * server, answering the requests in turn, while the callbacks here play the
+ * part of the sync loop in matrix-connection.c.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <json-glib/json-glib.h>
+
+/* libmatrix */
+#include "matrix-json.h"
+#include "matrix-roomregistry.h"
+#include "matrix-slidingsync.h"
+#include "matrix-sync.h"
+
+#define ROOM "!room:example.com"
+#define SYNC_TIMEOUT 30000
+
+
+/******************************************************************************
+ *
+ * The fake server
+ */
+
+/* a request which the server has yet to answer */
+struct _MatrixApiRequestData {
+    gchar *pos;
+    int timeout;
+    JsonObject *body;
+    MatrixApiPreprocessFunc preprocess;
+    GDestroyNotify preprocess_free;
+    MatrixApiPreprocessedCallback callback;
+    MatrixApiErrorCallback error_callback;
+    MatrixApiBadResponseCallback bad_response_callback;
+    gpointer user_data;
+};
+
+static MatrixApiRequestData *_pending = NULL;
+
+/* what the default error handlers were last called with */
+static gchar *_api_error = NULL;
+static int _api_bad_response = 0;
+
+
+MatrixApiRequestData *matrix_api_sliding_sync(MatrixConnectionData *conn,
+        const gchar *pos, int timeout, JsonObject *request,
+        MatrixApiPreprocessFunc preprocess,
+        GDestroyNotify preprocess_free,
+        MatrixApiPreprocessedCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data)
+{
+    /* the sync loop should only ever have one request outstanding */
+    g_assert(_pending == NULL);
+
+    _pending = g_new0(MatrixApiRequestData, 1);
+    _pending->pos = g_strdup(pos);
+    _pending->timeout = timeout;
+    _pending->body = json_object_ref(request);
+    _pending->preprocess = preprocess;
+    _pending->preprocess_free = preprocess_free;
+    _pending->callback = callback;
+    _pending->error_callback = error_callback;
+    _pending->bad_response_callback = bad_response_callback;
+    _pending->user_data = user_data;
+    return _pending;
+}
+
+
+void matrix_api_error(MatrixConnectionData *conn, gpointer user_data,
+        const gchar *error_message)
+{
+    g_free(_api_error);
+    _api_error = g_strdup(error_message);
+}
+
+
+void matrix_api_bad_response(MatrixConnectionData *ma, gpointer user_data,
+        int http_response_code, JsonNode *json_root)
+{
+    _api_bad_response = http_response_code;
+}
+
+
+static void _free_request(MatrixApiRequestData *request)
+{
+    g_free(request->pos);
+    json_object_unref(request->body);
+    g_free(request);
+}
+
+
+/**
+ * Take the outstanding request, ready to answer it
+ */
+static MatrixApiRequestData *_take_request(void)
+{
+    MatrixApiRequestData *request = _pending;
+
+    g_assert(request != NULL);
+    _pending = NULL;
+    return request;
+}
+
+
+static JsonNode *_parse(const gchar *json)
+{
+    JsonParser *parser = json_parser_new();
+    GError *err = NULL;
+    JsonNode *root;
+
+    if(!json_parser_load_from_data(parser, json, -1, &err))
+        g_error("unable to parse %s: %s", json, err->message);
+    root = json_node_copy(json_parser_get_root(parser));
+    g_object_unref(parser);
+    return root;
+}
+
+
+/**
+ * Answer the outstanding request successfully
+ */
+static void _serve(MatrixConnectionData *conn, const gchar *response)
+{
+    MatrixApiRequestData *request = _take_request();
+    JsonNode *root = _parse(response);
+
+    request->callback(conn, request->user_data, root,
+            request->preprocess(root));
+    json_node_free(root);
+    _free_request(request);
+}
+
+
+/**
+ * Answer the outstanding request with an HTTP error
+ */
+static void _fail(MatrixConnectionData *conn, int http_response_code,
+        const gchar *response)
+{
+    MatrixApiRequestData *request = _take_request();
+    JsonNode *root = _parse(response);
+
+    request->bad_response_callback(conn, request->user_data,
+            http_response_code, root);
+    json_node_free(root);
+    _free_request(request);
+}
+
+
+/**
+ * Drop the connection before answering the outstanding request
+ */
+static void _drop(MatrixConnectionData *conn, const gchar *error_message)
+{
+    MatrixApiRequestData *request = _take_request();
+
+    request->error_callback(conn, request->user_data, error_message);
+    _free_request(request);
+}
+
+
+/**
+ * Check the position, timeout and window of the outstanding request
+ */
+static void _check_request(const gchar *pos, int timeout, gint64 window_end)
+{
+    JsonObject *list;
+    JsonArray *range;
+
+    g_assert(_pending != NULL);
+    g_assert_cmpstr(_pending->pos, ==, pos);
+    g_assert_cmpint(_pending->timeout, ==, timeout);
+
+    list = matrix_json_object_get_object_member(
+            matrix_json_object_get_object_member(_pending->body, "lists"),
+            "rooms");
+    range = json_array_get_array_element(
+            matrix_json_object_get_array_member(list, "ranges"), 0);
+    g_assert_cmpint(json_array_get_int_element(range, 0), ==, 0);
+    g_assert_cmpint(json_array_get_int_element(range, 1), ==, window_end);
+}
+
+
+static JsonObject *_get_subscription(const gchar *room_id)
+{
+    g_assert(_pending != NULL);
+    return matrix_json_object_get_object_member(
+            matrix_json_object_get_object_member(_pending->body,
+                    "room_subscriptions"), room_id);
+}
+
+
+/******************************************************************************
+ *
+ * Stubs for the rest of libmatrix
+ */
+
+struct _MatrixSyncJob {
+    gchar *next_batch;
+    gboolean store_next_batch;
+};
+
+
+gpointer matrix_sync_preprocess(JsonNode *body)
+{
+    MatrixSyncJob *job = g_new0(MatrixSyncJob, 1);
+
+    job->next_batch = g_strdup(matrix_json_object_get_string_member(
+            matrix_json_node_get_object(body), "next_batch"));
+    job->store_next_batch = TRUE;
+    return job;
+}
+
+
+void matrix_sync_job_set_store_next_batch(MatrixSyncJob *job, gboolean store)
+{
+    job->store_next_batch = store;
+}
+
+
+void matrix_sync_job_free(MatrixSyncJob *job)
+{
+    g_free(job->next_batch);
+    g_free(job);
+}
+
+
+GList *matrix_roomregistry_get_conversations(MatrixConnectionData *conn)
+{
+    return NULL;
+}
+
+
+/******************************************************************************
+ *
+ * The sync loop
+ */
+
+static struct {
+    MatrixConnectionData *conn;
+    gchar *pos;
+    guint responses;
+    gchar *error;
+    int bad_response;
+} _loop;
+
+
+static void _start_request(void);
+
+
+static void _loop_complete(MatrixConnectionData *conn, gpointer user_data,
+        JsonNode *json_root, gpointer preprocessed)
+{
+    MatrixSyncJob *job = preprocessed;
+
+    g_assert(job != NULL);
+
+    /* sliding sync positions are no good to a classic /sync */
+    g_assert(!job->store_next_batch);
+
+    g_free(_loop.pos);
+    _loop.pos = g_strdup(job->next_batch);
+    matrix_sync_job_free(job);
+    _loop.responses++;
+    _start_request();
+}
+
+
+static void _loop_error(MatrixConnectionData *conn, gpointer user_data,
+        const gchar *error_message)
+{
+    g_free(_loop.error);
+    _loop.error = g_strdup(error_message);
+}
+
+
+static void _loop_bad_response(MatrixConnectionData *conn,
+        gpointer user_data, int http_response_code, JsonNode *json_root)
+{
+    if(matrix_slidingsync_position_expired(conn, http_response_code,
+            json_root)) {
+        g_free(_loop.pos);
+        _loop.pos = NULL;
+        _start_request();
+        return;
+    }
+    _loop.bad_response = http_response_code;
+}
+
+
+static void _start_request(void)
+{
+    g_assert(matrix_slidingsync_request(_loop.conn, _loop.pos, SYNC_TIMEOUT,
+            _loop_complete, _loop_error, _loop_bad_response, NULL) != NULL);
+}
+
+
+static void _loop_init(void)
+{
+    _loop.conn = g_new0(MatrixConnectionData, 1);
+    _loop.conn->slidingsync_count = -1;
+}
+
+
+static void _loop_free(void)
+{
+    if(_pending != NULL)
+        _free_request(_take_request());
+    matrix_slidingsync_free(_loop.conn);
+    g_free(_loop.conn);
+    g_free(_loop.pos);
+    g_free(_loop.error);
+    memset(&_loop, 0, sizeof(_loop));
+
+    g_free(_api_error);
+    _api_error = NULL;
+    _api_bad_response = 0;
+}
+
+
+/******************************************************************************
+ *
+ * Tests
+ */
+
+/*
+ * The window onto the room list is widened a step at a time; until it covers
+ * the whole list, we don't wait around for new events.
+ */
+static void test_widen_window(void)
+{
+    MatrixConnectionData *conn;
+
+    _loop_init();
+    conn = _loop.conn;
+    _start_request();
+    _check_request(NULL, 0, 49);
+
+    _serve(conn, "{\"pos\": \"p1\", \"lists\": {\"rooms\": {\"count\": 120}}}");
+    _check_request("p1", 0, 99);
+
+    _serve(conn, "{\"pos\": \"p2\", \"lists\": {\"rooms\": {\"count\": 120}}}");
+    _check_request("p2", SYNC_TIMEOUT, 149);
+    g_assert_cmpint(conn->slidingsync_count, ==, 120);
+
+    /* now we have them all, the window stays where it is */
+    _serve(conn, "{\"pos\": \"p3\", \"lists\": {\"rooms\": {\"count\": 120}}}");
+    _check_request("p3", SYNC_TIMEOUT, 149);
+    g_assert_cmpuint(_loop.responses, ==, 3);
+
+    _loop_free();
+}
+
+
+/*
+ * Subscribing to a room asks for its full details from the next request on
+ */
+static void test_subscriptions(void)
+{
+    MatrixConnectionData *conn;
+    JsonObject *subscription;
+    JsonArray *required_state;
+
+    _loop_init();
+    conn = _loop.conn;
+    _start_request();
+    g_assert(_get_subscription(ROOM) == NULL);
+
+    matrix_slidingsync_subscribe(conn, ROOM);
+    _serve(conn, "{\"pos\": \"p1\", \"lists\": {\"rooms\": {\"count\": 1}}}");
+
+    subscription = _get_subscription(ROOM);
+    g_assert(subscription != NULL);
+    g_assert_cmpint(matrix_json_object_get_int_member(subscription,
+            "timeline_limit"), ==, 20);
+    required_state = matrix_json_object_get_array_member(subscription,
+            "required_state");
+    g_assert_cmpuint(json_array_get_length(required_state), ==, 1);
+    g_assert_cmpstr(json_array_get_string_element(
+            json_array_get_array_element(required_state, 0), 0), ==, "*");
+
+    /* it stays subscribed until we say otherwise */
+    _serve(conn, "{\"pos\": \"p2\", \"lists\": {\"rooms\": {\"count\": 1}}}");
+    g_assert(_get_subscription(ROOM) != NULL);
+
+    matrix_slidingsync_unsubscribe(conn, ROOM);
+    _serve(conn, "{\"pos\": \"p3\", \"lists\": {\"rooms\": {\"count\": 1}}}");
+    g_assert(_get_subscription(ROOM) == NULL);
+
+    _loop_free();
+}
+
+
+/*
+ * When the server forgets our position, we start again from scratch, with
+ * the smallest window
+ */
+static void test_unknown_pos(void)
+{
+    MatrixConnectionData *conn;
+
+    _loop_init();
+    conn = _loop.conn;
+    _start_request();
+    _serve(conn, "{\"pos\": \"p1\", \"lists\": {\"rooms\": {\"count\": 120}}}");
+    _check_request("p1", 0, 99);
+
+    _fail(conn, 400, "{\"errcode\": \"M_UNKNOWN_POS\", "
+            "\"error\": \"Unknown position\"}");
+    _check_request(NULL, 0, 49);
+    g_assert_cmpint(conn->slidingsync_count, ==, -1);
+    g_assert_cmpint(_loop.bad_response, ==, 0);
+
+    _serve(conn, "{\"pos\": \"q1\", \"lists\": {\"rooms\": {\"count\": 10}}}");
+    _check_request("q1", SYNC_TIMEOUT, 49);
+
+    /* other errors are passed on, rather than restarting */
+    _fail(conn, 400, "{\"errcode\": \"M_BAD_JSON\"}");
+    g_assert(_pending == NULL);
+    g_assert_cmpint(_loop.bad_response, ==, 400);
+    g_assert_cmpint(conn->slidingsync_window, ==, 50);
+
+    _loop_free();
+}
+
+
+/*
+ * Errors are passed to the caller's callbacks, or to the default handlers if
+ * there are none
+ */
+static void test_errors(void)
+{
+    MatrixConnectionData *conn;
+
+    _loop_init();
+    conn = _loop.conn;
+    _start_request();
+    _drop(conn, "Connection reset");
+    g_assert_cmpstr(_loop.error, ==, "Connection reset");
+    g_assert(_pending == NULL);
+    g_assert(_api_error == NULL);
+
+    matrix_slidingsync_request(conn, NULL, SYNC_TIMEOUT, _loop_complete,
+            NULL, NULL, NULL);
+    _drop(conn, "Timed out");
+    g_assert_cmpstr(_api_error, ==, "Timed out");
+
+    matrix_slidingsync_request(conn, NULL, SYNC_TIMEOUT, _loop_complete,
+            NULL, NULL, NULL);
+    _fail(conn, 500, "{}");
+    g_assert_cmpint(_api_bad_response, ==, 500);
+
+    /* none of which moves the window on */
+    g_assert_cmpuint(_loop.responses, ==, 0);
+    g_assert_cmpint(conn->slidingsync_window, ==, 50);
+    g_assert_cmpint(conn->slidingsync_count, ==, -1);
+
+    _loop_free();
+}
+
+
+int main(int argc, char **argv)
+{
+#if !GLIB_CHECK_VERSION(2, 36, 0)
+    g_type_init();
+#endif
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/slidingsyncloop/widen_window", test_widen_window);
+    g_test_add_func("/slidingsyncloop/subscriptions", test_subscriptions);
+    g_test_add_func("/slidingsyncloop/unknown_pos", test_unknown_pos);
+    g_test_add_func("/slidingsyncloop/errors", test_errors);
+
+    return g_test_run();
+}
@@ -0,0 +1,166 @@
+/**
+ * test-sync.c: tests for merging the first sync after a sharded sync
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include <glib.h>
+
+#include <json-glib/json-glib.h>
+
+/* libmatrix */
+#include "matrix-json.h"
+#include "matrix-sync.h"
+
+
+/**
+ * Build a timeline object from a list of event ids. An id starting with 's'
+ * makes a state event.
+ */
+static JsonObject *_build_timeline(const gchar **event_ids, gboolean limited)
+{
+    JsonObject *timeline = json_object_new();
+    JsonArray *events = json_array_new();
+    guint i;
+
+    for(i = 0; event_ids[i] != NULL; i++) {
+        JsonObject *event = json_object_new();
+
+        json_object_set_string_member(event, "event_id", event_ids[i]);
+        if(event_ids[i][0] == 's') {
+            json_object_set_string_member(event, "type", "m.room.topic");
+            json_object_set_string_member(event, "state_key", "");
+        } else {
+            json_object_set_string_member(event, "type", "m.room.message");
+        }
+        json_array_add_object_element(events, event);
+    }
+
+    json_object_set_array_member(timeline, "events", events);
+    json_object_set_boolean_member(timeline, "limited", limited);
+    return timeline;
+}
+
+
+static GHashTable *_build_seen(const gchar **event_ids)
+{
+    GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+    guint i;
+
+    for(i = 0; event_ids[i] != NULL; i++)
+        g_hash_table_insert(seen, (gpointer)event_ids[i],
+                (gpointer)event_ids[i]);
+    return seen;
+}
+
+
+/**
+ * Check the event ids left in a timeline
+ */
+static void _check_timeline(JsonObject *timeline, const gchar **expected)
+{
+    JsonArray *events = matrix_json_object_get_array_member(timeline,
+            "events");
+    guint i;
+
+    g_assert_cmpuint(json_array_get_length(events), ==,
+            g_strv_length((gchar **)expected));
+    for(i = 0; expected[i] != NULL; i++) {
+        g_assert_cmpstr(matrix_json_object_get_string_member(
+                matrix_json_node_get_object(json_array_get_element(events, i)),
+                "event_id"), ==, expected[i]);
+    }
+}
+
+
+/*
+ * The catch-up sync from the anchor token starts with events from before the
+ * shard's window, then repeats the shard's events, then has the new ones.
+ * Only the new ones should be shown.
+ */
+static void test_drop_older_than_shard(void)
+{
+    const gchar *timeline_ids[] = {"$before1", "$before2", "$shard1",
+            "$shard2", "$new1", "$new2", NULL};
+    const gchar *seen_ids[] = {"$shard1", "$shard2", "$elsewhere", NULL};
+    const gchar *expected[] = {"$new1", "$new2", NULL};
+    JsonObject *timeline = _build_timeline(timeline_ids, TRUE);
+    GHashTable *seen = _build_seen(seen_ids);
+
+    g_assert_cmpuint(matrix_sync_drop_seen_events(timeline, seen), ==, 4);
+    _check_timeline(timeline, expected);
+
+    /* and the gap before them is not worth backfilling */
+    g_assert(!matrix_json_object_get_boolean_member(timeline, "limited"));
+
+    g_hash_table_destroy(seen);
+    json_object_unref(timeline);
+}
+
+
+/*
+ * State events are re-applied, wherever they are
+ */
+static void test_keep_state(void)
+{
+    const gchar *timeline_ids[] = {"s_before", "$shard1", "s_new", "$new1",
+            NULL};
+    const gchar *seen_ids[] = {"$shard1", "s_before", NULL};
+    const gchar *expected[] = {"s_before", "s_new", "$new1", NULL};
+    JsonObject *timeline = _build_timeline(timeline_ids, FALSE);
+    GHashTable *seen = _build_seen(seen_ids);
+
+    g_assert_cmpuint(matrix_sync_drop_seen_events(timeline, seen), ==, 1);
+    _check_timeline(timeline, expected);
+
+    g_hash_table_destroy(seen);
+    json_object_unref(timeline);
+}
+
+
+/*
+ * If none of the shard's events are in the timeline, it is all new, and the
+ * gap before it still needs filling
+ */
+static void test_nothing_seen(void)
+{
+    const gchar *timeline_ids[] = {"$new1", "$new2", NULL};
+    const gchar *seen_ids[] = {"$shard1", NULL};
+    JsonObject *timeline = _build_timeline(timeline_ids, TRUE);
+    GHashTable *seen = _build_seen(seen_ids);
+
+    g_assert_cmpuint(matrix_sync_drop_seen_events(timeline, seen), ==, 0);
+    _check_timeline(timeline, timeline_ids);
+    g_assert(matrix_json_object_get_boolean_member(timeline, "limited"));
+
+    g_hash_table_destroy(seen);
+    json_object_unref(timeline);
+}
+
+
+int main(int argc, char **argv)
+{
+#if !GLIB_CHECK_VERSION(2, 36, 0)
+    g_type_init();
+#endif
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/sync/drop_older_than_shard",
+            test_drop_older_than_shard);
+    g_test_add_func("/sync/keep_state", test_keep_state);
+    g_test_add_func("/sync/nothing_seen", test_nothing_seen);
+
+    return g_test_run();
+}
@@ -0,0 +1,371 @@
+/**
+ * test-syncmembers.c: tests for applying member changes from a sync
+ *
+ * matrix-sync.c is linked against the real member table, but with the rest of
+ * matrix-room.c stubbed out, so that we can see when matrix-sync.c flushes
+ * the changes from a run of state events in the timeline.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include <glib.h>
+
+#include <json-glib/json-glib.h>
+
+/* libpurple */
+#include "connection.h"
+#include "conversation.h"
+#include "eventloop.h"
+
+/* libmatrix */
+#include "matrix-backfill.h"
+#include "matrix-dormantroom.h"
+#include "matrix-ephemeral.h"
+#include "matrix-invite.h"
+#include "matrix-json.h"
+#include "matrix-room.h"
+#include "matrix-roommembers.h"
+#include "matrix-roomregistry.h"
+#include "matrix-seenevents.h"
+#include "matrix-statecache.h"
+#include "matrix-sync.h"
+
+#define ROOM "!room:example.com"
+
+
+/* the one room, which is created when the sync first mentions it */
+static PurpleConversation *_conv = NULL;
+static MatrixRoomMemberTable *_members = NULL;
+
+/* what the room was told, in order: "+user" for an arrival, "-user" for a
+ * departure, "~user" for a rename, "|" at the end of each flush, and the
+ * event id of each message */
+static GString *_log = NULL;
+
+
+/******************************************************************************
+ *
+ * Stubs for matrix-room.c
+ */
+
+void matrix_room_handle_state_event(PurpleConversation *conv,
+        JsonObject *json_event_obj)
+{
+    if(g_strcmp0(matrix_json_object_get_string_member(json_event_obj, "type"),
+            "m.room.member") != 0)
+        return;
+
+    matrix_roommembers_update_member(_members,
+            matrix_json_object_get_string_member(json_event_obj, "state_key"),
+            matrix_json_object_get_object_member(json_event_obj, "content"));
+}
+
+
+gboolean matrix_room_member_change_pending(PurpleConversation *conv,
+        const gchar *user_id)
+{
+    return matrix_roommembers_has_pending_change(_members, user_id);
+}
+
+
+static void _log_members(GSList *members, const gchar *prefix)
+{
+    GSList *elem;
+
+    for(elem = members; elem != NULL; elem = elem->next) {
+        g_string_append(_log, prefix);
+        g_string_append(_log, matrix_roommember_get_user_id(elem->data));
+    }
+    g_slist_free(members);
+}
+
+
+void matrix_room_complete_state_update(PurpleConversation *conv,
+        gboolean announce_arrivals)
+{
+    _log_members(matrix_roommembers_get_new_members(_members), "+");
+    _log_members(matrix_roommembers_get_renamed_members(_members), "~");
+    _log_members(matrix_roommembers_get_left_members(_members), "-");
+    g_string_append(_log, "|");
+}
+
+
+void matrix_room_handle_timeline_event(PurpleConversation *conv,
+        JsonObject *json_event_obj)
+{
+    g_string_append(_log, matrix_json_object_get_string_member(json_event_obj,
+            "event_id"));
+}
+
+
+void matrix_room_handle_state_table(PurpleConversation *conv,
+        MatrixRoomStateEventTable *state_events)
+{
+}
+
+
+void matrix_room_handle_summary(PurpleConversation *conv,
+        JsonObject *summary_obj)
+{
+}
+
+
+void matrix_room_handle_ephemeral(PurpleConversation *conv,
+        MatrixRoomEphemeral *ephemeral)
+{
+    matrix_ephemeral_free_room(ephemeral);
+}
+
+
+void matrix_room_handle_leave(PurpleConversation *conv)
+{
+}
+
+
+/******************************************************************************
+ *
+ * Stubs for the rest of libmatrix
+ */
+
+PurpleConversation *matrix_roomregistry_get_conversation(
+        MatrixConnectionData *conn, const gchar *room_id)
+{
+    return _conv;
+}
+
+
+PurpleChat *matrix_roomregistry_get_chat(MatrixConnectionData *conn,
+        const gchar *room_id)
+{
+    /* pretend there is already a buddy list entry */
+    static PurpleChat chat;
+    return &chat;
+}
+
+
+gboolean matrix_dormantroom_should_promote(MatrixConnectionData *conn,
+        const gchar *room_id, JsonObject *room_data)
+{
+    return TRUE;
+}
+
+
+PurpleConversation *matrix_dormantroom_promote(PurpleConnection *pc,
+        const gchar *room_id)
+{
+    _conv = g_new0(PurpleConversation, 1);
+    _conv->name = g_strdup(room_id);
+    return _conv;
+}
+
+
+void matrix_dormantroom_update(PurpleConnection *pc, const gchar *room_id,
+        MatrixRoomStateEventTable *state_events, JsonObject *room_data)
+{
+}
+
+
+void matrix_dormantroom_forget(MatrixConnectionData *conn,
+        const gchar *room_id)
+{
+}
+
+
+void matrix_invite_handle(MatrixConnectionData *conn, const gchar *room_id,
+        JsonObject *invite_data)
+{
+}
+
+
+void matrix_invite_forget(MatrixConnectionData *conn, const gchar *room_id)
+{
+}
+
+
+void matrix_backfill_start(PurpleConversation *conv, const gchar *from,
+        const gchar *to)
+{
+}
+
+
+gboolean matrix_backfill_pending(PurpleConversation *conv)
+{
+    return FALSE;
+}
+
+
+void matrix_backfill_defer_event(PurpleConversation *conv,
+        JsonObject *json_event_obj)
+{
+}
+
+
+void matrix_statecache_set_next_batch(PurpleConnection *pc,
+        const gchar *next_batch)
+{
+}
+
+
+void matrix_seenevents_forget_room(MatrixConnectionData *conn,
+        const gchar *room_id)
+{
+}
+
+
+/******************************************************************************
+ *
+ * Running a sync
+ */
+
+static PurpleEventLoopUiOps _eventloop_ops = {
+    g_timeout_add,
+    g_source_remove,
+};
+
+
+/**
+ * Build a sync response for our room, from a list of timeline events. Each
+ * event is either "@user:membership", for a membership change, or "$id",
+ * for a message.
+ */
+static JsonNode *_build_sync(const gchar **timeline_events)
+{
+    JsonObject *root, *rooms, *join, *room, *timeline;
+    JsonArray *events = json_array_new();
+    JsonNode *node;
+    guint i;
+
+    for(i = 0; timeline_events[i] != NULL; i++) {
+        JsonObject *event = json_object_new();
+
+        if(timeline_events[i][0] == '@') {
+            gchar **parts = g_strsplit(timeline_events[i], ":", 3);
+            gchar *user_id = g_strdup_printf("%s:%s", parts[0], parts[1]);
+            JsonObject *content = json_object_new();
+
+            json_object_set_string_member(content, "membership", parts[2]);
+            json_object_set_string_member(event, "type", "m.room.member");
+            json_object_set_string_member(event, "state_key", user_id);
+            json_object_set_object_member(event, "content", content);
+            g_free(user_id);
+            g_strfreev(parts);
+        } else {
+            json_object_set_string_member(event, "type", "m.room.message");
+            json_object_set_string_member(event, "event_id",
+                    timeline_events[i]);
+            json_object_set_object_member(event, "content",
+                    json_object_new());
+        }
+        json_array_add_object_element(events, event);
+    }
+
+    timeline = json_object_new();
+    json_object_set_array_member(timeline, "events", events);
+    room = json_object_new();
+    json_object_set_object_member(room, "timeline", timeline);
+    join = json_object_new();
+    json_object_set_object_member(join, ROOM, room);
+    rooms = json_object_new();
+    json_object_set_object_member(rooms, "join", join);
+    root = json_object_new();
+    json_object_set_string_member(root, "next_batch", "s1");
+    json_object_set_object_member(root, "rooms", rooms);
+
+    node = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(node, root);
+    return node;
+}
+
+
+/**
+ * Apply a sync response to our room, and check what the room was told
+ */
+static void _check_sync(const gchar **timeline_events, const gchar *expected)
+{
+    PurpleConnection *pc = g_new0(PurpleConnection, 1);
+    MatrixConnectionData *conn = g_new0(MatrixConnectionData, 1);
+    JsonNode *body = _build_sync(timeline_events);
+
+    conn->pc = pc;
+    purple_connection_set_protocol_data(pc, conn);
+    _members = matrix_roommembers_new_table();
+    _log = g_string_new("");
+
+    matrix_sync_apply(pc, matrix_sync_preprocess(body));
+    while(matrix_sync_pending(pc))
+        g_main_context_iteration(NULL, TRUE);
+
+    /* the first flush comes from the (empty) state section */
+    g_assert_cmpstr(_log->str, ==, expected);
+
+    g_string_free(_log, TRUE);
+    _log = NULL;
+    matrix_roommembers_free_table(_members);
+    _members = NULL;
+    g_free(_conv->name);
+    g_free(_conv);
+    _conv = NULL;
+    json_node_free(body);
+    g_free(conn);
+    g_free(pc);
+}
+
+
+/******************************************************************************
+ *
+ * Tests
+ */
+
+/*
+ * A run of state events is flushed once, before the next message
+ */
+static void test_flush_before_message(void)
+{
+    const gchar *events[] = {"@alice:x:join", "@bob:x:join", "$msg1",
+            "@bob:x:leave", NULL};
+
+    _check_sync(events, "|+@alice:x+@bob:x|$msg1-@bob:x|");
+}
+
+
+/*
+ * A member who changes twice in one run has the first change flushed before
+ * the second is applied
+ */
+static void test_flush_on_second_change(void)
+{
+    const gchar *events[] = {"@alice:x:join", "@bob:x:join", "@alice:x:leave",
+            "@alice:x:join", "$msg1", NULL};
+
+    _check_sync(events, "|+@alice:x+@bob:x|-@alice:x|+@alice:x|$msg1");
+}
+
+
+int main(int argc, char **argv)
+{
+#if !GLIB_CHECK_VERSION(2, 36, 0)
+    g_type_init();
+#endif
+    g_test_init(&argc, &argv, NULL);
+    purple_eventloop_set_ui_ops(&_eventloop_ops);
+
+    g_test_add_func("/syncmembers/flush_before_message",
+            test_flush_before_message);
+    g_test_add_func("/syncmembers/flush_on_second_change",
+            test_flush_on_second_change);
+
+    return g_test_run();
+}